@@ -122,8 +122,8 @@ log_annoying (char *fmt0, ...)
 }
 #endif
 
-int
-server_socket (struct in_addr addr, int port, int backlog)
+static int
+listen_socket (struct in_addr addr, int port, int backlog, int shared)
 {
   struct sockaddr_in address;
   int i, s;
@@ -139,6 +139,23 @@ server_socket (struct in_addr addr, int port, int backlog)
 		 strerror (errno));
     }
 
+  /* Every socket bound to the port must ask for sharing it. */
+  if (shared)
+    {
+#ifdef SO_REUSEPORT
+      if (setsockopt (s, SOL_SOCKET, SO_REUSEPORT,
+		      (void *)&i, sizeof i) == -1)
+#else
+      errno = ENOSYS;
+#endif
+	{
+	  log_error ("server_socket: setsockopt SO_REUSEPORT: %s",
+		     strerror (errno));
+	  close (s);
+	  return -1;
+	}
+    }
+
   memset (&address, '\0', sizeof address);
 #if defined(__FreeBSD__) || defined(__OpenBSD__)
   address.sin_len = sizeof address;
@@ -162,6 +179,23 @@ server_socket (struct in_addr addr, int port, int backlog)
   return s;
 }
 
+int
+server_socket (struct in_addr addr, int port, int backlog)
+{
+  return listen_socket (addr, port, backlog, FALSE);
+}
+
+/*
+Like server_socket(), but other sockets made by this function may
+listen on the same port, and the kernel spreads connections over them.
+*/
+
+int
+server_socket_shared (struct in_addr addr, int port, int backlog)
+{
+  return listen_socket (addr, port, backlog, TRUE);
+}
+
 int
 set_address (struct sockaddr_in *address, const char *host, int port)
 {
@@ -222,6 +256,21 @@ open_device (char *device)
   return fd;
 }
 
+int
+set_nonblocking (int fd)
+{
+  int flags;
+
+  flags = fcntl (fd, F_GETFL);
+  if (flags == -1)
+    return -1;
+
+  if (flags & O_NONBLOCK)
+    return 0;
+
+  return fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 #ifdef DEBUG_MODE
 void
 dump_buf (FILE *f, unsigned char *buf, size_t len)
@@ -256,29 +305,16 @@ dump_buf (FILE *f, unsigned char *buf, size_t len)
 int
 handle_device_input (Tunnel *tunnel, int fd, int events)
 {
-  unsigned char buf[10240];
-  ssize_t n, m;
+  ssize_t n;
 
   if (events & POLLIN)
     {
-      n = read (fd, buf, sizeof buf);
-      if (n == 0 || n == -1)
-	{
-	  if (n == -1 && errno != EAGAIN)
-	    log_error ("handle_device_input: read() error: %s",
-		       strerror (errno));
-	  return n;
-	}
-
-#ifdef DEBUG_MODE
-      log_annoying ("read %d bytes from device:", n);
-      if (debug_level >= 5)
-	dump_buf (debug_file, buf, (size_t)n);
-#endif
-
-      m = tunnel_write (tunnel, buf, (size_t)n);
-      log_annoying ("tunnel_write (%p, %p, %d) = %d", tunnel, buf, n, m);
-      return m;
+      n = tunnel_write_from (tunnel, fd, TUNNEL_DATA_MAX);
+      log_annoying ("tunnel_write_from (%p, %d, %d) = %d",
+		    tunnel, fd, TUNNEL_DATA_MAX, n);
+      if (n == -1 && errno != EAGAIN)
+	log_error ("handle_device_input: error: %s", strerror (errno));
+      return n;
     }
   else if (events & POLLHUP)
     {
@@ -296,35 +332,63 @@ handle_device_input (Tunnel *tunnel, int fd, int events)
   return -1;
 }
 
+int
+handle_device_output (Tunnel *tunnel, int fd, int events)
+{
+  ssize_t n;
+
+  if (events & POLLOUT)
+    {
+      n = tunnel_flush_to (tunnel, fd);
+      log_annoying ("tunnel_flush_to (%p, %d) = %d", tunnel, fd, n);
+      if (n == -1)
+	{
+	  log_error ("handle_device_output: error: %s", strerror (errno));
+	  return -1;
+	}
+      /* Data still queued isn't the end of the device. */
+      return 1;
+    }
+  else if (events & POLLHUP)
+    log_error ("handle_device_output: POLLHUP");
+  else if (events & POLLERR)
+    log_error ("handle_device_output: POLLERR");
+  else
+    log_error ("handle_device_output: none of the above");
+
+  errno = EIO;
+  return -1;
+}
+
 int
 handle_tunnel_input (Tunnel *tunnel, int fd, int events)
 {
-  unsigned char buf[10240];
-  ssize_t n, m;
+  ssize_t n;
 
   if (events & POLLIN)
     {
-      n = tunnel_read (tunnel, buf, sizeof buf);
-      if (n <= 0)
+      /* Write everything the tunnel has buffered, since poll() won't
+       * report it.  If fd == 0, then we are using --stdin-stdout so
+       * write to stdout, not fd.  What it won't take is queued, and
+       * tunnel_pending() stops when too much is. */
+      do
 	{
-log_annoying ("handle_tunnel_input: tunnel_read() = %d\n", n);
-	  if (n == -1 && errno != EAGAIN)
-	    log_error ("handle_tunnel_input: tunnel_read() error: %s",
-		       strerror (errno));
-	  return n;
+	  n = tunnel_read_to (tunnel, fd ? fd : 1, TUNNEL_DATA_MAX);
+	  log_annoying ("tunnel_read_to (%p, %d, %d) = %d",
+			tunnel, fd ? fd : 1, TUNNEL_DATA_MAX, n);
+	  if (n == -1 && errno == EAGAIN)
+	    continue;
+	  else if (n <= 0)
+	    {
+	      if (n == -1)
+		log_error ("handle_tunnel_input: tunnel_read_to() error: %s",
+			   strerror (errno));
+	      return n;
+	    }
 	}
+      while (tunnel_pending (tunnel));
 
-#ifdef DEBUG_MODE
-      log_annoying ("read %d bytes from tunnel:", n);
-      if (debug_level >= 5)
-	dump_buf (debug_file, buf, (size_t)n);
-#endif
-
-      /* If fd == 0, then we are using --stdin-stdout so write to stdout,
-       * not fd. */
-      m = write_all (fd ? fd : 1, buf, (size_t)n);
-      log_annoying ("write_all (%d, %p, %d) = %d", fd ? fd : 1, buf, n, m);
-      return m;
+      return n;
     }
   else if (events & POLLHUP)
     log_error ("handle_device_input: POLLHUP");
@@ -16,6 +16,7 @@ Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
 #include <string.h>
 #include <syslog_.h>
 #include <getopt.h>
+#include <sys/poll_.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -27,6 +28,7 @@ Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
 #define DEFAULT_CONTENT_LENGTH (100 * 1024) /* bytes */
 #define DEFAULT_KEEP_ALIVE 5 /* seconds */
 #define DEFAULT_MAX_CONNECTION_AGE 300 /* seconds */
+#define DEFAULT_STANDBY_THRESHOLD 75 /* percent of Content-Length */
 #define DEFAULT_BASE_URI "/index.html?crap="
 #define BUG_REPORT_EMAIL "bug-httptunnel@gnu.org"
 
@@ -59,51 +61,76 @@ static inline void log_annoying () {}
 #endif
 
 extern int server_socket (struct in_addr addr, int port, int backlog);
+extern int server_socket_shared (struct in_addr addr, int port,
+				 int backlog);
 extern int set_address (struct sockaddr_in *address,
 			const char *host, int port);
 extern int open_device (char *device);
+extern int set_nonblocking (int fd);
 extern int handle_device_input (Tunnel *tunnel, int fd, int events);
+extern int handle_device_output (Tunnel *tunnel, int fd, int events);
 extern int handle_tunnel_input (Tunnel *tunnel, int fd, int events);
 extern void name_and_port (const char *nameport, char **name, int *port);
 extern int atoi_with_postfix (const char *s_);
 extern RETSIGTYPE log_sigpipe (int);
 void dump_buf (FILE *f, unsigned char *buf, size_t len);
 
+/*
+Wait until FD is ready for EVENTS, or at most TIMEOUT milliseconds.
+Used on nonblocking descriptors when a read or write returns EAGAIN.
+*/
+
+static inline int
+wait_for_fd_timeout (int fd, int events, int timeout)
+{
+  struct pollfd p;
+  int n;
+
+  p.fd = fd;
+  p.events = events;
+  do
+    n = poll (&p, 1, timeout);
+  while (n == -1 && errno == EINTR);
+
+  return n;
+}
+
+static inline int
+wait_for_fd (int fd, int events)
+{
+  return wait_for_fd_timeout (fd, events, -1);
+}
+
+/*
+Read exactly LEN bytes.  The descriptor's blocking mode is left alone:
+it is set once when the descriptor is created, and if it's nonblocking
+this waits with poll() instead.
+*/
+
 static inline ssize_t
 read_all (int fd, void *buf, size_t len)
 {
-  ssize_t n, m, r;
-  long flags;
+  ssize_t n, m;
   char *rbuf = buf;
 
-  flags = fcntl (fd, F_GETFL);
-  fcntl (fd, F_SETFL, flags & ~O_NONBLOCK);
-
-  r = len;
   for (n = 0; n < len; n += m)
     {
       log_annoying ("read (%d, %p, %d) ...", fd, rbuf + n, len - n);
       m = read (fd, rbuf + n, len - n);
       log_annoying ("... = %d", m);
       if (m == 0)
-	{
-	  r = 0;
-	  break;
-	}
+	return 0;
       else if (m == -1)
 	{
-	  if (errno != EAGAIN)
-	    {
-	      r = -1;
-	      break;
-	    }
-	  else
-	    m = 0;
+	  if (errno != EAGAIN && errno != EINTR)
+	    return -1;
+	  if (errno == EAGAIN && wait_for_fd (fd, POLLIN) == -1)
+	    return -1;
+	  m = 0;
 	}
     }
 
-  fcntl (fd, F_SETFL, flags);
-  return r;
+  return len;
 }
 
 static inline ssize_t
@@ -121,18 +148,21 @@ write_all (int fd, void *data, size_t len)
 	return 0;
       else if (m == -1)
 	{
-	  if (errno != EAGAIN)
+	  if (errno != EAGAIN && errno != EINTR)
 	    return -1;
-	  else
-	    m = 0;
+	  if (errno == EAGAIN && wait_for_fd (fd, POLLOUT) == -1)
+	    return -1;
+	  m = 0;
 	}
     }
 
   return len;
 }
 
+/* Start connecting to ADDRESS without waiting for it.  The socket
+   polls writable once it's done; connect_result() tells how it went. */
 static inline int
-do_connect (struct sockaddr_in *address)
+do_connect_nonblocking (struct sockaddr_in *address)
 {
   int fd;
 
@@ -140,8 +170,9 @@ do_connect (struct sockaddr_in *address)
   if (fd == -1)
     return -1;
 
-  if (connect (fd, (struct sockaddr *)address,
-	       sizeof (struct sockaddr_in)) == -1)
+  if (set_nonblocking (fd) == -1 ||
+      (connect (fd, (struct sockaddr *)address,
+		sizeof (struct sockaddr_in)) == -1 && errno != EINPROGRESS))
     {
       close (fd);
       return -1;
@@ -150,6 +181,23 @@ do_connect (struct sockaddr_in *address)
   return fd;
 }
 
+static inline int
+connect_result (int fd)
+{
+  socklen_t length = sizeof (int);
+  int error;
+
+  if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+    return -1;
+  if (error != 0)
+    {
+      errno = error;
+      return -1;
+    }
+
+  return 0;
+}
+
 static inline void
 handle_input (const char *type, Tunnel *tunnel, int fd, int events,
 	      int (*handler)(Tunnel *tunnel, int fd, int events),
@@ -0,0 +1,547 @@
+/*
+event.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+See event.h for some documentation about the programming interface.
+*/
+
+#include "config.h"
+#include <time.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "event.h"
+#include "common.h"
+
+#define WHEEL_SIZE 1024 /* slots, EVENT_TICK milliseconds each */
+#define MAX_EVENTS 64 /* events per epoll_wait() */
+
+/* A registered file descriptor.  GENERATION tells apart registrations
+   of a reused descriptor number. */
+typedef struct
+{
+  Event_handler *handler;
+  void *data;
+  int events;
+  int polled;
+  unsigned int generation;
+} Event_fd;
+
+struct event_loop
+{
+  Event_fd *fds;
+  int fds_size;
+#ifdef HAVE_SYS_EPOLL_H
+  int epoll_fd;
+#else
+  struct pollfd *pollfd;
+  unsigned int *pollfd_generation;
+  int pollfd_size;
+  int pollfd_count;
+  int pollfd_dirty;
+#endif
+  Event_timer wheel[WHEEL_SIZE];
+  unsigned long tick;
+};
+
+/*
+Return the time in ticks since the first call.
+*/
+
+static unsigned long
+event_now (void)
+{
+  static long start_sec = -1;
+  long sec, usec;
+
+#if defined (HAVE_CLOCK_GETTIME) && defined (CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  sec = ts.tv_sec;
+  usec = ts.tv_nsec / 1000;
+#else
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  sec = tv.tv_sec;
+  usec = tv.tv_usec;
+#endif
+
+  if (start_sec == -1 || sec < start_sec)
+    start_sec = sec;
+
+  return ((unsigned long)(sec - start_sec) * (1000 / EVENT_TICK) +
+	  usec / (1000 * EVENT_TICK));
+}
+
+static inline void
+event_timer_link (Event_timer *head, Event_timer *timer)
+{
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+static inline void
+event_timer_unlink (Event_timer *timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+}
+
+Event_loop *
+event_loop_new (void)
+{
+  Event_loop *loop;
+  int i;
+
+  loop = malloc (sizeof (Event_loop));
+  if (loop == NULL)
+    {
+      log_error ("event_loop_new: out of memory");
+      return NULL;
+    }
+
+  loop->fds = NULL;
+  loop->fds_size = 0;
+#ifdef HAVE_SYS_EPOLL_H
+  loop->epoll_fd = epoll_create (MAX_EVENTS);
+  if (loop->epoll_fd == -1)
+    {
+      log_error ("event_loop_new: epoll_create error: %s", strerror (errno));
+      free (loop);
+      return NULL;
+    }
+  log_debug ("event_loop_new: using epoll");
+#else
+  loop->pollfd = NULL;
+  loop->pollfd_generation = NULL;
+  loop->pollfd_size = 0;
+  loop->pollfd_count = 0;
+  loop->pollfd_dirty = FALSE;
+  log_debug ("event_loop_new: using poll");
+#endif
+
+  for (i = 0; i < WHEEL_SIZE; i++)
+    loop->wheel[i].next = loop->wheel[i].prev = &loop->wheel[i];
+  loop->tick = event_now ();
+
+  return loop;
+}
+
+void
+event_loop_destroy (Event_loop *loop)
+{
+  int i;
+
+  for (i = 0; i < WHEEL_SIZE; i++)
+    while (loop->wheel[i].next != &loop->wheel[i])
+      event_timer_unlink (loop->wheel[i].next);
+
+#ifdef HAVE_SYS_EPOLL_H
+  close (loop->epoll_fd);
+#else
+  if (loop->pollfd)
+    free (loop->pollfd);
+  if (loop->pollfd_generation)
+    free (loop->pollfd_generation);
+#endif
+  if (loop->fds)
+    free (loop->fds);
+  free (loop);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int
+event_epoll_ctl (Event_loop *loop, int fd, int events)
+{
+  Event_fd *e = &loop->fds[fd];
+  struct epoll_event ev;
+  int op;
+
+  ev.events = 0;
+  if (events & POLLIN)
+    ev.events |= EPOLLIN;
+  if (events & POLLOUT)
+    ev.events |= EPOLLOUT;
+  ev.data.u64 = (unsigned long long)e->generation << 32 | fd;
+
+  /* Descriptors not polled for anything are left out of the epoll
+     set, so that hangups on them don't wake the loop. */
+  if (events == 0)
+    {
+      if (!e->polled)
+	return 0;
+      op = EPOLL_CTL_DEL;
+    }
+  else
+    op = e->polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+  if (epoll_ctl (loop->epoll_fd, op, fd, &ev) == -1)
+    {
+      if (op == EPOLL_CTL_ADD && errno == EEXIST)
+	op = EPOLL_CTL_MOD;
+      else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+	op = EPOLL_CTL_ADD;
+      else if (op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+	{
+	  e->polled = FALSE;
+	  return 0;
+	}
+      else
+	op = -1;
+
+      if (op == -1 || epoll_ctl (loop->epoll_fd, op, fd, &ev) == -1)
+	{
+	  log_error ("event_epoll_ctl: epoll_ctl (%d) error: %s",
+		     fd, strerror (errno));
+	  return -1;
+	}
+    }
+
+  e->polled = events != 0;
+  return 0;
+}
+#endif
+
+int
+event_add (Event_loop *loop, int fd, int events,
+	   Event_handler *handler, void *data)
+{
+  Event_fd *e;
+
+  if (fd < 0)
+    {
+      errno = EBADF;
+      return -1;
+    }
+
+  if (fd >= loop->fds_size)
+    {
+      int size = fd + 64;
+      int i;
+
+      e = realloc (loop->fds, size * sizeof (Event_fd));
+      if (e == NULL)
+	{
+	  log_error ("event_add: out of memory");
+	  errno = ENOMEM;
+	  return -1;
+	}
+      for (i = loop->fds_size; i < size; i++)
+	{
+	  e[i].handler = NULL;
+	  e[i].polled = FALSE;
+	  e[i].generation = 0;
+	}
+      loop->fds = e;
+      loop->fds_size = size;
+    }
+
+  e = &loop->fds[fd];
+  if (e->handler != NULL)
+    log_debug ("event_add: fd %d was already registered", fd);
+  e->handler = handler;
+  e->data = data;
+  e->events = events;
+  e->generation++;
+  log_annoying ("event_add: fd %d, events %x", fd, events);
+
+#ifdef HAVE_SYS_EPOLL_H
+  if (event_epoll_ctl (loop, fd, events) == -1)
+    {
+      e->handler = NULL;
+      return -1;
+    }
+#else
+  loop->pollfd_dirty = TRUE;
+#endif
+
+  return 0;
+}
+
+int
+event_modify (Event_loop *loop, int fd, int events)
+{
+  Event_fd *e;
+
+  if (fd < 0 || fd >= loop->fds_size || loop->fds[fd].handler == NULL)
+    {
+      log_error ("event_modify: fd %d is not registered", fd);
+      errno = EBADF;
+      return -1;
+    }
+
+  e = &loop->fds[fd];
+  if (e->events == events)
+    return 0;
+  e->events = events;
+  log_annoying ("event_modify: fd %d, events %x", fd, events);
+
+#ifdef HAVE_SYS_EPOLL_H
+  return event_epoll_ctl (loop, fd, events);
+#else
+  loop->pollfd_dirty = TRUE;
+  return 0;
+#endif
+}
+
+void
+event_remove (Event_loop *loop, int fd)
+{
+  if (fd < 0 || fd >= loop->fds_size || loop->fds[fd].handler == NULL)
+    return;
+
+  log_annoying ("event_remove: fd %d", fd);
+#ifdef HAVE_SYS_EPOLL_H
+  event_epoll_ctl (loop, fd, 0);
+#else
+  loop->pollfd_dirty = TRUE;
+#endif
+  loop->fds[fd].handler = NULL;
+  loop->fds[fd].events = 0;
+}
+
+void
+event_timer_init (Event_timer *timer, Event_timer_handler *handler,
+		  void *data)
+{
+  timer->next = timer->prev = NULL;
+  timer->expires = 0;
+  timer->handler = handler;
+  timer->data = data;
+}
+
+int
+event_timer_is_set (Event_timer *timer)
+{
+  return timer->next != NULL;
+}
+
+void
+event_timer_cancel (Event_timer *timer)
+{
+  if (event_timer_is_set (timer))
+    event_timer_unlink (timer);
+}
+
+void
+event_timer_set (Event_loop *loop, Event_timer *timer, int ms)
+{
+  unsigned long expires;
+
+  if (event_timer_is_set (timer))
+    event_timer_unlink (timer);
+
+  if (ms < 0)
+    ms = 0;
+  expires = event_now () + (ms + EVENT_TICK - 1) / EVENT_TICK;
+  /* Slots up to the current tick have already been run. */
+  if (expires <= loop->tick)
+    expires = loop->tick + 1;
+
+  timer->expires = expires;
+  event_timer_link (&loop->wheel[expires % WHEEL_SIZE], timer);
+}
+
+/*
+Return the number of milliseconds until the nearest non-empty slot in
+the wheel, or -1 if there are no timers.  A timer in that slot may be
+due only after further turns of the wheel; the loop then wakes up
+early, once per turn.
+*/
+
+static int
+event_timeout (Event_loop *loop)
+{
+  unsigned long now = event_now ();
+  unsigned long t;
+
+  for (t = loop->tick + 1; t <= loop->tick + WHEEL_SIZE; t++)
+    {
+      Event_timer *head = &loop->wheel[t % WHEEL_SIZE];
+
+      if (head->next != head)
+	return t <= now ? 0 : (t - now) * EVENT_TICK;
+    }
+
+  return -1;
+}
+
+static void
+event_run_timers (Event_loop *loop)
+{
+  unsigned long now = event_now ();
+  Event_timer expired;
+  unsigned long t;
+
+  if (now <= loop->tick)
+    return;
+
+  /* Collect due timers first, since handlers may set timers. */
+  expired.next = expired.prev = &expired;
+  for (t = loop->tick + 1;
+       t <= now && t <= loop->tick + WHEEL_SIZE;
+       t++)
+    {
+      Event_timer *head = &loop->wheel[t % WHEEL_SIZE];
+      Event_timer *timer, *next;
+
+      for (timer = head->next; timer != head; timer = next)
+	{
+	  next = timer->next;
+	  if (timer->expires <= now)
+	    {
+	      event_timer_unlink (timer);
+	      event_timer_link (&expired, timer);
+	    }
+	}
+    }
+  loop->tick = now;
+
+  while (expired.next != &expired)
+    {
+      Event_timer *timer = expired.next;
+
+      event_timer_unlink (timer);
+      timer->handler (loop, timer->data);
+    }
+}
+
+static void
+event_call (Event_loop *loop, int fd, unsigned int generation, int revents)
+{
+  Event_fd *e;
+
+  if (fd >= loop->fds_size)
+    return;
+
+  e = &loop->fds[fd];
+  if (e->handler == NULL || e->generation != generation)
+    return;
+
+  revents &= e->events | POLLHUP | POLLERR | POLLNVAL;
+  if (revents == 0 || e->events == 0)
+    return;
+
+  e->handler (loop, fd, revents, e->data);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+int
+event_dispatch (Event_loop *loop)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int i, n;
+
+  log_annoying ("epoll_wait () ...");
+  n = epoll_wait (loop->epoll_fd, events, MAX_EVENTS, event_timeout (loop));
+  log_annoying ("... = %d", n);
+  if (n == -1 && errno != EINTR)
+    {
+      log_error ("event_dispatch: epoll_wait error: %s", strerror (errno));
+      return -1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      int revents = 0;
+
+      if (events[i].events & EPOLLIN)
+	revents |= POLLIN;
+      if (events[i].events & EPOLLOUT)
+	revents |= POLLOUT;
+      if (events[i].events & EPOLLHUP)
+	revents |= POLLHUP;
+      if (events[i].events & EPOLLERR)
+	revents |= POLLERR;
+
+      event_call (loop, (int)(events[i].data.u64 & 0xffffffff),
+		  (unsigned int)(events[i].data.u64 >> 32), revents);
+    }
+
+  event_run_timers (loop);
+  return 0;
+}
+#else
+static int
+event_build_pollfd (Event_loop *loop)
+{
+  int i, n;
+
+  for (i = 0, n = 0; i < loop->fds_size; i++)
+    if (loop->fds[i].handler != NULL && loop->fds[i].events != 0)
+      n++;
+
+  if (n > loop->pollfd_size)
+    {
+      struct pollfd *p;
+      unsigned int *g;
+
+      p = realloc (loop->pollfd, n * sizeof (struct pollfd));
+      if (p != NULL)
+	loop->pollfd = p;
+      g = realloc (loop->pollfd_generation, n * sizeof (unsigned int));
+      if (g != NULL)
+	loop->pollfd_generation = g;
+      if (p == NULL || g == NULL)
+	{
+	  log_error ("event_build_pollfd: out of memory");
+	  errno = ENOMEM;
+	  return -1;
+	}
+      loop->pollfd_size = n;
+    }
+
+  for (i = 0, n = 0; i < loop->fds_size; i++)
+    if (loop->fds[i].handler != NULL && loop->fds[i].events != 0)
+      {
+	loop->pollfd[n].fd = i;
+	loop->pollfd[n].events = loop->fds[i].events;
+	loop->pollfd_generation[n] = loop->fds[i].generation;
+	n++;
+      }
+
+  loop->pollfd_count = n;
+  loop->pollfd_dirty = FALSE;
+  return 0;
+}
+
+int
+event_dispatch (Event_loop *loop)
+{
+  int i, n;
+
+  if (loop->pollfd_dirty && event_build_pollfd (loop) == -1)
+    return -1;
+
+  log_annoying ("poll () ...");
+  n = poll (loop->pollfd, loop->pollfd_count, event_timeout (loop));
+  log_annoying ("... = %d", n);
+  if (n == -1 && errno != EINTR)
+    {
+      log_error ("event_dispatch: poll error: %s", strerror (errno));
+      return -1;
+    }
+
+  /* Handlers may change the registrations, but LOOP->POLLFD is only
+     rebuilt before the next poll(). */
+  for (i = 0; n > 0 && i < loop->pollfd_count; i++)
+    if (loop->pollfd[i].revents)
+      {
+	n--;
+	event_call (loop, loop->pollfd[i].fd, loop->pollfd_generation[i],
+		    loop->pollfd[i].revents);
+      }
+
+  event_run_timers (loop);
+  return 0;
+}
+#endif
@@ -0,0 +1,93 @@
+/*
+event.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+This is the interface to the event loop that drives hts and htc.  It
+consists of the following functions:
+
+Event_loop *event_loop_new (void);
+
+  Create a new event loop.  epoll() is used if available, otherwise
+  poll().
+
+int event_add (Event_loop *loop, int fd, int events,
+               Event_handler *handler, void *data);
+
+  Call HANDLER (LOOP, FD, REVENTS, DATA) whenever FD is ready for any
+  of EVENTS (POLLIN, POLLOUT).  EVENTS may be 0 to keep FD registered
+  without polling it.  POLLHUP, POLLERR and POLLNVAL are reported even
+  if not asked for.
+
+int event_modify (Event_loop *loop, int fd, int events);
+
+  Change the events polled for on FD.
+
+void event_remove (Event_loop *loop, int fd);
+
+  Stop polling FD.  This must be done before FD is closed.  Pending
+  events for FD are dropped, even if they were already received.
+
+void event_timer_init (Event_timer *timer,
+                       Event_timer_handler *handler, void *data);
+
+  Initialize TIMER, which will call HANDLER (LOOP, DATA) when it
+  expires.
+
+void event_timer_set (Event_loop *loop, Event_timer *timer, int ms);
+
+  Make TIMER expire once, in MS milliseconds.  A timer that is
+  already set is moved.  Timers are kept in a timer wheel, so this is
+  cheap, and accurate to EVENT_TICK milliseconds.
+
+void event_timer_cancel (Event_timer *timer);
+int event_timer_is_set (Event_timer *timer);
+
+  Cancel TIMER, or check whether it's set.
+
+int event_dispatch (Event_loop *loop);
+
+  Wait for the next events or timers, and call their handlers.
+  Return -1 on error.
+
+void event_loop_destroy (Event_loop *loop);
+
+  Free all resources associated with the loop.  File descriptors
+  aren't closed.  */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "config.h"
+#include <sys/poll_.h>
+
+#define EVENT_TICK 1 /* milliseconds; fine enough for htc --coalesce */
+
+typedef struct event_loop Event_loop;
+typedef struct event_timer Event_timer;
+
+typedef void Event_handler (Event_loop *loop, int fd, int events, void *data);
+typedef void Event_timer_handler (Event_loop *loop, void *data);
+
+struct event_timer
+{
+  Event_timer *next, *prev;
+  unsigned long expires; /* ticks */
+  Event_timer_handler *handler;
+  void *data;
+};
+
+extern Event_loop *event_loop_new (void);
+extern int event_add (Event_loop *loop, int fd, int events,
+		      Event_handler *handler, void *data);
+extern int event_modify (Event_loop *loop, int fd, int events);
+extern void event_remove (Event_loop *loop, int fd);
+extern void event_timer_init (Event_timer *timer,
+			      Event_timer_handler *handler, void *data);
+extern void event_timer_set (Event_loop *loop, Event_timer *timer, int ms);
+extern void event_timer_cancel (Event_timer *timer);
+extern int event_timer_is_set (Event_timer *timer);
+extern int event_dispatch (Event_loop *loop);
+extern void event_loop_destroy (Event_loop *loop);
+
+#endif /* EVENT_H */
@@ -18,9 +18,15 @@ two-way data path tunneled in HTTP requests.
 
 #include "common.h"
 #include "base64.h"
+#include "event.h"
+#include "mux.h"
 
 #define DEFAULT_PROXY_PORT 8080
 #define DEFAULT_PROXY_BUFFER_TIMEOUT 500 /* milliseconds */
+#define MULTIPLEX_ANSWER_TIMEOUT 10 /* seconds */
+#define POOL_MAX 64
+#define POOL_RETRY 5 /* seconds */
+#define DRAIN_TIMEOUT 10 /* seconds */
 
 typedef struct
 {
@@ -39,6 +45,13 @@ typedef struct
   int strict_content_length;
   int keep_alive;
   int max_connection_age;
+  int standby_threshold;
+  int persistent;
+  int chunked;
+  int coalesce_window;
+  int compress_level;
+  int multiplex;
+  int pool;
   char *proxy_authorization;
   char *user_agent;
   const char *base_uri;
@@ -47,6 +60,38 @@ typedef struct
 #define NO_PROXY_BUFFER 0
 #define NO_PROXY (NULL)
 
+/* The tunnel being served, and the device or port it's forwarded to.
+   With --multiplex, FD is the socket listening on the port, and the
+   connections to it are streams in MUX.
+   With --pool, a Client without FD is a tunnel opened in advance. */
+typedef struct client
+{
+  Arguments *arg;
+  Event_loop *loop;
+  Tunnel *tunnel;
+  int fd;
+  Mux *mux;
+  int accepting;			/* FD is polled for connections */
+  int out_polled;		/* tunnel data is queued for the device */
+  int in_fd;			/* tunnel_pollin_fd() as registered */
+  unsigned int in_generation;
+  int out_fd;			/* tunnel_pollout_fd() as registered */
+  unsigned int out_generation;
+  int closed;
+  int draining;			/* closed, and the tunnel output is written */
+  Event_timer keep_alive;
+  Event_timer proxy_buffer;
+  Event_timer multiplex_answer;
+  Event_timer drain;
+  Event_timer coalesce;
+  struct client *next;		/* in the pool */
+} Client;
+
+static Client *pool = NULL;	/* oldest first */
+static int pool_count = 0;
+static Event_timer pool_refill;
+static int served = 0;		/* Clients not in the pool */
+
 int debug_level = 0;
 FILE *debug_file = NULL;
 
@@ -65,6 +110,8 @@ usage (FILE *f, const char *me)
 "                                 (k, M, and G postfixes recognized)\n"
 "  -c, --content-length BYTES     use HTTP PUT requests of BYTES size\n"
 "                                 (k, M, and G postfixes recognized)\n"
+"  -C, --persistent               reuse connections for several requests\n"
+"                                 (implies --strict-content-length)\n"
 "  -d, --device DEVICE            use DEVICE for input and output\n"
 #ifdef DEBUG_MODE
 "  -D, --debug [LEVEL]            enable debugging mode\n"
@@ -76,15 +123,31 @@ usage (FILE *f, const char *me)
 #ifdef DEBUG_MODE
 "  -l, --logfile FILE             specify file for debugging output\n"
 #endif
+"  -m, --multiplex                carry all connections to the forwarded\n"
+"                                 port in one tunnel\n"
 "  -M, --max-connection-age SEC   maximum time a connection will stay\n"
 "                                 open is SEC seconds (default is %d)\n"
+"  -n, --no-multiplex             make a new tunnel for each connection to\n"
+"                                 the forwarded port (the default)\n"
+"  -N, --standby-threshold PERCENT  connect the next request when PERCENT\n"
+"                                 of Content-Length is sent (default is %d)\n"
+"  -p, --pool N                   keep N tunnels open in advance for\n"
+"                                 connections to the forwarded port, when\n"
+"                                 they aren't multiplexed, and serve those\n"
+"                                 connections at the same time\n"
 "  -P, --proxy HOSTNAME[:PORT]    use a HTTP proxy (default port is %d)\n"
 "  -s, --stdin-stdout             use stdin/stdout for communication\n"
 "                                 (implies --no-daemon)\n"
 "  -S, --strict-content-length    always write Content-Length bytes in requests\n"
+"  -t, --chunked                  use chunked Transfer-Encoding instead of\n"
+"                                 Content-Length\n"
 "  -T, --timeout TIME             timeout, in milliseconds, before sending\n"
 "                                 padding to a buffering proxy\n"
 "  -U, --user-agent STRING        specify User-Agent value in HTTP requests\n"
+"  -W, --coalesce USEC            wait up to USEC microseconds for more\n"
+"                                 input to send along with what's read\n"
+"  -Z, --compress LEVEL           compress tunnel data at LEVEL, 1 to 9\n"
+"                                 (default is 0, no compression)\n"
 "  -R, --base-uri STRING          specify a URI value for all HTTP requests\n"
 "                                 (default is \"%s\")\n"
 "  -V, --version                  output version information and exit\n"
@@ -92,8 +155,8 @@ usage (FILE *f, const char *me)
 "\n"
 "Report bugs to %s.\n",
 	   me, DEFAULT_HOST_PORT, DEFAULT_KEEP_ALIVE,
-	   DEFAULT_MAX_CONNECTION_AGE, DEFAULT_PROXY_PORT,
-	   DEFAULT_BASE_URI, BUG_REPORT_EMAIL);
+	   DEFAULT_MAX_CONNECTION_AGE, DEFAULT_STANDBY_THRESHOLD,
+	   DEFAULT_PROXY_PORT, DEFAULT_BASE_URI, BUG_REPORT_EMAIL);
 }
 
 static int
@@ -111,6 +174,466 @@ wait_for_connection_on_socket (int s)
   return t;
 }
 
+static void client_update (Event_loop *loop, Client *client);
+
+/*
+Stop writing to the device of a closed CLIENT, and close it.
+*/
+
+static void
+client_device_close (Client *client)
+{
+  if (client->fd == -1)
+    return;
+
+  event_remove (client->loop, client->fd ? client->fd : 1);
+  if (client->fd > 0)
+    close (client->fd);
+  client->fd = -1;
+}
+
+/*
+Write what's queued for the device of a closed CLIENT when it can
+take it.
+*/
+
+static void
+client_device_drain (Event_loop *loop, int fd, int events, void *data)
+{
+  Client *client = data;
+
+  if (tunnel_flush_to (client->tunnel, fd) == -1)
+    log_error ("couldn't write %d bytes to device or port: %s",
+	       tunnel_queued (client->tunnel), strerror (errno));
+  else if (tunnel_queued (client->tunnel) > 0)
+    return;
+
+  client_device_close (client);
+  client_update (loop, client);
+}
+
+/*
+Close CLIENT.  The server and the device are given a while to take
+the rest of their output before it's destroyed.
+*/
+
+static void
+client_shutdown (Client *client)
+{
+  Event_loop *loop = client->loop;
+  Arguments *arg = client->arg;
+
+  event_timer_cancel (&client->keep_alive);
+  event_timer_cancel (&client->proxy_buffer);
+  event_timer_cancel (&client->multiplex_answer);
+  event_timer_cancel (&client->coalesce);
+  if (client->in_fd != -1)
+    event_remove (loop, client->in_fd);
+  client->in_fd = -1;
+  if (client->mux == NULL || client->accepting)
+    event_remove (loop, client->fd);
+  if (client->out_polled && client->fd == 0)
+    event_remove (loop, 1);
+  client->out_polled = FALSE;
+
+  log_debug ("destroying tunnel");
+  /* FD may be the socket listening on the port. */
+  if (client->mux != NULL || client->accepting)
+    client->fd = -1;
+  if (client->mux != NULL)
+    mux_destroy (client->mux);
+  client->mux = NULL;
+
+  /* What the device hasn't taken yet is written as it takes it. */
+  if (client->fd != -1 && tunnel_queued (client->tunnel) > 0 &&
+      event_add (loop, client->fd ? client->fd : 1, POLLOUT,
+		 client_device_drain, client) == 0)
+    log_debug ("%d bytes left to write to device or port",
+	       tunnel_queued (client->tunnel));
+  else
+    client_device_close (client);
+
+  tunnel_close (client->tunnel);
+  if (arg->proxy_name)
+    log_notice ("disconnected from %s:%d via %s:%d",
+		arg->host_name, arg->host_port,
+		arg->proxy_name, arg->proxy_port);
+  else
+    log_notice ("disconnected from %s:%d", arg->host_name, arg->host_port);
+  client->draining = TRUE;
+  event_timer_set (loop, &client->drain, 1000 * DRAIN_TIMEOUT);
+}
+
+static void
+client_destroy (Client *client)
+{
+  Arguments *arg = client->arg;
+  Client **cp;
+  int opened;
+
+  if (!client->draining)
+    client_shutdown (client);
+  client_device_close (client);
+
+  event_timer_cancel (&client->drain);
+  if (client->out_fd != -1)
+    event_remove (client->loop, client->out_fd);
+  opened = tunnel_is_attached (client->tunnel);
+  tunnel_destroy (client->tunnel);
+
+  for (cp = &pool; *cp != NULL && *cp != client; cp = &(*cp)->next)
+    ;
+  if (*cp != NULL)
+    {
+      /* Try again later if the server can't be reached. */
+      *cp = client->next;
+      pool_count--;
+      event_timer_set (client->loop, &pool_refill,
+		       opened ? 0 : 1000 * POOL_RETRY);
+    }
+  else
+    served--;
+  free (client);
+
+  /* Without a pool to go on with, htc ends if the server can't be
+     reached. */
+  if (!opened && arg->pool == 0)
+    log_exit (1);
+}
+
+static void
+client_device_input (Event_loop *loop, int fd, int events, void *data)
+{
+  Client *client = data;
+
+  if (events & POLLOUT)
+    handle_input ("device or port", client->tunnel, fd, events,
+		  handle_device_output, &client->closed);
+  if (events & ~POLLOUT)
+    handle_input ("device or port", client->tunnel, fd, events,
+		  handle_device_input, &client->closed);
+  if (events & POLLIN)
+    event_timer_set (loop, &client->keep_alive,
+		     1000 * client->arg->keep_alive);
+  client_update (loop, client);
+}
+
+static void
+client_device_output (Event_loop *loop, int fd, int events, void *data)
+{
+  Client *client = data;
+
+  handle_input ("stdout", client->tunnel, fd, events,
+		handle_device_output, &client->closed);
+  client_update (loop, client);
+}
+
+/*
+Go on opening the tunnel of CLIENT.
+*/
+
+static void
+client_open (Client *client)
+{
+  Arguments *arg = client->arg;
+  int n;
+
+  n = tunnel_connect (client->tunnel);
+  if (n == -1)
+    {
+      log_error ("couldn't open tunnel: %s", strerror (errno));
+      client->closed = TRUE;
+    }
+  else if (n == 1 && arg->proxy_name)
+    log_notice ("connected to %s:%d via %s:%d",
+		arg->host_name, arg->host_port,
+		arg->proxy_name, arg->proxy_port);
+  else if (n == 1)
+    log_notice ("connected to %s:%d", arg->host_name, arg->host_port);
+}
+
+static void
+client_tunnel_input (Event_loop *loop, int fd, int events, void *data)
+{
+  Client *client = data;
+
+  /* While the input connection is being made, whatever poll() says
+     is for tunnel_read() to find out. */
+  if (tunnel_pollin_events (client->tunnel) == POLLOUT)
+    events = POLLIN;
+
+  if (!tunnel_is_attached (client->tunnel))
+    client_open (client);
+  else if (client->mux != NULL)
+    mux_tunnel_input (client->mux);
+  else
+    handle_input ("tunnel", client->tunnel, client->fd, events,
+		  handle_tunnel_input, &client->closed);
+  client_update (loop, client);
+}
+
+static void
+client_tunnel_output (Event_loop *loop, int fd, int events, void *data)
+{
+  Client *client = data;
+
+  if (tunnel_flush (client->tunnel) == -1)
+    {
+      log_error ("couldn't write to tunnel: %s", strerror (errno));
+      client->closed = TRUE;
+    }
+  client_update (loop, client);
+}
+
+/*
+The server or the device hasn't taken what was left to send when
+CLIENT closed.
+*/
+
+static void
+client_drain (Event_loop *loop, void *data)
+{
+  Client *client = data;
+
+  if (client->fd != -1)
+    log_error ("the device or port didn't take the rest of its data");
+  else
+    log_error ("the server didn't take the rest of the tunnel output");
+  client_destroy (client);
+}
+
+static void
+client_stream_input (void *data)
+{
+  Client *client = data;
+
+  event_timer_set (client->loop, &client->keep_alive,
+		   1000 * client->arg->keep_alive);
+  client_update (client->loop, client);
+}
+
+static void
+client_accept (Event_loop *loop, int fd, int events, void *data)
+{
+  Client *client = data;
+  int t;
+
+  t = wait_for_connection_on_socket (fd);
+  log_debug ("wait_for_connection_on_socket (%d) = %d", fd, t);
+  if (t == -1)
+    log_error ("couldn't forward port %d: %s",
+	       client->arg->forward_port, strerror (errno));
+  else if (mux_open (client->mux, t) == -1)
+    log_error ("couldn't open stream: %s", strerror (errno));
+
+  client_stream_input (client);
+}
+
+/*
+The server hasn't said whether it can multiplex.  It's too old to
+know how.
+*/
+
+static void
+client_multiplex_answer (Event_loop *loop, void *data)
+{
+  log_error ("the server didn't answer whether it can multiplex "
+	     "connections");
+  log_exit (1);
+}
+
+static void
+client_keep_alive (Event_loop *loop, void *data)
+{
+  Client *client = data;
+
+  log_verbose ("sending keep-alive");
+  tunnel_padding (client->tunnel, 1);
+  event_timer_set (loop, &client->keep_alive,
+		   1000 * client->arg->keep_alive);
+  client_update (loop, client);
+}
+
+static void
+client_proxy_buffer (Event_loop *loop, void *data)
+{
+  Client *client = data;
+
+  log_verbose ("proxy buffer timed out");
+  if (tunnel_maybe_pad (client->tunnel, client->arg->proxy_buffer_size) > 0)
+    event_timer_set (loop, &client->keep_alive,
+		     1000 * client->arg->keep_alive);
+  client_update (loop, client);
+}
+
+/*
+The coalescing window has passed since the tunnel began holding back
+device input.
+*/
+
+static void
+client_coalesce (Event_loop *loop, void *data)
+{
+  Client *client = data;
+
+  if (tunnel_write_held (client->tunnel) == -1)
+    {
+      log_error ("couldn't write to tunnel: %s", strerror (errno));
+      client->closed = TRUE;
+    }
+  client_update (loop, client);
+}
+
+static int
+client_poll_output (Client *client)
+{
+  int fd = tunnel_pollout_fd (client->tunnel);
+
+  if (fd == client->out_fd &&
+      tunnel_pollout_generation (client->tunnel) == client->out_generation)
+    return 0;
+  if (client->out_fd != -1)
+    event_remove (client->loop, client->out_fd);
+  client->out_fd = fd;
+  client->out_generation = tunnel_pollout_generation (client->tunnel);
+  if (fd != -1 &&
+      event_add (client->loop, fd, POLLOUT, client_tunnel_output,
+		 client) == -1)
+    {
+      log_error ("couldn't poll tunnel: %s", strerror (errno));
+      client->out_fd = -1;
+      return -1;
+    }
+  return 0;
+}
+
+/*
+Bring the event registrations up to date with the state of the
+tunnel, or destroy CLIENT if it has been closed.  This must be called
+after every call into the tunnel.
+*/
+
+static void
+client_update (Event_loop *loop, Client *client)
+{
+  int fd, waiting;
+
+  /* A closed client lingers until the server has taken the rest of
+     the tunnel output. */
+  if (client->closed)
+    {
+      if (!client->draining)
+	client_shutdown (client);
+      if ((tunnel_pollout_fd (client->tunnel) == -1 && client->fd == -1) ||
+	  client_poll_output (client) == -1)
+	client_destroy (client);
+      return;
+    }
+
+  if (client_poll_output (client) == -1)
+    {
+      client_destroy (client);
+      return;
+    }
+
+  /* Connections are accepted once the server agrees to carry them. */
+  if (client->mux != NULL && !client->accepting)
+    {
+      int multiplex = -1;
+
+      tunnel_getopt (client->tunnel, "multiplex", &multiplex);
+      if (multiplex == 0)
+	{
+	  log_error ("the server can't multiplex connections");
+	  log_exit (1);
+	}
+      else if (multiplex == 1)
+	{
+	  event_timer_cancel (&client->multiplex_answer);
+	  if (event_add (loop, client->fd, POLLIN,
+			 client_accept, client) == -1)
+	    {
+	      log_error ("couldn't poll port: %s", strerror (errno));
+	      client_destroy (client);
+	      return;
+	    }
+	  client->accepting = TRUE;
+	}
+    }
+
+  /* Don't read the tunnel while the device is slow to take its data,
+     or before there is a device, once it's open. */
+  waiting = client->mux == NULL && client->fd == -1;
+  if (tunnel_queued (client->tunnel) > TUNNEL_QUEUE_MAX ||
+      (waiting && tunnel_is_attached (client->tunnel)))
+    fd = -1;
+  else
+    fd = tunnel_pollin_fd (client->tunnel);
+  if (fd != client->in_fd ||
+      tunnel_pollin_generation (client->tunnel) != client->in_generation)
+    {
+      if (client->in_fd != -1)
+	event_remove (loop, client->in_fd);
+      client->in_fd = fd;
+      client->in_generation = tunnel_pollin_generation (client->tunnel);
+      if (fd != -1 &&
+	  event_add (loop, fd, tunnel_pollin_events (client->tunnel),
+		     client_tunnel_input, client) == -1)
+	{
+	  log_error ("couldn't poll tunnel: %s", strerror (errno));
+	  client->in_fd = -1;
+	  client_destroy (client);
+	  return;
+	}
+    }
+
+  /* Don't read more than the tunnel can take.  Write what's queued
+     for the device when it can take it; with --stdin-stdout, that's
+     stdout. */
+  if (client->mux != NULL)
+    mux_set_input (client->mux, tunnel_can_write (client->tunnel));
+  else if (!waiting)
+    {
+      int out = client->fd ? client->fd : 1;
+      int events = tunnel_can_write (client->tunnel) ? POLLIN : 0;
+
+      if ((tunnel_queued (client->tunnel) > 0) != client->out_polled)
+	{
+	  client->out_polled = !client->out_polled;
+	  if (out != client->fd && !client->out_polled)
+	    event_remove (loop, out);
+	  else if (out != client->fd &&
+		   event_add (loop, out, POLLOUT,
+			      client_device_output, client) == -1)
+	    {
+	      log_error ("couldn't poll stdout: %s", strerror (errno));
+	      client->out_polled = FALSE;
+	      client_destroy (client);
+	      return;
+	    }
+	}
+      if (out == client->fd && client->out_polled)
+	events |= POLLOUT;
+      event_modify (loop, client->fd, events);
+    }
+
+  /* Send what the tunnel holds back once the window has passed. */
+  if (tunnel_held (client->tunnel) == 0)
+    event_timer_cancel (&client->coalesce);
+  else if (!event_timer_is_set (&client->coalesce))
+    event_timer_set (loop, &client->coalesce,
+		     (client->arg->coalesce_window + 999) / 1000);
+
+  /* Pad the request if nothing happens for a while. */
+  if (client->arg->proxy_buffer_timeout != -1)
+    event_timer_set (loop, &client->proxy_buffer,
+		     client->arg->proxy_buffer_timeout);
+
+  /* The tunnel's input buffer isn't visible to the event loop. */
+  if (!waiting && tunnel_pending (client->tunnel))
+    client_tunnel_input (loop, client->in_fd, POLLIN, client);
+}
+
 static void
 parse_arguments (int argc, char **argv, Arguments *arg)
 {
@@ -133,6 +656,13 @@ parse_arguments (int argc, char **argv, Arguments *arg)
   arg->strict_content_length = FALSE;
   arg->keep_alive = DEFAULT_KEEP_ALIVE;
   arg->max_connection_age = DEFAULT_CONNECTION_MAX_TIME;
+  arg->standby_threshold = DEFAULT_STANDBY_THRESHOLD;
+  arg->persistent = FALSE;
+  arg->chunked = FALSE;
+  arg->coalesce_window = 0;
+  arg->compress_level = 0;
+  arg->multiplex = FALSE;
+  arg->pool = 0;
   arg->proxy_authorization = NULL;
   arg->user_agent = NULL;
   arg->base_uri = DEFAULT_BASE_URI;
@@ -158,15 +688,23 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	{ "base-uri", required_argument, 0, 'R' },
 	{ "forward-port", required_argument, 0, 'F' },
 	{ "content-length", required_argument, 0, 'c' },
+	{ "persistent", no_argument, 0, 'C' },
 	{ "strict-content-length", no_argument, 0, 'S' },
+	{ "chunked", no_argument, 0, 't' },
+	{ "coalesce", required_argument, 0, 'W' },
+	{ "compress", required_argument, 0, 'Z' },
+	{ "multiplex", no_argument, 0, 'm' },
+	{ "no-multiplex", no_argument, 0, 'n' },
+	{ "pool", required_argument, 0, 'p' },
 	{ "proxy-buffer-size", required_argument, 0, 'B' },
 	{ "proxy-authorization", required_argument, 0, 'A' },
 	{ "max-connection-age", required_argument, 0, 'M' },
+	{ "standby-threshold", required_argument, 0, 'N' },
 	{ "proxy-authorization-file", required_argument, 0, 'z' },
 	{ 0, 0, 0, 0 }
       };
 
-      static const char *short_options = "A:B:c:d:F:hk:M:P:sST:U:R:Vwz:"
+      static const char *short_options = "A:B:c:Cd:F:hk:mM:nN:p:P:sStT:U:R:VwW:Z:z:"
 #ifdef DEBUG_MODE
 	"D:l:"
 #endif
@@ -198,6 +736,10 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	  arg->content_length = atoi_with_postfix (optarg);
 	  break;
 
+	case 'C':
+	  arg->persistent = TRUE;
+	  break;
+
 	case 'd':
 	  arg->device = optarg;
 	  break;
@@ -229,14 +771,30 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	  arg->keep_alive = atoi (optarg);
 	  break;
 
+	case 'm':
+	  arg->multiplex = TRUE;
+	  break;
+
 	case 'M':
 	  arg->max_connection_age = atoi (optarg);
 	  break;
 
+	case 'n':
+	  arg->multiplex = FALSE;
+	  break;
+
+	case 'N':
+	  arg->standby_threshold = atoi (optarg);
+	  break;
+
 	case 'h':
 	  usage (stdout, arg->me);
 	  exit (0);
 
+	case 'p':
+	  arg->pool = atoi (optarg);
+	  break;
+
 	case 'P':
 	  name_and_port (optarg, &arg->proxy_name, &arg->proxy_port);
 	  if (arg->proxy_port == -1)
@@ -254,6 +812,10 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	  arg->strict_content_length = TRUE;
 	  break;
 
+	case 't':
+	  arg->chunked = TRUE;
+	  break;
+
 	case 'T':
 	  arg->proxy_buffer_timeout = atoi (optarg);
 	  break;
@@ -262,6 +824,14 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	  arg->user_agent = optarg;
 	  break;
 
+	case 'W':
+	  arg->coalesce_window = atoi (optarg);
+	  break;
+
+	case 'Z':
+	  arg->compress_level = atoi (optarg);
+	  break;
+
 	case 'R':
 	  arg->base_uri = optarg;
 	  break;
@@ -361,6 +931,30 @@ parse_arguments (int argc, char **argv, Arguments *arg)
       exit (1);
     }
 
+  if (arg->multiplex && arg->forward_port == -1)
+    {
+      fprintf (stderr, "%s: --multiplex can only be used with --forward-port.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
+  if (arg->pool < 0 || arg->pool > POOL_MAX)
+    {
+      fprintf (stderr, "%s: --pool N must be 0 to %d.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, POOL_MAX, arg->me, arg->me);
+      exit (1);
+    }
+  if (arg->pool > 0 && (arg->forward_port == -1 || arg->multiplex))
+    {
+      fprintf (stderr, "%s: --pool can only be used with --forward-port, "
+		       "and not with --multiplex.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
   /* Removed test ((arg->device == NULL) == (arg->forward_port == -1))
    * by Sampo Niskanen - those have been tested already! */
   if (arg->host_name == NULL ||
@@ -371,6 +965,36 @@ parse_arguments (int argc, char **argv, Arguments *arg)
       exit (1);
     }
 
+  if (arg->coalesce_window < 0 || arg->coalesce_window > TUNNEL_COALESCE_MAX)
+    {
+      fprintf (stderr, "%s: --coalesce USEC must be 0 to %d.\n",
+	       arg->me, TUNNEL_COALESCE_MAX);
+      exit (1);
+    }
+
+  /* Streams are read by mux.c, not tunnel_write_from(). */
+  if (arg->coalesce_window > 0 && arg->multiplex)
+    {
+      fprintf (stderr, "%s: --coalesce can't be used with --multiplex.\n",
+	       arg->me);
+      exit (1);
+    }
+
+  if (arg->compress_level < 0 || arg->compress_level > 9)
+    {
+      fprintf (stderr, "%s: --compress LEVEL must be 0 to 9.\n",
+	       arg->me);
+      exit (1);
+    }
+#ifndef HAVE_LIBZ
+  if (arg->compress_level > 0)
+    {
+      fprintf (stderr, "%s: compression isn't supported; "
+	       "built without zlib\n", arg->me);
+      exit (1);
+    }
+#endif
+
   if (debug_level == 0 && debug_file != NULL)
     {
       fprintf (stderr, "%s: --logfile can't be used without debugging\n",
@@ -405,6 +1029,327 @@ parse_arguments (int argc, char **argv, Arguments *arg)
     arg->proxy_buffer_timeout = -1;
 }
 
+/*
+Create a tunnel as ARG says, and start opening it.  Return NULL if
+it can't be.
+*/
+
+static Tunnel *
+client_tunnel_new (Arguments *arg)
+{
+  Tunnel *tunnel;
+
+  log_debug ("creating a new tunnel");
+  tunnel = tunnel_new_client (arg->host_name, arg->host_port,
+			      arg->proxy_name, arg->proxy_port,
+			      arg->content_length);
+  if (tunnel == NULL)
+    {
+      log_error ("couldn't create tunnel");
+      log_exit (1);
+    }
+
+  if (tunnel_setopt (tunnel, "strict_content_length",
+		     &arg->strict_content_length) == -1)
+    log_debug ("tunnel_setopt strict_content_length error: %s",
+	       strerror (errno));
+
+  if (tunnel_setopt (tunnel, "keep_alive",
+		     &arg->keep_alive) == -1)
+    log_debug ("tunnel_setopt keep_alive error: %s", strerror (errno));
+
+  if (tunnel_setopt (tunnel, "max_connection_age",
+		     &arg->max_connection_age) == -1)
+    log_debug ("tunnel_setopt max_connection_age error: %s",
+	       strerror (errno));
+
+  if (tunnel_setopt (tunnel, "standby_threshold",
+		     &arg->standby_threshold) == -1)
+    log_debug ("tunnel_setopt standby_threshold error: %s",
+	       strerror (errno));
+
+  if (tunnel_setopt (tunnel, "persistent", &arg->persistent) == -1)
+    log_debug ("tunnel_setopt persistent error: %s", strerror (errno));
+
+  if (tunnel_setopt (tunnel, "chunked", &arg->chunked) == -1)
+    log_debug ("tunnel_setopt chunked error: %s", strerror (errno));
+
+  if (tunnel_setopt (tunnel, "coalesce_window",
+		     &arg->coalesce_window) == -1)
+    log_debug ("tunnel_setopt coalesce_window error: %s",
+	       strerror (errno));
+
+  if (tunnel_setopt (tunnel, "compression", &arg->compress_level) == -1)
+    log_debug ("tunnel_setopt compression error: %s", strerror (errno));
+
+  if (tunnel_setopt (tunnel, "multiplex", &arg->multiplex) == -1)
+    log_debug ("tunnel_setopt multiplex error: %s", strerror (errno));
+
+  if (arg->proxy_authorization != NULL)
+    {
+      ssize_t len;
+      char *auth;
+
+      len = encode_base64 (arg->proxy_authorization,
+			   strlen (arg->proxy_authorization),
+			   &auth);
+      if (len == -1)
+	{
+	  log_error ("encode_base64 error: %s", strerror (errno));
+	}
+      else
+	{
+	  char *str = malloc (len + 7);
+
+	  if (str == NULL)
+	    {
+	      log_error ("out of memory when encoding "
+			 "authorization string");
+	      log_exit (1);
+	    }
+
+	  strcpy (str, "Basic ");
+	  strcat (str, auth);
+	  free (auth);
+
+	  if (tunnel_setopt (tunnel, "proxy_authorization", str) == -1)
+	    log_error ("tunnel_setopt proxy_authorization error: %s",
+		       strerror (errno));
+
+	  free (str);
+	}
+    }
+
+  if (arg->user_agent != NULL)
+    {
+      if (tunnel_setopt (tunnel, "user_agent", arg->user_agent) == -1)
+	log_error ("tunnel_setopt user_agent error: %s",
+		   strerror (errno));
+    }
+
+  if (arg->base_uri != NULL)
+    {
+      if (tunnel_setopt (tunnel, "base_uri", (void *)arg->base_uri) == -1)
+	log_error ("tunnel_setopt base_uri error: %s",
+		   strerror (errno));
+    }
+
+  /* The rest is done by client_open(). */
+  if (tunnel_connect (tunnel) == -1)
+    {
+      log_error ("couldn't open tunnel: %s", strerror (errno));
+      tunnel_destroy (tunnel);
+      return NULL;
+    }
+
+  return tunnel;
+}
+
+/*
+Make a Client serving TUNNEL to FD, or -1 for none yet.
+*/
+
+static Client *
+client_new (Arguments *arg, Event_loop *loop, Tunnel *tunnel, int fd)
+{
+  Client *client;
+
+  client = malloc (sizeof (Client));
+  if (client == NULL)
+    {
+      log_error ("client_new: out of memory");
+      return NULL;
+    }
+
+  client->arg = arg;
+  client->loop = loop;
+  client->tunnel = tunnel;
+  client->fd = fd;
+  client->mux = NULL;
+  client->accepting = FALSE;
+  client->out_polled = FALSE;
+  client->in_fd = -1;
+  client->in_generation = 0;
+  client->out_fd = -1;
+  client->out_generation = 0;
+  client->closed = FALSE;
+  client->draining = FALSE;
+  client->next = NULL;
+  event_timer_init (&client->keep_alive, client_keep_alive, client);
+  event_timer_init (&client->proxy_buffer, client_proxy_buffer, client);
+  event_timer_init (&client->multiplex_answer, client_multiplex_answer,
+		    client);
+  event_timer_init (&client->drain, client_drain, client);
+  event_timer_init (&client->coalesce, client_coalesce, client);
+  event_timer_set (loop, &client->keep_alive, 1000 * arg->keep_alive);
+  return client;
+}
+
+/*
+Start serving CLIENT's device or port.  Return -1 on error.
+*/
+
+static int
+client_start (Client *client)
+{
+  Arguments *arg = client->arg;
+
+  if (arg->multiplex)
+    {
+      /* The port is polled when the server has answered. */
+      client->mux = mux_new (client->loop, client->tunnel, NULL,
+			     client_stream_input, client, &client->closed);
+      if (client->mux == NULL)
+	return -1;
+      event_timer_set (client->loop, &client->multiplex_answer,
+		       1000 * MULTIPLEX_ANSWER_TIMEOUT);
+      log_notice ("waiting for the server to multiplex connections");
+    }
+  else if (event_add (client->loop, client->fd, POLLIN,
+		      client_device_input, client) == -1)
+    {
+      log_error ("couldn't poll device or port: %s", strerror (errno));
+      return -1;
+    }
+
+  client_update (client->loop, client);
+  return 0;
+}
+
+/*
+With --pool, tunnels are opened before there are connections for
+them, as Clients without a device, and connections to the forwarded
+port are served at the same time.  hts connects to its destination
+for each tunnel, so a pooled tunnel may be closed by the destination
+before it's used.  Keep-alive requests keep the rest open.
+*/
+
+static void
+pool_refill_expired (Event_loop *loop, void *data)
+{
+  Arguments *arg = data;
+  Tunnel *tunnel;
+  Client *client, **cp;
+
+  /* Not needed while connections are multiplexed. */
+  if (pool_count >= arg->pool || arg->multiplex)
+    return;
+
+  tunnel = client_tunnel_new (arg);
+  if (tunnel == NULL)
+    {
+      event_timer_set (loop, &pool_refill, 1000 * POOL_RETRY);
+      return;
+    }
+  client = client_new (arg, loop, tunnel, -1);
+  if (client == NULL)
+    {
+      tunnel_destroy (tunnel);
+      event_timer_set (loop, &pool_refill, 1000 * POOL_RETRY);
+      return;
+    }
+
+  for (cp = &pool; *cp != NULL; cp = &(*cp)->next)
+    ;
+  *cp = client;
+  pool_count++;
+  log_debug ("%d of %d tunnels in the pool", pool_count, arg->pool);
+
+  if (pool_count < arg->pool)
+    event_timer_set (loop, &pool_refill, 0);
+  client_update (loop, client);
+}
+
+/*
+Take the oldest Client from the pool, or return NULL if it's empty.
+*/
+
+static Client *
+pool_take (Event_loop *loop)
+{
+  Client *client = pool;
+
+  if (client == NULL)
+    return NULL;
+
+  pool = client->next;
+  client->next = NULL;
+  pool_count--;
+  served++;
+  event_timer_set (loop, &pool_refill, 0);
+  return client;
+}
+
+static void
+pool_accept (Event_loop *loop, int fd, int events, void *data)
+{
+  Arguments *arg = data;
+  Tunnel *tunnel;
+  Client *client;
+  int t;
+
+  t = wait_for_connection_on_socket (fd);
+  log_debug ("wait_for_connection_on_socket (%d) = %d", fd, t);
+  if (t == -1 || set_nonblocking (t) == -1)
+    {
+      log_error ("couldn't forward port %d: %s",
+		 arg->forward_port, strerror (errno));
+      if (t != -1)
+	close (t);
+      return;
+    }
+
+  client = pool_take (loop);
+  if (client != NULL)
+    log_debug ("using a tunnel from the pool");
+  else
+    {
+      tunnel = client_tunnel_new (arg);
+      client = tunnel ? client_new (arg, loop, tunnel, -1) : NULL;
+      if (client == NULL)
+	{
+	  if (tunnel != NULL)
+	    tunnel_destroy (tunnel);
+	  close (t);
+	  return;
+	}
+      served++;
+    }
+
+  client->fd = t;
+  if (client_start (client) == -1)
+    {
+      client->closed = TRUE;
+      client_update (loop, client);
+    }
+}
+
+/*
+Serve connections on the socket S, each with a tunnel from the pool.
+This doesn't return.
+*/
+
+static void
+pool_serve (Event_loop *loop, int s, Arguments *arg)
+{
+  event_timer_set (loop, &pool_refill, 0);
+  if (event_add (loop, s, POLLIN, pool_accept, arg) == -1)
+    {
+      log_error ("couldn't poll port: %s", strerror (errno));
+      log_exit (1);
+    }
+
+  for (;;)
+    {
+      log_annoying ("event_dispatch () ...");
+      if (event_dispatch (loop) == -1)
+	{
+	  log_error ("event_dispatch error: %s", strerror (errno));
+	  log_exit (1);
+	}
+    }
+}
+
 int
 main (int argc, char **argv)
 {
@@ -412,7 +1357,8 @@ main (int argc, char **argv)
   int fd = -1;
   Arguments arg;
   Tunnel *tunnel;
-  int closed;
+  Event_loop *loop;
+  Client *client;
 
   parse_arguments (argc, argv, &arg);
 
@@ -438,6 +1384,13 @@ main (int argc, char **argv)
   log_notice ("  content_length = %d", arg.content_length);
   log_notice ("  forward_port = %d", arg.forward_port);
   log_notice ("  max_connection_age = %d", arg.max_connection_age);
+  log_notice ("  standby_threshold = %d", arg.standby_threshold);
+  log_notice ("  persistent = %d", arg.persistent);
+  log_notice ("  chunked = %d", arg.chunked);
+  log_notice ("  coalesce_window = %d", arg.coalesce_window);
+  log_notice ("  compress_level = %d", arg.compress_level);
+  log_notice ("  multiplex = %d", arg.multiplex);
+  log_notice ("  pool = %d", arg.pool);
   log_notice ("  use_std = %d", arg.use_std);
   log_notice ("  strict_content_length = %d", arg.strict_content_length);
   log_notice ("  keep_alive = %d", arg.keep_alive);
@@ -453,7 +1406,10 @@ main (int argc, char **argv)
       struct in_addr addr;
 
       addr.s_addr = INADDR_ANY;
-      s = server_socket (addr, arg.forward_port, 0);
+      /* Many connections may be waiting to become streams, or for
+	 tunnels from the pool. */
+      s = server_socket (addr, arg.forward_port,
+			 arg.multiplex || arg.pool > 0 ? 16 : 0);
       log_debug ("server_socket (%d) = %d", arg.forward_port, s);
       if (s == -1)
 	{
@@ -468,10 +1424,16 @@ main (int argc, char **argv)
   signal (SIGPIPE, SIG_IGN);
 #endif
 
-  for (;;)
+  loop = event_loop_new ();
+  if (loop == NULL)
     {
-      time_t last_tunnel_write;
+      log_error ("couldn't create event loop: %s", strerror (errno));
+      log_exit (1);
+    }
+  event_timer_init (&pool_refill, pool_refill_expired, &arg);
 
+  for (;;)
+    {
       if (arg.device)
 	{
 	  fd = open_device (arg.device);
@@ -493,12 +1455,16 @@ main (int argc, char **argv)
 		}
 	    }
 	}
+      else if (arg.multiplex)
+	fd = s;
+      else if (arg.forward_port != -1 && arg.pool > 0)
+	pool_serve (loop, s, &arg);
       else if (arg.forward_port != -1)
 	{
 	  log_debug ("waiting for connection on port %d", arg.forward_port);
 	  fd = wait_for_connection_on_socket (s);
 	  log_debug ("wait_for_connection_on_socket (%d) = %d", s, fd);
-	  if (fd == -1)
+	  if (fd == -1 || set_nonblocking (fd) == -1)
 	    {
 	      log_error ("couldn't forward port %d: %s",
 			 arg.forward_port, strerror (errno));
@@ -517,7 +1483,7 @@ main (int argc, char **argv)
 	} else if (arg.use_std) {
 	  log_debug ("using stdin as fd");
 	  fd = 0;
-	  if (fcntl(fd,F_SETFL,O_NONBLOCK)==-1)
+	  if (set_nonblocking (fd) == -1)
 	    {
 	      log_error ("couldn't set stdin to non-blocking mode: %s",
 			 strerror(errno));
@@ -526,167 +1492,28 @@ main (int argc, char **argv)
 	  /* Usage of stdout (fd = 1) is checked later. */
 	}
 
-      log_debug ("creating a new tunnel");
-      tunnel = tunnel_new_client (arg.host_name, arg.host_port,
-				  arg.proxy_name, arg.proxy_port,
-				  arg.content_length);
-      if (tunnel == NULL)
-	{
-	  log_error ("couldn't create tunnel");
-	  log_exit (1);
-	}
-
-      if (tunnel_setopt (tunnel, "strict_content_length",
-			 &arg.strict_content_length) == -1)
-	log_debug ("tunnel_setopt strict_content_length error: %s",
-		   strerror (errno));
-
-      if (tunnel_setopt (tunnel, "keep_alive",
-			 &arg.keep_alive) == -1)
-	log_debug ("tunnel_setopt keep_alive error: %s", strerror (errno));
-
-      if (tunnel_setopt (tunnel, "max_connection_age",
-			 &arg.max_connection_age) == -1)
-	log_debug ("tunnel_setopt max_connection_age error: %s",
-		   strerror (errno));
-
-      if (arg.proxy_authorization != NULL)
-	{
-	  ssize_t len;
-	  char *auth;
-
-	  len = encode_base64 (arg.proxy_authorization,
-			       strlen (arg.proxy_authorization),
-			       &auth);
-	  if (len == -1)
-	    {
-	      log_error ("encode_base64 error: %s", strerror (errno));
-	    }
-	  else
-	    {
-	      char *str = malloc (len + 7);
-
-	      if (str == NULL)
-		{
-		  log_error ("out of memory when encoding "
-			     "authorization string");
-		  log_exit (1);
-		}
-
-	      strcpy (str, "Basic ");
-	      strcat (str, auth);
-	      free (auth);
-	
-	      if (tunnel_setopt (tunnel, "proxy_authorization", str) == -1)
-		log_error ("tunnel_setopt proxy_authorization error: %s",
-			   strerror (errno));
-
-	      free (str);
-	    }
-	}
-
-      if (arg.user_agent != NULL)
-	{
-	  if (tunnel_setopt (tunnel, "user_agent", arg.user_agent) == -1)
-	    log_error ("tunnel_setopt user_agent error: %s",
-		       strerror (errno));
-	}
+      tunnel = client_tunnel_new (&arg);
+      client = tunnel != NULL ? client_new (&arg, loop, tunnel, fd) : NULL;
+      if (client == NULL)
+	log_exit (1);
+      served++;
+      if (client_start (client) == -1)
+	log_exit (1);
 
-	  if (arg.base_uri != NULL)
+      while (served > 0)
 	{
-	  if (tunnel_setopt (tunnel, "base_uri", (void *)arg.base_uri) == -1)
-	    log_error ("tunnel_setopt base_uri error: %s",
-		       strerror (errno));
-	}
-
-      if (tunnel_connect (tunnel) == -1)
-	{
-	  log_error ("couldn't open tunnel: %s", strerror (errno));
-	  log_exit (1);
-	}
-      if (arg.proxy_name)
-	log_notice ("connected to %s:%d via %s:%d",
-		    arg.host_name, arg.host_port,
-		    arg.proxy_name, arg.proxy_port);
-      else
-	log_notice ("connected to %s:%d", arg.host_name, arg.host_port);
-
-      closed = FALSE;
-      time (&last_tunnel_write);
-      while (!closed)
-	{
-	  struct pollfd pollfd[2];
-	  int keep_alive_timeout;
-	  int timeout;
-	  time_t t;
-	  int n;
-
-	  pollfd[0].fd = fd;
-	  pollfd[0].events = POLLIN;
-	  pollfd[1].fd = tunnel_pollin_fd (tunnel);
-	  pollfd[1].events = POLLIN;
-      
-	  time (&t);
-	  timeout = 1000 * (arg.keep_alive - (t - last_tunnel_write));
-	  keep_alive_timeout = TRUE;
-	  if (timeout < 0)
-	    timeout = 0;
-	  if (arg.proxy_buffer_timeout != -1 &&
-	      arg.proxy_buffer_timeout < timeout)
-	    {
-	      timeout = arg.proxy_buffer_timeout;
-	      keep_alive_timeout = FALSE;
-	    }
-
-	  log_annoying ("poll () ...");
-	  n = poll (pollfd, 2, timeout);
-	  log_annoying ("... = %d", n);
-	  if (n == -1)
+	  log_annoying ("event_dispatch () ...");
+	  if (event_dispatch (loop) == -1)
 	    {
-	      log_error ("poll error: %s", strerror (errno));
+	      log_error ("event_dispatch error: %s", strerror (errno));
 	      log_exit (1);
 	    }
-	  else if (n == 0)
-	    {
-	      log_verbose ("poll() timed out");
-	      if (keep_alive_timeout)
-		{
-		  tunnel_padding (tunnel, 1);
-		  time (&last_tunnel_write);
-		}
-	      else
-		{
-		  if (tunnel_maybe_pad (tunnel, arg.proxy_buffer_size) > 0)
-		    time (&last_tunnel_write);
-		}
-	      continue;
-	    }
-      
-	  handle_input ("device or port", tunnel, fd, pollfd[0].revents,
-			handle_device_input, &closed);
-	  handle_input ("tunnel", tunnel, fd, pollfd[1].revents,
-			handle_tunnel_input, &closed);
-
-	  if (pollfd[0].revents & POLLIN)
-	    time (&last_tunnel_write);
-	}
-
-      log_debug ("destroying tunnel");
-      if (fd != 0)
-        {
-          close (fd);
 	}
-      tunnel_destroy (tunnel);
-      if (arg.proxy_name)
-	log_notice ("disconnected from %s:%d via %s:%d",
-		    arg.host_name, arg.host_port,
-		    arg.proxy_name, arg.proxy_port);
-      else
-	log_notice ("disconnected from %s%d", arg.host_name, arg.host_port);
     }
 
   log_debug ("closing server socket");
   close (s);
+  event_loop_destroy (loop);
 
   log_exit (0);
 }
@@ -17,8 +17,22 @@ two-way data path tunneled in HTTP requests.
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sched.h>
 
 #include "common.h"
+#include "event.h"
+#include "mux.h"
+
+#define ACCEPT_TIMEOUT 10 /* seconds */
+#define SESSION_BUCKETS 256 /* must be a power of two */
+#define WORKERS_MAX 64
+#define REGISTRY_SIZE 4096 /* sessions of all workers; a power of two */
+#define REGISTRY_KEY_MAX 32
+#define HANDOFF_RETRY 100 /* milliseconds */
 
 typedef struct
 {
@@ -28,6 +42,7 @@ typedef struct
   int port;
   char *forward_host;
   int forward_port;
+  struct sockaddr_in forward_address;
   size_t content_length;
   char *pid_filename;
   int use_std;
@@ -35,10 +50,74 @@ typedef struct
   int strict_content_length;
   int keep_alive;
   int max_connection_age;
+  int compress_level;
+  int workers;
   char *root;
   char *user;
 } Arguments;
 
+typedef struct session Session;
+typedef struct pending Pending;
+
+/* A tunnel being served, and the device or port it's forwarded to.
+   If the client multiplexes, there's a connection to the port for each
+   stream in MUX instead. */
+struct session
+{
+  Arguments *arg;
+  Tunnel *tunnel;
+  char *key;
+  int fd;
+  Mux *mux;
+  int in_fd;			/* tunnel_pollin_fd() as registered */
+  unsigned int in_generation;
+  int out_fd;			/* tunnel_pollout_fd() as registered */
+  unsigned int out_generation;
+  int out_polled;		/* tunnel data is queued for FD */
+  int closed;
+  int draining;			/* closed, but output is queued */
+  Event_timer keep_alive;
+  Event_timer detached;
+  Session *next;
+};
+
+/* An accepted connection that doesn't belong to a session yet. */
+struct pending
+{
+  Arguments *arg;
+  Tunnel_connection *conn;
+  int ready;
+  Event_timer timeout;
+  Event_timer start;		/* read what's already buffered */
+  Pending *next;
+};
+
+static Event_loop *loop;
+static Session *sessions[SESSION_BUCKETS]; /* hashed by key */
+static int session_count = 0;
+static Pending *pending = NULL;
+static pid_t workers[WORKERS_MAX]; /* see supervise() */
+static int worker_count = 0;
+static int worker_id = -1;	/* this worker, or -1 */
+static int handoff[WORKERS_MAX][2]; /* sockets to pass connections to
+				       each worker */
+static Event_timer pending_poll; /* see pending_join() */
+
+/* The worker serving each session, shared by all workers.  Keys are
+   hashed into ENTRY with linear probing.  A free entry has an empty
+   key; see registry_delete() for how entries are taken out. */
+typedef struct
+{
+  volatile pid_t lock;		/* pid of the holder, or 0 */
+  struct
+  {
+    char key[REGISTRY_KEY_MAX];
+    int owner;
+  } entry[REGISTRY_SIZE];
+} Registry;
+
+static Registry *registry = NULL;
+
 int debug_level = 0;
 FILE *debug_file = NULL;
 
@@ -74,7 +153,10 @@ usage (FILE *f, const char *me)
 "  -u, --user USER                change user to USER\n"
 "  -V, --version                  output version information and exit\n"
 "  -w, --no-daemon                don't fork into the background\n"
+"  -Z, --compress LEVEL           compress tunnel data at LEVEL, 1 to 9\n"
+"                                 (default is 0, no compression)\n"
 "  -p, --pid-file LOCATION        write a PID file to LOCATION\n"
+"  -n, --workers N                serve tunnels in N processes\n"
 "\n"
 "Report bugs to %s.\n",
 	   me, DEFAULT_HOST_PORT, DEFAULT_KEEP_ALIVE,
@@ -101,6 +183,8 @@ parse_arguments (int argc, char **argv, Arguments *arg)
   arg->strict_content_length = FALSE;
   arg->keep_alive = DEFAULT_KEEP_ALIVE;
   arg->max_connection_age = DEFAULT_CONNECTION_MAX_TIME;
+  arg->compress_level = 0;
+  arg->workers = 1;
   arg->user = NULL;
   arg->root = NULL;
   
@@ -126,10 +210,12 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	{ "content-length", required_argument, 0, 'c' },
 	{ "strict-content-length", no_argument, 0, 'S' },
 	{ "max-connection-age", required_argument, 0, 'M' },
+	{ "compress", required_argument, 0, 'Z' },
+	{ "workers", required_argument, 0, 'n' },
 	{ 0, 0, 0, 0 }
       };
 
-      static const char *short_options = "c:d:F:hk:M:p:sSVwu:r:"
+      static const char *short_options = "c:d:F:hk:M:n:p:sSVwZ:u:r:"
 #ifdef DEBUG_MODE
 	"D:l:"
 #endif
@@ -199,6 +285,10 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	  arg->max_connection_age = atoi (optarg);
 	  break;
 
+	case 'n':
+	  arg->workers = atoi (optarg);
+	  break;
+
 	case 'r':
 	  arg->root = optarg;
 	  break;
@@ -228,6 +318,10 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	  arg->use_daemon = FALSE;
 	  break;
 
+	case 'Z':
+	  arg->compress_level = atoi (optarg);
+	  break;
+
 	case '?':
 	  break;
 
@@ -273,6 +367,36 @@ parse_arguments (int argc, char **argv, Arguments *arg)
       exit (1);
     }
 
+  if (arg->workers < 1 || arg->workers > WORKERS_MAX)
+    {
+      fprintf (stderr, "%s: --workers N must be 1 to %d.\n",
+	       arg->me, WORKERS_MAX);
+      exit (1);
+    }
+
+  if (arg->workers > 1 && arg->use_std)
+    {
+      fprintf (stderr, "%s: --workers can't be used with --stdin-stdout.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
+  if (arg->compress_level < 0 || arg->compress_level > 9)
+    {
+      fprintf (stderr, "%s: --compress LEVEL must be 0 to 9.\n",
+	       arg->me);
+      exit (1);
+    }
+#ifndef HAVE_LIBZ
+  if (arg->compress_level > 0)
+    {
+      fprintf (stderr, "%s: compression isn't supported; "
+	       "built without zlib\n", arg->me);
+      exit (1);
+    }
+#endif
+
   if (debug_level == 0 && debug_file != NULL)
     {
       fprintf (stderr, "%s: --logfile can't be used without debugging\n",
@@ -290,13 +414,1097 @@ parse_arguments (int argc, char **argv, Arguments *arg)
     }
 }
 
+/*
+Open the device or port that a new tunnel is forwarded to.
+*/
+
+static int
+open_destination (Arguments *arg)
+{
+  int fd;
+
+  if (arg->device != NULL)
+    {
+      fd = open_device (arg->device);
+      log_debug ("open_device (\"%s\") = %d", arg->device, fd);
+      if (fd == -1)
+	{
+	  log_error ("couldn't open %s: %s",
+		     arg->device, strerror (errno));
+	  return -1;
+	}
+    }
+  else if (arg->use_std)
+    {
+      log_debug ("using stdin as fd");
+      fd = 0;
+      if (set_nonblocking (fd) == -1)
+	{
+	  log_error ("couldn't set stdin to non-blocking mode: %s",
+		     strerror (errno));
+	  return -1;
+	}
+      /* Usage of stdout (fd = 1) is checked later. */
+      return fd;
+    }
+  else
+    {
+      /* The connection completes while the tunnel is served; until
+	 then, tunnel data is queued for it.  A failure shows up as an
+	 error reading or writing it. */
+      fd = do_connect_nonblocking (&arg->forward_address);
+      log_debug ("do_connect_nonblocking (\"%s:%d\") = %d",
+		 arg->forward_host, arg->forward_port, fd);
+      if (fd == -1)
+	{
+	  log_error ("couldn't connect to %s:%d: %s\n",
+		     arg->forward_host, arg->forward_port, strerror (errno));
+	  return -1;
+	}
+    }
+
+  /* Check that fd is not 0 (clash with --stdin-stdout) */
+  if (fd == 0)
+    {
+      int fd2 = fcntl (fd, F_DUPFD, 1);
+
+      log_notice ("changing fd from %d to %d", fd, fd2);
+      if (fd2 == -1)
+	{
+	  log_error ("couldn't dup(%d): %s", fd, strerror (errno));
+	  close (fd);
+	  return -1;
+	}
+      close (fd);
+      fd = fd2;
+    }
+
+  return fd;
+}
+
+static void session_update (Session *session);
+static Pending *pending_new (Arguments *arg, Tunnel_connection *conn,
+			     int timeout);
+static void handoff_input (Event_loop *loop, int fd, int events, void *data);
+
+static unsigned long
+key_hash (const char *key)
+{
+  unsigned long h = 5381;
+
+  while (*key)
+    h = h * 33 + (unsigned char)*key++;
+  return h;
+}
+
+static Session **
+session_bucket (const char *key)
+{
+  return &sessions[key_hash (key) & (SESSION_BUCKETS - 1)];
+}
+
+static Session *
+session_lookup (const char *key)
+{
+  Session *session;
+
+  for (session = *session_bucket (key); session != NULL;
+       session = session->next)
+    if (strcmp (session->key, key) == 0)
+      return session;
+
+  return NULL;
+}
+
+static void
+registry_lock (void)
+{
+  while (!__sync_bool_compare_and_swap (&registry->lock, 0, getpid ()))
+    sched_yield ();
+}
+
+static void
+registry_unlock (void)
+{
+  __sync_lock_release (&registry->lock);
+}
+
+/*
+Return the entry for KEY, or else the free one ending its probe
+sequence, or -1 if there is none.  The registry must be locked.
+*/
+
+static int
+registry_find (const char *key)
+{
+  unsigned long h = key_hash (key);
+  int i, n;
+
+  for (n = 0; n < REGISTRY_SIZE; n++)
+    {
+      i = (h + n) & (REGISTRY_SIZE - 1);
+      if (registry->entry[i].key[0] == 0 ||
+	  strcmp (registry->entry[i].key, key) == 0)
+	return i;
+    }
+
+  return -1;
+}
+
+/*
+Free entry I.  The entries after it in the same run are moved back
+into the hole where their probe sequences pass it, so that no key is
+cut off from its home entry.  The registry must be locked.
+*/
+
+static void
+registry_delete (int i)
+{
+  int j, home;
+
+  for (j = (i + 1) & (REGISTRY_SIZE - 1);
+       registry->entry[j].key[0] != 0;
+       j = (j + 1) & (REGISTRY_SIZE - 1))
+    {
+      home = key_hash (registry->entry[j].key) & (REGISTRY_SIZE - 1);
+      /* Leave the entry if its home lies cyclically in (I, J]. */
+      if (((j - home) & (REGISTRY_SIZE - 1)) <
+	  ((j - i) & (REGISTRY_SIZE - 1)))
+	continue;
+      registry->entry[i] = registry->entry[j];
+      i = j;
+    }
+
+  registry->entry[i].key[0] = 0;
+  registry->entry[i].owner = -1;
+}
+
+/*
+Return the worker serving the session KEY, or -1 if none is.
+*/
+
+static int
+registry_owner (const char *key)
+{
+  int i, owner;
+
+  registry_lock ();
+  i = registry_find (key);
+  owner = -1;
+  if (i != -1 && registry->entry[i].key[0] != 0)
+    owner = registry->entry[i].owner;
+  registry_unlock ();
+  return owner;
+}
+
+/*
+Make OWNER the worker serving the session KEY, or take KEY out of the
+registry if OWNER is -1.
+*/
+
+static void
+registry_set (const char *key, int owner)
+{
+  int i;
+
+  if (strlen (key) >= REGISTRY_KEY_MAX)
+    return;
+
+  registry_lock ();
+  i = registry_find (key);
+  if (i == -1)
+    log_error ("too many tunnels to register %s", key);
+  else if (owner != -1)
+    {
+      strcpy (registry->entry[i].key, key);
+      registry->entry[i].owner = owner;
+    }
+  else if (registry->entry[i].key[0] != 0)
+    registry_delete (i);
+  registry_unlock ();
+}
+
+/*
+Pass CONN to the worker serving its session.  Return 1 if it was
+passed, 0 if no worker serves the session, or -1 on error.
+*/
+
+static int
+worker_handoff (Tunnel_connection *conn)
+{
+  const char *key = tunnel_connection_key (conn);
+  int owner;
+
+  owner = registry_owner (key);
+  if (owner == -1 || owner == worker_id)
+    return 0;
+
+  log_debug ("passing connection for tunnel %s to worker %d", key, owner);
+  if (tunnel_connection_send (conn, handoff[owner][1]) == -1)
+    {
+      log_error ("couldn't pass connection to worker %d: %s",
+		 owner, strerror (errno));
+      return -1;
+    }
+
+  return 1;
+}
+
+/*
+Stop serving the session: take it out of the table, and close the
+device and the tunnel.  Output still queued for the client is written
+before the session is destroyed; see session_update().
+*/
+
+/*
+Stop writing to the device of a closed SESSION, and close it.
+*/
+
+static void
+session_device_close (Session *session)
+{
+  if (session->fd == -1)
+    return;
+
+  event_remove (loop, session->fd ? session->fd : 1);
+  if (session->fd > 0)
+    close (session->fd);
+  session->fd = -1;
+}
+
+/*
+Write what's queued for the device of a closed SESSION when it can
+take it.
+*/
+
+static void
+session_device_drain (Event_loop *loop, int fd, int events, void *data)
+{
+  Session *session = data;
+
+  if (tunnel_flush_to (session->tunnel, fd) == -1)
+    log_error ("couldn't write %d bytes to device or port: %s",
+	       tunnel_queued (session->tunnel), strerror (errno));
+  else if (tunnel_queued (session->tunnel) > 0)
+    return;
+
+  session_device_close (session);
+  session_update (session);
+}
+
+static void
+session_shutdown (Session *session)
+{
+  Arguments *arg = session->arg;
+  Session **sp;
+  int out;
+
+  if (session->key)
+    for (sp = session_bucket (session->key); *sp != NULL; sp = &(*sp)->next)
+      if (*sp == session)
+	{
+	  *sp = session->next;
+	  session_count--;
+	  if (registry != NULL)
+	    registry_set (session->key, -1);
+	  break;
+	}
+
+  log_debug ("closing tunnel %s", session->key);
+  event_timer_cancel (&session->keep_alive);
+  event_timer_cancel (&session->detached);
+  if (session->in_fd != -1)
+    event_remove (loop, session->in_fd);
+  session->in_fd = -1;
+  if (session->fd != -1)
+    event_remove (loop, session->fd);
+  if (session->out_polled && session->fd == 0)
+    event_remove (loop, 1);
+  session->out_polled = FALSE;
+
+  /* What the device hasn't taken yet is written as it takes it. */
+  out = session->fd ? session->fd : 1;
+  if (session->fd != -1 && session->tunnel != NULL &&
+      tunnel_queued (session->tunnel) > 0 &&
+      event_add (loop, out, POLLOUT, session_device_drain, session) == 0)
+    log_debug ("%d bytes left to write to device or port",
+	       tunnel_queued (session->tunnel));
+  else
+    session_device_close (session);
+
+  if (session->mux)
+    mux_destroy (session->mux);
+  session->mux = NULL;
+  if (session->tunnel)
+    tunnel_close (session->tunnel);
+  log_notice ("disconnected from %s:%d", arg->forward_host, arg->forward_port);
+  session->draining = TRUE;
+}
+
+static void
+session_destroy (Session *session)
+{
+  if (!session->draining)
+    session_shutdown (session);
+  session_device_close (session);
+
+  event_timer_cancel (&session->detached);
+  if (session->out_fd != -1)
+    event_remove (loop, session->out_fd);
+  if (session->tunnel)
+    tunnel_destroy (session->tunnel);
+
+  if (session->key)
+    free (session->key);
+  free (session);
+}
+
+static void
+session_device_input (Event_loop *loop, int fd, int events, void *data)
+{
+  Session *session = data;
+
+  if (events & POLLOUT)
+    handle_input ("device or port", session->tunnel, fd, events,
+		  handle_device_output, &session->closed);
+  if (events & ~POLLOUT)
+    handle_input ("device or port", session->tunnel, fd, events,
+		  handle_device_input, &session->closed);
+  if (events & POLLIN)
+    event_timer_set (loop, &session->keep_alive,
+		     1000 * session->arg->keep_alive);
+  session_update (session);
+}
+
+static void
+session_device_output (Event_loop *loop, int fd, int events, void *data)
+{
+  Session *session = data;
+
+  handle_input ("stdout", session->tunnel, fd, events,
+		handle_device_output, &session->closed);
+  session_update (session);
+}
+
+static void
+session_tunnel_input (Event_loop *loop, int fd, int events, void *data)
+{
+  Session *session = data;
+
+  if (session->mux != NULL)
+    mux_tunnel_input (session->mux);
+  else
+    handle_input ("tunnel", session->tunnel, session->fd, events,
+		  handle_tunnel_input, &session->closed);
+  session_update (session);
+}
+
+static void
+session_stream_input (void *data)
+{
+  Session *session = data;
+
+  event_timer_set (loop, &session->keep_alive,
+		   1000 * session->arg->keep_alive);
+  session_update (session);
+}
+
+static int
+session_connect (void *data)
+{
+  Session *session = data;
+
+  return open_destination (session->arg);
+}
+
+static void
+session_keep_alive (Event_loop *loop, void *data)
+{
+  Session *session = data;
+
+  log_verbose ("sending keep-alive to %s", session->key);
+  tunnel_padding (session->tunnel, 1);
+  event_timer_set (loop, &session->keep_alive,
+		   1000 * session->arg->keep_alive);
+  session_update (session);
+}
+
+static void
+session_detached (Event_loop *loop, void *data)
+{
+  Session *session = data;
+
+  if (session->draining)
+    {
+      if (session->fd != -1)
+	log_error ("tunnel %s: device or port didn't take its data",
+		   session->key);
+      else
+	log_error ("tunnel %s: client didn't take its data", session->key);
+      session_destroy (session);
+      return;
+    }
+
+  log_error ("tunnel %s: client didn't reconnect", session->key);
+  session->closed = TRUE;
+  session_update (session);
+}
+
+/*
+Bring the event registrations up to date with the state of the
+tunnel, or destroy the session if it has been closed.  This must be
+called after every call into the tunnel.
+*/
+
+/*
+Write queued tunnel output when the client's connection can take it.
+*/
+
+static void
+session_tunnel_output (Event_loop *loop, int fd, int events, void *data)
+{
+  Session *session = data;
+
+  if (tunnel_flush (session->tunnel) == -1)
+    log_error ("couldn't write to tunnel %s: %s",
+	       session->key, strerror (errno));
+  session_update (session);
+}
+
+static int
+session_poll_output (Session *session)
+{
+  int fd = tunnel_pollout_fd (session->tunnel);
+
+  if (fd == session->out_fd &&
+      tunnel_pollout_generation (session->tunnel) == session->out_generation)
+    return 0;
+  if (session->out_fd != -1)
+    event_remove (loop, session->out_fd);
+  session->out_fd = fd;
+  session->out_generation = tunnel_pollout_generation (session->tunnel);
+  if (fd != -1 &&
+      event_add (loop, fd, POLLOUT, session_tunnel_output, session) == -1)
+    {
+      session->out_fd = -1;
+      return -1;
+    }
+  return 0;
+}
+
+static void
+session_update (Session *session)
+{
+  Tunnel_connection *conn;
+  Pending *p;
+  int fd;
+
+  /* A closed session lingers until the client has taken what's
+     queued for it, or for as long as it would have to reconnect. */
+  if (session->closed)
+    {
+      if (!session->draining)
+	{
+	  session_shutdown (session);
+	  event_timer_set (loop, &session->detached, 1000 * ACCEPT_TIMEOUT);
+	}
+      if ((tunnel_pollout_fd (session->tunnel) == -1 && session->fd == -1) ||
+	  session_poll_output (session) == -1)
+	session_destroy (session);
+      return;
+    }
+
+  if (session_poll_output (session) == -1)
+    {
+      session_destroy (session);
+      return;
+    }
+
+  /* Don't read the tunnel while the device is slow to take its data. */
+  if (tunnel_queued (session->tunnel) > TUNNEL_QUEUE_MAX)
+    fd = -1;
+  else
+    fd = tunnel_pollin_fd (session->tunnel);
+  if (fd != session->in_fd ||
+      tunnel_pollin_generation (session->tunnel) != session->in_generation)
+    {
+      if (session->in_fd != -1)
+	event_remove (loop, session->in_fd);
+      session->in_fd = fd;
+      session->in_generation = tunnel_pollin_generation (session->tunnel);
+      if (fd != -1 &&
+	  event_add (loop, fd, POLLIN, session_tunnel_input, session) == -1)
+	{
+	  session->in_fd = -1;
+	  session_destroy (session);
+	  return;
+	}
+    }
+
+  /* Don't read more than the client can be sent.  Write what's queued
+     for the device when it can take it; with --stdin-stdout, that's
+     stdout. */
+  if (session->mux != NULL)
+    mux_set_input (session->mux, tunnel_can_write (session->tunnel));
+  else
+    {
+      int out = session->fd ? session->fd : 1;
+      int events = tunnel_can_write (session->tunnel) ? POLLIN : 0;
+
+      if ((tunnel_queued (session->tunnel) > 0) != session->out_polled)
+	{
+	  session->out_polled = !session->out_polled;
+	  if (out != session->fd && !session->out_polled)
+	    event_remove (loop, out);
+	  else if (out != session->fd &&
+		   event_add (loop, out, POLLOUT,
+			      session_device_output, session) == -1)
+	    {
+	      session->out_polled = FALSE;
+	      session_destroy (session);
+	      return;
+	    }
+	}
+      if (out == session->fd && session->out_polled)
+	events |= POLLOUT;
+      event_modify (loop, session->fd, events);
+    }
+
+  if (tunnel_is_attached (session->tunnel))
+    event_timer_cancel (&session->detached);
+  else if (!event_timer_is_set (&session->detached))
+    event_timer_set (loop, &session->detached, 1000 * ACCEPT_TIMEOUT);
+
+  /* Persistent connections may carry requests for any tunnel, so
+     they are read like new ones.  A client may leave them idle for a
+     while. */
+  while ((conn = tunnel_released (session->tunnel)) != NULL)
+    {
+      p = pending_new (session->arg, conn,
+		       1000 * session->arg->max_connection_age);
+      if (p != NULL)
+	event_timer_set (loop, &p->start, 0);
+    }
+
+  /* The tunnel's input buffer isn't visible to the event loop. */
+  if (tunnel_pending (session->tunnel))
+    session_tunnel_input (loop, session->in_fd, POLLIN, session);
+}
+
+static Session *
+session_new (Arguments *arg, const char *key, int multiplex)
+{
+  Session *session;
+
+  session = malloc (sizeof (Session));
+  if (session == NULL)
+    {
+      log_error ("session_new: out of memory");
+      return NULL;
+    }
+
+  session->arg = arg;
+  session->fd = -1;
+  session->mux = NULL;
+  session->in_fd = -1;
+  session->out_fd = -1;
+  session->in_generation = 0;
+  session->out_generation = 0;
+  session->out_polled = FALSE;
+  session->closed = FALSE;
+  session->draining = FALSE;
+  session->next = NULL;
+  event_timer_init (&session->keep_alive, session_keep_alive, session);
+  event_timer_init (&session->detached, session_detached, session);
+  session->key = strdup (key);
+  session->tunnel = tunnel_new_server (arg->content_length);
+  if (session->key == NULL || session->tunnel == NULL)
+    {
+      log_error ("couldn't create tunnel");
+      session_destroy (session);
+      return NULL;
+    }
+
+  if (tunnel_setopt (session->tunnel, "strict_content_length",
+		     &arg->strict_content_length) == -1)
+    log_debug ("tunnel_setopt strict_content_length error: %s",
+	       strerror (errno));
+
+  if (tunnel_setopt (session->tunnel, "keep_alive",
+		     &arg->keep_alive) == -1)
+    log_debug ("tunnel_setopt keep_alive error: %s", strerror (errno));
+
+  if (tunnel_setopt (session->tunnel, "max_connection_age",
+		     &arg->max_connection_age) == -1)
+    log_debug ("tunnel_setopt max_connection_age error: %s",
+	       strerror (errno));
+
+  if (tunnel_setopt (session->tunnel, "compression",
+		     &arg->compress_level) == -1)
+    log_debug ("tunnel_setopt compression error: %s", strerror (errno));
+
+  if (multiplex)
+    {
+      /* Each stream the client opens is connected to the port. */
+      if (tunnel_setopt (session->tunnel, "multiplex", &multiplex) == -1)
+	log_debug ("tunnel_setopt multiplex error: %s", strerror (errno));
+      session->mux = mux_new (loop, session->tunnel, session_connect,
+			      session_stream_input, session,
+			      &session->closed);
+      if (session->mux == NULL)
+	{
+	  session_destroy (session);
+	  return NULL;
+	}
+    }
+  else if ((session->fd = open_destination (arg)) == -1)
+    {
+      session_destroy (session);
+      return NULL;
+    }
+
+  /* The device is polled once the client can be sent data. */
+  if (session->fd != -1 &&
+      event_add (loop, session->fd, 0, session_device_input, session) == -1)
+    {
+      close (session->fd);
+      session->fd = -1;
+      session_destroy (session);
+      return NULL;
+    }
+
+  event_timer_set (loop, &session->keep_alive, 1000 * arg->keep_alive);
+
+  log_notice ("new tunnel %s%s", key, multiplex ? ", multiplexed" : "");
+  return session;
+}
+
+/*
+Give CONN to the session it belongs to, starting a new session if it
+opens a tunnel.  Return 1 if CONN was used, 0 if its session doesn't
+exist yet, or -1 if it must be rejected.
+*/
+
+static int
+session_attach (Arguments *arg, Tunnel_connection *conn)
+{
+  const char *key = tunnel_connection_key (conn);
+  Session *session;
+
+  session = session_lookup (key);
+
+  if (tunnel_connection_opens (conn))
+    {
+      if (session != NULL)
+	{
+	  log_error ("rejected tunnel %s: already got one", key);
+	  return -1;
+	}
+
+      /* A device or stdin can only serve one tunnel at a time. */
+      if (session_count > 0 && arg->forward_port == -1)
+	{
+	  log_error ("rejected tunnel %s: %s is busy",
+		     key, arg->device ? arg->device : "stdin");
+	  return -1;
+	}
+
+      /* Only connections to a port can be multiplexed. */
+      session = session_new (arg, key, arg->forward_port != -1 &&
+			     tunnel_connection_multiplexed (conn));
+      if (session == NULL)
+	return -1;
+      session->next = *session_bucket (key);
+      *session_bucket (key) = session;
+      session_count++;
+      if (registry != NULL)
+	registry_set (key, worker_id);
+    }
+  else if (session == NULL)
+    return 0;
+
+  if (tunnel_attach (session->tunnel, conn) == -1)
+    return -1;
+
+  session_update (session);
+  return 1;
+}
+
+static void
+pending_destroy (Pending *p)
+{
+  Pending **pp;
+
+  for (pp = &pending; *pp != NULL; pp = &(*pp)->next)
+    if (*pp == p)
+      {
+	*pp = p->next;
+	break;
+      }
+
+  event_timer_cancel (&p->timeout);
+  event_timer_cancel (&p->start);
+  if (p->conn)
+    {
+      event_remove (loop, tunnel_connection_fd (p->conn));
+      tunnel_connection_destroy (p->conn);
+    }
+  free (p);
+}
+
+/*
+Give P to its session, and return TRUE if P is done with.
+*/
+
+static int
+pending_join (Pending *p)
+{
+  int n;
+
+  n = session_attach (p->arg, p->conn);
+  if (n == 1)
+    p->conn = NULL;
+  else if (n == 0 && registry != NULL)
+    n = worker_handoff (p->conn);
+
+  if (n == 0)
+    {
+      /* Another worker may start the session. */
+      if (registry != NULL && !event_timer_is_set (&pending_poll))
+	event_timer_set (loop, &pending_poll, HANDOFF_RETRY);
+      return FALSE;
+    }
+
+  pending_destroy (p);
+  return TRUE;
+}
+
+/*
+A new session may let connections that arrived before it join it.
+*/
+
+static void
+pending_retry (void)
+{
+  Pending *p, *next;
+
+  p = pending;
+  while (p != NULL)
+    {
+      next = p->next;
+      if (p->ready && pending_join (p))
+	next = pending;
+      p = next;
+    }
+}
+
+static void
+pending_input (Event_loop *loop, int fd, int events, void *data)
+{
+  Pending *p = data;
+  int n;
+
+  n = tunnel_connection_read (p->conn);
+  if (n == -1 && errno == EAGAIN)
+    return;
+  if (n != 1)
+    {
+      pending_destroy (p);
+      return;
+    }
+
+  /* A connection of the same tunnel that reached another worker
+     first may be waiting to be passed here.  Take it before this
+     one, so the order of the tunnel's requests is kept. */
+  if (worker_id != -1)
+    handoff_input (loop, handoff[worker_id][0], POLLIN, p->arg);
+
+  p->ready = TRUE;
+  event_remove (loop, fd);
+  if (pending_join (p))
+    pending_retry ();
+}
+
+static void
+pending_poll_expired (Event_loop *loop, void *data)
+{
+  pending_retry ();
+}
+
+static void
+pending_timeout (Event_loop *loop, void *data)
+{
+  Pending *p = data;
+
+  if (p->ready)
+    log_error ("no tunnel %s for connection",
+	       tunnel_connection_key (p->conn));
+  else
+    log_error ("timed out reading request header");
+  pending_destroy (p);
+}
+
+static void
+pending_start (Event_loop *loop, void *data)
+{
+  Pending *p = data;
+
+  pending_input (loop, tunnel_connection_fd (p->conn), POLLIN, p);
+}
+
+/*
+Wait for the request header on CONN, for at most TIMEOUT
+milliseconds.
+*/
+
+static Pending *
+pending_new (Arguments *arg, Tunnel_connection *conn, int timeout)
+{
+  Pending *p;
+
+  p = malloc (sizeof (Pending));
+  if (p == NULL)
+    {
+      log_error ("pending_new: out of memory");
+      tunnel_connection_destroy (conn);
+      return NULL;
+    }
+
+  p->arg = arg;
+  p->conn = conn;
+  p->ready = FALSE;
+  event_timer_init (&p->timeout, pending_timeout, p);
+  event_timer_init (&p->start, pending_start, p);
+  event_timer_set (loop, &p->timeout, timeout);
+  p->next = pending;
+  pending = p;
+
+  if (event_add (loop, tunnel_connection_fd (conn), POLLIN,
+		 pending_input, p) == -1)
+    {
+      pending_destroy (p);
+      return NULL;
+    }
+
+  return p;
+}
+
+static void
+listener_input (Event_loop *loop, int fd, int events, void *data)
+{
+  Tunnel_connection *conn;
+
+  conn = tunnel_connection_accept (fd);
+  if (conn == NULL)
+    {
+      log_notice ("couldn't accept connection: %s", strerror (errno));
+      return;
+    }
+
+  pending_new (data, conn, 1000 * ACCEPT_TIMEOUT);
+}
+
+/*
+Take a connection that another worker has passed on.  Its request
+header has already been received.
+*/
+
+static void
+handoff_input (Event_loop *loop, int fd, int events, void *data)
+{
+  Tunnel_connection *conn;
+  Pending *p;
+
+  while ((conn = tunnel_connection_receive (fd)) != NULL)
+    {
+      p = pending_new (data, conn, 1000 * ACCEPT_TIMEOUT);
+      if (p != NULL)
+	pending_input (loop, tunnel_connection_fd (conn), POLLIN, p);
+    }
+}
+
+/*
+Serve all tunnels from one event loop.
+*/
+
+static void
+serve (Arguments *arg, int listener)
+{
+  loop = event_loop_new ();
+  event_timer_init (&pending_poll, pending_poll_expired, NULL);
+  if (loop == NULL ||
+      event_add (loop, listener, POLLIN, listener_input, arg) == -1 ||
+      (worker_id != -1 &&
+       event_add (loop, handoff[worker_id][0], POLLIN,
+		  handoff_input, arg) == -1))
+    {
+      log_error ("couldn't create event loop");
+      log_exit (1);
+    }
+
+  log_debug ("waiting for tunnel connections");
+  while (event_dispatch (loop) == 0)
+    ;
+
+  log_exit (1);
+}
+
+static void
+supervise_stop (int sig)
+{
+  int i;
+
+  for (i = 0; i < worker_count; i++)
+    if (workers[i] > 0)
+      kill (workers[i], sig);
+
+  signal (sig, SIG_DFL);
+  raise (sig);
+}
+
+static void
+worker_start (Arguments *arg, int *listeners, int i)
+{
+  pid_t pid;
+  int j;
+
+  pid = fork ();
+  if (pid == -1)
+    {
+      log_error ("couldn't start worker %d: %s", i, strerror (errno));
+      return;
+    }
+  else if (pid > 0)
+    {
+      workers[i] = pid;
+      return;
+    }
+
+  signal (SIGTERM, SIG_DFL);
+  signal (SIGINT, SIG_DFL);
+  worker_id = i;
+  for (j = 0; j < arg->workers; j++)
+    if (j != i)
+      {
+	close (listeners[j]);
+	close (handoff[j][0]);
+      }
+
+  log_notice ("worker %d started", i);
+  serve (arg, listeners[i]);
+}
+
+/*
+Forget the sessions of worker I, which has exited.  It may have held
+the registry lock.
+*/
+
+static void
+registry_clear (int i, pid_t pid)
+{
+  int j, deleted;
+
+  __sync_bool_compare_and_swap (&registry->lock, pid, 0);
+  registry_lock ();
+  /* Deleting may move an entry back past J, around the end. */
+  do
+    {
+      deleted = FALSE;
+      for (j = 0; j < REGISTRY_SIZE; j++)
+	while (registry->entry[j].key[0] != 0 &&
+	       registry->entry[j].owner == i)
+	  {
+	    registry_delete (j);
+	    deleted = TRUE;
+	  }
+    }
+  while (deleted);
+  registry_unlock ();
+}
+
+/*
+Serve tunnels in ARG->workers processes, each accepting connections
+on its own listener, and start a new one whenever one exits.  The
+listeners stay open here, so that connections to an exited worker's
+listener wait for the next one.  A worker which receives a connection
+for another worker's session passes it on, through the socket pair
+HANDOFF of that worker.  The sessions are found in a registry shared
+by all workers.
+*/
+
+static void
+supervise (Arguments *arg, int *listeners)
+{
+  int i, status;
+  pid_t pid;
+
+  registry = mmap (NULL, sizeof *registry, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (registry == MAP_FAILED)
+    {
+      log_error ("couldn't map session registry: %s", strerror (errno));
+      log_exit (1);
+    }
+  memset (registry, 0, sizeof *registry);
+
+  for (i = 0; i < arg->workers; i++)
+    if (socketpair (AF_UNIX, SOCK_DGRAM, 0, handoff[i]) == -1)
+      {
+	log_error ("couldn't create handoff socket: %s", strerror (errno));
+	log_exit (1);
+      }
+
+  worker_count = arg->workers;
+  signal (SIGTERM, supervise_stop);
+  signal (SIGINT, supervise_stop);
+  for (i = 0; i < worker_count; i++)
+    worker_start (arg, listeners, i);
+
+  for (;;)
+    {
+      pid = wait (&status);
+      if (pid == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != ECHILD)
+	    {
+	      log_error ("couldn't wait for workers: %s", strerror (errno));
+	      log_exit (1);
+	    }
+	  /* All forks failed.  Try again later. */
+	  sleep (1);
+	}
+
+      for (i = 0; i < worker_count; i++)
+	{
+	  if (pid != -1 && workers[i] != pid)
+	    continue;
+	  if (pid != -1)
+	    {
+	      if (WIFSIGNALED (status))
+		log_error ("worker %d killed by signal %d",
+			   i, WTERMSIG (status));
+	      else
+		log_error ("worker %d exited with status %d",
+			   i, WEXITSTATUS (status));
+	      workers[i] = 0;
+	      registry_clear (i, pid);
+	      /* Don't spin if the worker can't run at all. */
+	      sleep (1);
+	    }
+	  if (workers[i] == 0)
+	    worker_start (arg, listeners, i);
+	}
+    }
+}
+
 int
 main (int argc, char **argv)
 {
-  int closed;
-  int fd = -1;
   Arguments arg;
-  Tunnel *tunnel;
+  int listeners[WORKERS_MAX];
+  int n;
   FILE *pid_file;
   uid_t uid = 0;
   gid_t gid;
@@ -325,6 +1533,8 @@ main (int argc, char **argv)
 	      arg.forward_host ? arg.forward_host : "(null)");
   log_notice ("  content_length = %d", arg.content_length);
   log_notice ("  strict_content_length = %d", arg.strict_content_length);
+  log_notice ("  compress_level = %d", arg.compress_level);
+  log_notice ("  workers = %d", arg.workers);
   log_notice ("  use_std = %d", arg.use_std);
   log_notice ("  debug_level = %d", debug_level);
   log_notice ("  pid_filename = %s",
@@ -332,25 +1542,26 @@ main (int argc, char **argv)
   log_notice ("  chroot = %s", arg.root ? arg.root : "(null)");
   log_notice ("  user = %s", arg.user ? arg.user : "(null)");
 
-  tunnel = tunnel_new_server (arg.host, arg.port, arg.content_length);
-  if (tunnel == NULL)
+  /* Look up the destination once, before chroot. */
+  if (arg.forward_port != -1 &&
+      set_address (&arg.forward_address,
+		   arg.forward_host, arg.forward_port) == -1)
     {
-      log_error ("couldn't create tunnel");
+      log_error ("couldn't forward port to %s:%d: %s",
+		 arg.forward_host, arg.forward_port, strerror (errno));
       log_exit (1);
     }
 
-  if (tunnel_setopt (tunnel, "strict_content_length",
-		     &arg.strict_content_length) == -1)
-    log_debug ("tunnel_setopt strict_content_length error: %s",
-	       strerror (errno));
-
-  if (tunnel_setopt (tunnel, "keep_alive",
-		     &arg.keep_alive) == -1)
-    log_debug ("tunnel_setopt keep_alive error: %s", strerror (errno));
-
-  if (tunnel_setopt (tunnel, "max_connection_age",
-		     &arg.max_connection_age) == -1)
-    log_debug ("tunnel_setopt max_connection_age error: %s", strerror (errno));
+  /* Bind the port before giving up privileges. */
+  if (arg.workers > 1)
+    n = tunnel_listen_workers (arg.host, arg.port, listeners, arg.workers);
+  else
+    n = listeners[0] = tunnel_listen (arg.host, arg.port);
+  if (n == -1)
+    {
+      log_error ("couldn't create tunnel");
+      log_exit (1);
+    }
 
 #ifdef DEBUG_MODE
   signal (SIGPIPE, log_sigpipe);
@@ -436,139 +1647,10 @@ main (int argc, char **argv)
 	}
     }
 
-  for (;;)
-    {
-      time_t last_tunnel_write;
-
-      log_debug ("waiting for tunnel connection");
-
-      if (arg.device != NULL)
-	{
-	  fd = open_device (arg.device);
-	  log_debug ("open_device (\"%s\") = %d", arg.device, fd);
-	  if (fd == -1)
-	    {
-	      log_error ("couldn't open %s: %s",
-			 arg.device, strerror (errno));
-	      log_exit (1);
-	    }
-	  /* Check that fd is not 0 (clash with --stdin-stdout) */
-	  if (fd == 0)
-	    {
-	      log_notice ("changing fd from %d to 3", fd);
-	      if (dup2 (fd, 3) != 3)
-	        {
-		  log_error ("couldn't dup2(%d, 3): %s", fd, strerror (errno));
-		  log_exit (1);
-		}
-	    }
-	} else if (arg.use_std) {
-	  log_debug ("using stdin as fd");
-	  fd = 0;
-	  if (fcntl (fd, F_SETFL, O_NONBLOCK)==-1)
-	    {
-	      log_error ("couldn't set stdin to non-blocking mode: %s",
-			 strerror (errno));
-	      log_exit (1);
-	    }
-	  /* Usage of stdout (fd = 1) is checked later. */
-	}
-
-      if (tunnel_accept (tunnel) == -1)
-	{
-	  log_notice ("couldn't accept connection: %s", strerror (errno));
-	  continue;
-	}
-
-      if (arg.forward_port != -1)
-	{
-	  struct sockaddr_in addr;
-
-	  if (set_address (&addr, arg.forward_host, arg.forward_port) == -1)
-	    {
-	      log_error ("couldn't forward port to %s:%d: %s\n",
-			 arg.forward_host, arg.forward_port, strerror (errno));
-	      log_exit (1);
-	    }
-
-	  fd = do_connect (&addr);
-	  log_debug ("do_connect (\"%s:%d\") = %d",
-		 arg.forward_host, arg.forward_port, fd);
-	  if (fd == -1)
-	    {
-	      log_error ("couldn't connect to %s:%d: %s\n",
-			 arg.forward_host, arg.forward_port, strerror (errno));
-	      log_exit (1);
-	    }
-	  /* Check that fd is not 0 (clash with --stdin-stdout) */
-	  if (fd == 0)
-	    {
-	      log_notice ("changing fd from %d to 3", fd);
-	      if (dup2 (fd, 3) != 3)
-	        {
-		  log_error ("couldn't dup2(%d, 3): %s", fd, strerror (errno));
-		  log_exit (1);
-		}
-	    }
-	}
-
-      closed = FALSE;
-      time (&last_tunnel_write);
-      while (!closed)
-	{
-	  struct pollfd pollfd[2];
-	  int timeout;
-	  time_t t;
-	  int n;
-
-	  pollfd[0].fd = fd;
-	  pollfd[0].events = POLLIN;
-	  pollfd[1].fd = tunnel_pollin_fd (tunnel);
-	  pollfd[1].events = POLLIN;
-
-	  time (&t);
-	  timeout = 1000 * (arg.keep_alive - (t - last_tunnel_write));
-	  if (timeout < 0)
-	    timeout = 0;
-
-	  log_annoying ("poll () ...");
-	  n = poll (pollfd, 2, timeout);
-	  log_annoying ("... = %d", n);
-	  if (n == -1)
-	    {
-	      log_error ("poll error: %s\n", strerror (errno));
-	      log_exit (1);
-	    }
-	  else if (n == 0)
-	    {
-	      log_verbose ("poll() timed out");
-	      tunnel_padding (tunnel, 1);
-	      time (&last_tunnel_write);
-	      continue;
-	    }
-
-	  log_annoying ("revents[0] = %x, revents[1] = %x, POLLIN = %x",
-			pollfd[0].revents, pollfd[1].revents, POLLIN);
-	  handle_input ("device or port", tunnel, fd, pollfd[0].revents,
-			handle_device_input, &closed);
-	  handle_input ("tunnel", tunnel, fd, pollfd[1].revents,
-			handle_tunnel_input, &closed);
-
-	  if (pollfd[0].revents & POLLIN)
-	    time (&last_tunnel_write);
-	}
-
-      log_debug ("closing tunnel");
-      if (fd != 0)
-        {
-          close (fd);
-	}
-      tunnel_close (tunnel);
-      log_notice ("disconnected from %s:%d", arg.forward_host, arg.forward_port);
-    }
-
-  log_debug ("destroying tunnel");
-  tunnel_destroy (tunnel);
+  if (arg.workers > 1)
+    supervise (&arg, listeners);
+  else
+    serve (&arg, listeners[0]);
 
   log_exit (0);
 }
@@ -2,7 +2,7 @@
 http.c
 Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
 
-bug alert: parse_header() doesn't handle header fields that are extended
+bug alert: http_parse_fields() doesn't handle header fields that are extended
 over multiple lines.
 */
 
@@ -10,6 +10,7 @@ over multiple lines.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "http.h"
 #include "common.h"
@@ -18,8 +19,9 @@ static inline ssize_t
 http_method (int fd, Http_destination *dest,
 	     Http_method method, ssize_t length)
 {
-  char str[1024];
+  char str[1024], seq[32];
   Http_request *request;
+  const char *session;
   ssize_t n;
 
   if (fd == -1)
@@ -28,10 +30,16 @@ http_method (int fd, Http_destination *dest,
       return -1;
     }
 
+  /* The session token must come right before the last colon.  The
+     sequence number of a request body goes after the time. */
+  session = dest->session ? dest->session : "";
+  seq[0] = 0;
+  if (dest->sequence != 0 && method != HTTP_GET)
+    snprintf (seq, sizeof seq, ".%lu", dest->sequence);
   if (dest->proxy_name == NULL)
-    snprintf (str, sizeof(str), "%s:%ld", dest->base_uri, time (NULL));
+    snprintf (str, sizeof(str), "%s%s:%ld%s", dest->base_uri, session, time (NULL), seq);
   else
-    snprintf (str, sizeof(str), "http://%s:%d%s%ld", dest->host_name, dest->host_port, dest->base_uri, time (NULL));
+    snprintf (str, sizeof(str), "http://%s:%d%s%s:%ld%s", dest->host_name, dest->host_port, dest->base_uri, session, time (NULL), seq);
 
   request = http_create_request (method, str, 1, 1);
   if (request == NULL)
@@ -40,13 +48,16 @@ http_method (int fd, Http_destination *dest,
   snprintf (str, sizeof(str), "%s:%d", dest->host_name, dest->host_port);
   http_add_header (&request->header, "Host", str);
 
-  if (length >= 0)
+  if (length >= 0 && dest->chunked)
+    http_add_header (&request->header, "Transfer-Encoding", "chunked");
+  else if (length >= 0)
     {
       snprintf (str, sizeof(str), "%ld", length);
       http_add_header (&request->header, "Content-Length", str);
     }
 
-  http_add_header (&request->header, "Connection", "close");
+  http_add_header (&request->header, "Connection",
+		   dest->persistent ? "keep-alive" : "close");
 
   if (dest->proxy_authorization)
     http_add_header (&request->header, "Proxy-Authorization",
@@ -147,21 +158,21 @@ http_error_to_errno (int err)
 }
 
 static Http_method
-http_string_to_method (const char *method, size_t n)
+http_string_to_method (const char *method)
 {
-  if (strncmp (method, "GET", n) == 0)
+  if (strcmp (method, "GET") == 0)
     return HTTP_GET;
-  if (strncmp (method, "PUT", n) == 0)
+  if (strcmp (method, "PUT") == 0)
     return HTTP_PUT;
-  if (strncmp (method, "POST", n) == 0)
+  if (strcmp (method, "POST") == 0)
     return HTTP_POST;
-  if (strncmp (method, "OPTIONS", n) == 0)
+  if (strcmp (method, "OPTIONS") == 0)
     return HTTP_OPTIONS;
-  if (strncmp (method, "HEAD", n) == 0)
+  if (strcmp (method, "HEAD") == 0)
     return HTTP_HEAD;
-  if (strncmp (method, "DELETE", n) == 0)
+  if (strcmp (method, "DELETE") == 0)
     return HTTP_DELETE;
-  if (strncmp (method, "TRACE", n) == 0)
+  if (strcmp (method, "TRACE") == 0)
     return HTTP_TRACE;
   return -1;
 }
@@ -182,61 +193,6 @@ http_method_to_string (Http_method method)
   return "(uknown)";
 }
 
-static ssize_t
-read_until (int fd, int ch, char **data)
-{
-  char *buf, *buf2;
-  ssize_t n, len, buf_size;
-
-  *data = NULL;
-
-  buf_size = 100;
-  buf = malloc (buf_size);
-  if (buf == NULL)
-    {
-      log_error ("read_until: out of memory");
-      return -1;
-    }
-
-  len = 0;
-  while ((n = read_all (fd, buf + len, 1)) == 1)
-    {
-      if (buf[len++] == ch)
-	break;
-      if (len + 1 == buf_size)
-	{
-	  buf_size *= 2;
-	  buf2 = realloc (buf, buf_size);
-	  if (buf2 == NULL)
-	    {
-	      log_error ("read_until: realloc failed");
-	      free (buf);
-	      return -1;
-	    }
-	  buf = buf2;
-	}
-    }
-  if (n <= 0)
-    {
-      free (buf);
-      if (n == 0)
-	log_error ("read_until: closed");
-      else
-	log_error ("read_until: read error: %s", strerror (errno));
-      return n;
-    }
-
-  /* Shrink to minimum size + 1 in case someone wants to add a NUL. */
-  buf2 = realloc (buf, len + 1);
-  if (buf2 == NULL)
-    log_error ("read_until: realloc: shrink failed"); /* not fatal */
-  else
-    buf = buf2;
-
-  *data = buf;
-  return len;
-}
-
 static inline Http_header *
 http_alloc_header (const char *name, const char *value)
 {
@@ -279,123 +235,6 @@ http_add_header (Http_header **header, const char *name, const char *value)
   return new_header;
 }
 
-static ssize_t
-parse_header (int fd, Http_header **header)
-{
-  unsigned char buf[2];
-  char *data;
-  Http_header *h;
-  size_t len;
-  ssize_t n;
-
-  *header = NULL;
-
-  n = read_all (fd, buf, 2);
-  if (n <= 0)
-    return n;
-  if (buf[0] == '\r' && buf[1] == '\n')
-    return n;
-
-  h = malloc (sizeof (Http_header));
-  if (h == NULL)
-    {
-      log_error ("parse_header: malloc failed");
-      return -1;
-    }
-  *header = h;
-  h->name = NULL;
-  h->value = NULL;
-
-  n = read_until (fd, ':', &data);
-  if (n <= 0)
-    return n;
-  data = realloc (data, n + 2);
-  if (data == NULL)
-    {
-      log_error ("parse_header: realloc failed");
-      return -1;
-    }
-  memmove (data + 2, data, n);
-  memcpy (data, buf, 2);
-  n += 2;
-  data[n - 1] = 0;
-  h->name = data;
-  len = n;
-
-  n = read_until (fd, '\r', &data);
-  if (n <= 0)
-    return n;
-  data[n - 1] = 0;
-  h->value = data;
-  len += n;
-
-  n = read_until (fd, '\n', &data);
-  if (n <= 0)
-    return n;
-  free (data);
-  if (n != 1)
-    {
-      log_error ("parse_header: invalid line ending");
-      return -1;
-    }
-  len += n;
-
-  log_verbose ("parse_header: %s:%s", h->name, h->value);
-
-  n = parse_header (fd, &h->next);
-  if (n <= 0)
-    return n;
-  len += n;
-
-  return len;
-}
-
-static ssize_t
-http_write_header (int fd, Http_header *header)
-{
-  ssize_t n = 0, m;
-
-  if (header == NULL)
-    return write_all (fd, "\r\n", 2);
-
-  m = write_all (fd, (void *)header->name, strlen (header->name));
-  if (m == -1)
-    {
-      return -1;
-    }
-  n += m;
-
-  m = write_all (fd, ": ", 2);
-  if (m == -1)
-    {
-      return -1;
-    }
-  n += m;
-
-  m = write_all (fd, (void *)header->value, strlen (header->value));
-  if (m == -1)
-    {
-      return -1;
-    }
-  n += m;
-
-  m = write_all (fd, "\r\n", 2);
-  if (m == -1)
-    {
-      return -1;
-    }
-  n += m;
-
-  m = http_write_header (fd, header->next);
-  if (m == -1)
-    {
-      return -1;
-    }
-  n += m;
-
-  return n;
-}
-
 static void
 http_destroy_header (Http_header *header)
 {
@@ -450,121 +289,226 @@ http_create_response (int major_version,
   return response;
 }
 
+/*
+Make one read() from FD into BUF and look for the end of the header.
+BUF->LENGTH must be 0 before the first call.  Reads are as large as
+the buffer allows, so some of the message body may be read too; it's
+left in BUF after the header.  Return the header length once it's
+complete, 0 if the peer closed the connection, or -1 on error.  EAGAIN
+means that more of the header is still to come.
+*/
+
+/*
+Look for the end of the header in BUF, starting at SCANNED.
+*/
+
+static ssize_t
+http_find_header_end (Http_buffer *buf, size_t scanned)
+{
+  static const char end_of_header[] = "\r\n\r\n";
+  char *end;
+
+  for (end = buf->data + scanned;
+       end + 4 <= buf->data + buf->length;
+       end++)
+    {
+      if (memcmp (end, end_of_header, 4) == 0)
+	{
+	  buf->header_length = end + 4 - buf->data;
+	  return buf->header_length;
+	}
+    }
+
+  errno = EAGAIN;
+  return -1;
+}
+
 ssize_t
-http_parse_response (int fd, Http_response **response_)
+http_fill_header (int fd, Http_buffer *buf)
 {
-  Http_response *response;
-  char *data;
-  size_t len;
+  size_t scanned;
   ssize_t n;
 
-  *response_ = NULL;
-
-  response = malloc (sizeof (Http_response));
-  if (response == NULL)
+  if (buf->length == sizeof buf->data)
     {
-      log_error ("http_parse_response: out of memory");
+      log_error ("http_fill_header: header longer than %d bytes",
+		 sizeof buf->data);
+      errno = EIO;
       return -1;
     }
 
-  response->major_version = -1;
-  response->minor_version = -1;
-  response->status_code = -1;
-  response->status_message = NULL;
-  response->header = NULL;
+  /* The end of the header may straddle the previous read. */
+  scanned = buf->length < 3 ? 0 : buf->length - 3;
+  buf->header_length = 0;
 
-  n = read_until (fd, '/', &data);
-  if (n <= 0)
+  log_annoying ("read (%d, %p, %d) ...", fd, buf->data + buf->length,
+		sizeof buf->data - buf->length);
+  n = read (fd, buf->data + buf->length, sizeof buf->data - buf->length);
+  log_annoying ("... = %d", n);
+  if (n == 0)
     {
-      free (response);
-      return n;
+      log_error ("http_fill_header: closed");
+      return 0;
     }
-  else if (n != 5 || memcmp (data, "HTTP", 4) != 0)
+  else if (n == -1)
     {
-      log_error ("http_parse_response: expected \"HTTP\"");
-      free (data);
-      free (response);
+      if (errno != EAGAIN && errno != EINTR)
+	log_error ("http_fill_header: read error: %s", strerror (errno));
+      if (errno == EINTR)
+	errno = EAGAIN;
       return -1;
     }
-  free (data);
-  len = n;
 
-  n = read_until (fd, '.', &data);
-  if (n <= 0)
+  buf->length += n;
+  return http_find_header_end (buf, scanned);
+}
+
+/*
+Check whether BUF already holds a complete header, as when a message
+follows another one on a persistent connection.  Return values are as
+for http_fill_header().
+*/
+
+ssize_t
+http_buffered_header (Http_buffer *buf)
+{
+  buf->header_length = 0;
+  return http_find_header_end (buf, 0);
+}
+
+/*
+Return the next line of the header in BUF starting at *P, and move *P
+past it.  The line ending is replaced by a NUL.
+*/
+
+static char *
+http_next_line (Http_buffer *buf, char **p)
+{
+  char *end = buf->data + buf->header_length;
+  char *line = *p;
+  char *cr;
+
+  cr = memchr (line, '\r', end - line);
+  if (cr == NULL || cr + 1 == end || cr[1] != '\n')
     {
-      free (response);
-      return n;
+      log_error ("http_next_line: invalid line ending");
+      return NULL;
     }
-  data[n - 1] = 0;
-  response->major_version = atoi (data);
-  log_verbose ("http_parse_response: major version = %d",
-	       response->major_version);
-  free (data);
-  len += n;
-
-  n = read_until (fd, ' ', &data);
-  if (n <= 0)
+
+  *cr = 0;
+  *p = cr + 2;
+  return line;
+}
+
+/*
+Parse the header fields following the start line.  The fields are
+stored in BUF and point into its data.
+*/
+
+static int
+http_parse_fields (Http_buffer *buf, char *p, Http_header **header)
+{
+  Http_header **tail = header;
+  int n_fields = 0;
+  char *line, *value;
+
+  *header = NULL;
+
+  for (;;)
     {
-      free (response);
-      return n;
+      line = http_next_line (buf, &p);
+      if (line == NULL)
+	return -1;
+      if (*line == 0)
+	return 0;
+
+      value = strchr (line, ':');
+      if (value == NULL)
+	{
+	  log_error ("http_parse_fields: invalid header field: %s", line);
+	  return -1;
+	}
+      *value++ = 0;
+      while (*value == ' ' || *value == '\t')
+	value++;
+
+      log_verbose ("http_parse_fields: %s: %s", line, value);
+
+      if (n_fields == HTTP_MAX_FIELDS)
+	{
+	  log_debug ("http_parse_fields: too many fields; ignoring %s", line);
+	  continue;
+	}
+
+      buf->field[n_fields].name = line;
+      buf->field[n_fields].value = value;
+      buf->field[n_fields].next = NULL;
+      *tail = &buf->field[n_fields];
+      tail = &buf->field[n_fields].next;
+      n_fields++;
     }
-  data[n - 1] = 0;
-  response->minor_version = atoi (data);
-  log_verbose ("http_parse_response: minor version = %d",
-	       response->minor_version);
-  free (data);
-  len += n;
-
-  n = read_until (fd, ' ', &data);
-  if (n <= 0)
+}
+
+static int
+http_parse_version (const char *s, int *major_version, int *minor_version)
+{
+  const char *dot;
+
+  if (strncmp (s, "HTTP/", 5) != 0 || (dot = strchr (s + 5, '.')) == NULL)
+    return -1;
+
+  *major_version = atoi (s + 5);
+  *minor_version = atoi (dot + 1);
+  return 0;
+}
+
+int
+http_parse_response_header (Http_buffer *buf, Http_response *response)
+{
+  char *line, *p, *status;
+
+  response->major_version = -1;
+  response->minor_version = -1;
+  response->status_code = -1;
+  response->status_message = NULL;
+  response->header = NULL;
+
+  p = buf->data;
+  line = http_next_line (buf, &p);
+  if (line == NULL)
+    return -1;
+
+  status = strchr (line, ' ');
+  if (status == NULL ||
+      http_parse_version (line, &response->major_version,
+			  &response->minor_version) == -1)
     {
-      free (response);
-      return n;
+      log_error ("http_parse_response: expected \"HTTP\"");
+      errno = EIO;
+      return -1;
     }
-  data[n - 1] = 0;
-  response->status_code = atoi (data);
+  log_verbose ("http_parse_response: version = %d.%d",
+	       response->major_version, response->minor_version);
+
+  response->status_code = atoi (status + 1);
   log_verbose ("http_parse_response: status code = %d",
 	       response->status_code);
-  free (data);
-  len += n;
 
-  n = read_until (fd, '\r', &data);
-  if (n <= 0)
-    {
-      free (response);
-      return n;
-    }
-  data[n - 1] = 0;
-  response->status_message = data;
+  response->status_message = strchr (status + 1, ' ');
+  if (response->status_message == NULL)
+    response->status_message = "";
+  else
+    response->status_message++;
   log_verbose ("http_parse_response: status message = \"%s\"",
 	       response->status_message);
-  len += n;
 
-  n = read_until (fd, '\n', &data);
-  if (n <= 0)
-    {
-      http_destroy_response (response);
-      return n;
-    }
-  free (data);
-  if (n != 1)
+  if (http_parse_fields (buf, p, &response->header) == -1)
     {
-      log_error ("http_parse_request: invalid line ending");
-      http_destroy_response (response);
+      errno = EIO;
       return -1;
     }
-  len += n;
 
-  n = parse_header (fd, &response->header);
-  if (n <= 0)
-    {
-      http_destroy_response (response);
-      return n;
-    }
-  len += n;
-
-  *response_ = response;
-  return len;
+  return 0;
 }
 
 void
@@ -615,22 +559,10 @@ http_create_request (Http_method method,
   return request;
 }
 
-ssize_t
-http_parse_request (int fd, Http_request **request_)
+int
+http_parse_request_header (Http_buffer *buf, Http_request *request)
 {
-  Http_request *request;
-  char *data;
-  size_t len;
-  ssize_t n;
-
-  *request_ = NULL;
-
-  request = malloc (sizeof (Http_request));
-  if (request == NULL)
-    {
-      log_error ("http_parse_request: out of memory");
-      return -1;
-    }
+  char *line, *p, *uri, *version;
 
   request->method = -1;
   request->uri = NULL;
@@ -638,132 +570,102 @@ http_parse_request (int fd, Http_request **request_)
   request->minor_version = -1;
   request->header = NULL;
 
-  n = read_until (fd, ' ', &data);
-  if (n <= 0)
+  p = buf->data;
+  line = http_next_line (buf, &p);
+  if (line == NULL)
+    return -1;
+
+  uri = strchr (line, ' ');
+  version = strrchr (line, ' ');
+  if (uri == NULL || version == uri)
     {
-      free (request);
-      return n;
+      log_error ("http_parse_request: invalid request line: %s", line);
+      errno = EIO;
+      return -1;
     }
-  request->method = http_string_to_method (data, n - 1);
+  *uri++ = 0;
+  *version++ = 0;
+
+  request->method = http_string_to_method (line);
   if (request->method == -1)
     {
       log_error ("http_parse_request: expected an HTTP method");
-      free (data);
-      free (request);
+      errno = EIO;
       return -1;
     }
-  data[n - 1] = 0;
-  log_verbose ("http_parse_request: method = \"%s\"", data);
-  free (data);
-  len = n;
+  log_verbose ("http_parse_request: method = \"%s\"", line);
 
-  n = read_until (fd, ' ', &data);
-  if (n <= 0)
-    {
-      free (request);
-      return n;
-    }
-  data[n - 1] = 0;
-  request->uri = data;
-  len += n;
+  request->uri = uri;
   log_verbose ("http_parse_request: uri = \"%s\"", request->uri);
 
-  n = read_until (fd, '/', &data);
-  if (n <= 0)
-    {
-      http_destroy_request (request);
-      return n;
-    }
-  else if (n != 5 || memcmp (data, "HTTP", 4) != 0)
+  if (http_parse_version (version, &request->major_version,
+			  &request->minor_version) == -1)
     {
       log_error ("http_parse_request: expected \"HTTP\"");
-      free (data);
-      http_destroy_request (request);
+      errno = EIO;
       return -1;
     }
-  free (data);
-  len = n;
+  log_verbose ("http_parse_request: version = %d.%d",
+	       request->major_version, request->minor_version);
 
-  n = read_until (fd, '.', &data);
-  if (n <= 0)
-    {
-      http_destroy_request (request);
-      return n;
-    }
-  data[n - 1] = 0;
-  request->major_version = atoi (data);
-  log_verbose ("http_parse_request: major version = %d",
-	       request->major_version);
-  free (data);
-  len += n;
-
-  n = read_until (fd, '\r', &data);
-  if (n <= 0)
-    {
-      http_destroy_request (request);
-      return n;
-    }
-  data[n - 1] = 0;
-  request->minor_version = atoi (data);
-  log_verbose ("http_parse_request: minor version = %d",
-	       request->minor_version);
-  free (data);
-  len += n;
-
-  n = read_until (fd, '\n', &data);
-  if (n <= 0)
-    {
-      http_destroy_request (request);
-      return n;
-    }
-  free (data);
-  if (n != 1)
+  if (http_parse_fields (buf, p, &request->header) == -1)
     {
-      log_error ("http_parse_request: invalid line ending");
-      http_destroy_request (request);
+      errno = EIO;
       return -1;
     }
-  len += n;
-
-  n = parse_header (fd, &request->header);
-  if (n <= 0)
-    {
-      http_destroy_request (request);
-      return n;
-    }
-  len += n;
 
-  *request_ = request;
- return len;
+  return 0;
 }
 
+/*
+Write the header of REQUEST, ending with an empty line, to STR, which
+has room for SIZE bytes.  Return its length, or -1 if it doesn't fit.
+*/
+
 ssize_t
-http_write_request (int fd, Http_request *request)
+http_format_request (Http_request *request, char *str, size_t size)
 {
-  char str[1024];
-  ssize_t n = 0;
-  size_t m;
-
-  m = snprintf (str, sizeof(str), "%s %s HTTP/%d.%d\r\n",
-	       http_method_to_string (request->method),
-	       request->uri,
-	       request->major_version,
-	       request->minor_version);
-  m = write_all (fd, str, m);
-  log_verbose ("http_write_request: %s", str);
-  if (m == -1)
+  Http_header *header;
+  size_t n;
+
+  n = snprintf (str, size, "%s %s HTTP/%d.%d\r\n",
+		http_method_to_string (request->method),
+		request->uri,
+		request->major_version,
+		request->minor_version);
+  log_verbose ("http_format_request: %s", str);
+
+  for (header = request->header;
+       header != NULL && n < size;
+       header = header->next)
+    n += snprintf (str + n, size - n, "%s: %s\r\n",
+		   header->name, header->value);
+
+  if (n + 2 > size)
     {
-      log_error ("http_write_request: write error: %s", strerror (errno));
+      log_error ("http_format_request: request longer than %d bytes", size);
+      errno = EIO;
       return -1;
     }
-  n += m;
+  memcpy (str + n, "\r\n", 2);
+  return n + 2;
+}
 
-  m = http_write_header (fd, request->header);
-  if (m == -1)
+ssize_t
+http_write_request (int fd, Http_request *request)
+{
+  char str[HTTP_BUFFER_SIZE];
+  ssize_t n;
+
+  n = http_format_request (request, str, sizeof str);
+  if (n == -1)
+    return -1;
+
+  if (write_all (fd, str, n) == -1)
     {
+      log_error ("http_write_request: write error: %s", strerror (errno));
       return -1;
     }
-  n += m;
 
   return n;
 }
@@ -783,7 +685,7 @@ http_header_find (Http_header *header, const char *name)
   if (header == NULL)
     return NULL;
 
-  if (strcmp (header->name, name) == 0)
+  if (strcasecmp (header->name, name) == 0)
     return header;
 
   return http_header_find (header->next, name);
@@ -801,6 +703,44 @@ http_header_get (Http_header *header, const char *name)
   return h->value;
 }
 
+/*
+Return TRUE if the connection a message with HEADER was sent on stays
+open after the message.  That's the default in HTTP/1.1, and optional
+in HTTP/1.0.
+*/
+
+int
+http_persistent (int major_version, int minor_version, Http_header *header)
+{
+  const char *connection;
+
+  connection = http_header_get (header, "Connection");
+  if (connection != NULL && strcasecmp (connection, "close") == 0)
+    return FALSE;
+  if (major_version == 1 && minor_version >= 1)
+    return TRUE;
+  return (connection != NULL && strcasecmp (connection, "keep-alive") == 0);
+}
+
+/*
+Return TRUE if a message with HEADER has a chunked body.  Chunked must
+be the last transfer coding applied.
+*/
+
+int
+http_chunked (Http_header *header)
+{
+  const char *coding;
+  size_t n;
+
+  coding = http_header_get (header, "Transfer-Encoding");
+  if (coding == NULL)
+    return FALSE;
+
+  n = strlen (coding);
+  return n >= 7 && strcasecmp (coding + n - 7, "chunked") == 0;
+}
+
 #if 0
 void
 http_header_set (Http_header **header, const char *name, const char *value)
@@ -45,6 +45,21 @@ typedef struct
    Http_header *header;
 } Http_response;
 
+#define HTTP_BUFFER_SIZE 8192 /* bytes */
+#define HTTP_MAX_FIELDS 32
+
+/* A received HTTP header.  Requests and responses parsed from it
+   point into DATA, so it must outlive them.  Header data is read in
+   large chunks, so DATA may also hold the start of the message body,
+   from HEADER_LENGTH to LENGTH. */
+typedef struct
+{
+  char data[HTTP_BUFFER_SIZE];
+  size_t length;		/* bytes read into DATA */
+  size_t header_length;		/* bytes of DATA taken by the header */
+  Http_header field[HTTP_MAX_FIELDS];
+} Http_buffer;
+
 typedef struct
 {
   const char *host_name;
@@ -54,6 +69,10 @@ typedef struct
   const char *proxy_authorization;
   const char *user_agent;
   const char *base_uri;
+  const char *session;		/* identifies the tunnel to the server */
+  unsigned long sequence;	/* numbers POSTs and PUTs, if nonzero */
+  int persistent;		/* ask for persistent connections */
+  int chunked;			/* send request bodies chunked */
 } Http_destination;
 
 extern ssize_t http_get (int fd, Http_destination *dest);
@@ -67,7 +86,10 @@ extern Http_response *http_create_response (int major_version,
 					    int minor_version,
 					    int status_code,
 					    const char *status_message);
-extern ssize_t http_parse_response (int fd, Http_response **response);
+extern ssize_t http_fill_header (int fd, Http_buffer *buf);
+extern ssize_t http_buffered_header (Http_buffer *buf);
+extern int http_parse_response_header (Http_buffer *buf,
+				       Http_response *response);
 extern void http_destroy_response (Http_response *response);
 
 extern Http_header *http_add_header (Http_header **header,
@@ -78,8 +100,14 @@ extern Http_request *http_create_request (Http_method method,
 					  const char *uri,
 					  int major_version,
 					  int minor_version);
-extern ssize_t http_parse_request (int fd, Http_request **request);
+extern int http_parse_request_header (Http_buffer *buf,
+				      Http_request *request);
+extern ssize_t http_format_request (Http_request *request,
+				    char *str, size_t size);
 extern ssize_t http_write_request (int fd, Http_request *request);
 extern void http_destroy_request (Http_request *resquest);
 
 extern const char *http_header_get (Http_header *header, const char *name);
+extern int http_persistent (int major_version, int minor_version,
+			    Http_header *header);
+extern int http_chunked (Http_header *header);
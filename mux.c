@@ -0,0 +1,768 @@
+/*
+mux.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+See mux.h for some documentation about the programming interface.
+*/
+
+#include "config.h"
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "mux.h"
+#include "common.h"
+
+#define MUX_HEADER 5 /* bytes: type, stream id, length */
+#define MUX_DATA_MAX 65535 /* bytes in one frame */
+#define MUX_BATCH 4 /* frames read at once; see mux_stream_read() */
+#define MUX_WINDOW (256 * 1024) /* bytes a stream may have unwritten */
+#define MUX_BUCKETS 64 /* stream hash table size; must be a power of 2 */
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+enum mux_frame
+{
+  MUX_OPEN = 1,
+  MUX_DATA = 2,
+  MUX_CLOSE = 3,
+  MUX_WINDOW_UPDATE = 4
+};
+
+typedef struct mux_stream Mux_stream;
+
+/* Data received for a stream is written to FD right away if it can
+   be, and queued otherwise.  The peer sends no more than the window
+   it has been given, so the queue never holds more than MUX_WINDOW
+   bytes.  Credit for written bytes is given back in MUX_WINDOW_UPDATE
+   frames, half a window at a time. */
+struct mux_stream
+{
+  unsigned int id;
+  int fd;			/* or -1 if it couldn't be connected */
+  int connecting;		/* FD isn't connected yet */
+  int events;			/* as polled */
+  int sent_close;		/* MUX_CLOSE sent; FD isn't read any more */
+  int got_close;		/* MUX_CLOSE received */
+  int failed;			/* FD couldn't be written */
+  size_t send_window;		/* bytes the peer will take */
+  size_t recv_window;		/* bytes the peer may send */
+  size_t consumed;		/* written to FD, not yet credited */
+  char *queue;			/* MUX_WINDOW bytes, or NULL */
+  size_t queue_start;
+  size_t queue_len;
+  Mux *mux;
+  Mux_stream *next;
+};
+
+struct mux
+{
+  Event_loop *loop;
+  Tunnel *tunnel;
+  Mux_connect *connect;
+  Mux_update *update;
+  void *data;
+  int *closed;
+  int input;			/* streams are polled for input */
+  unsigned int next_id;
+  int count;
+  Mux_stream *streams[MUX_BUCKETS];
+  size_t in_len;
+  unsigned char in_buf[2 * (MUX_HEADER + MUX_DATA_MAX)];
+};
+
+static Mux_stream **
+mux_bucket (Mux *mux, unsigned int id)
+{
+  return &mux->streams[id & (MUX_BUCKETS - 1)];
+}
+
+static Mux_stream *
+mux_lookup (Mux *mux, unsigned int id)
+{
+  Mux_stream *stream;
+
+  for (stream = *mux_bucket (mux, id); stream != NULL; stream = stream->next)
+    if (stream->id == id)
+      return stream;
+
+  return NULL;
+}
+
+static void
+mux_header (unsigned char *frame, enum mux_frame type, unsigned int id,
+	    size_t length)
+{
+  frame[0] = type;
+  frame[1] = (id >> 8) & 0xff;
+  frame[2] = id & 0xff;
+  frame[3] = (length >> 8) & 0xff;
+  frame[4] = length & 0xff;
+}
+
+/*
+Write LENGTH bytes of complete frames from FRAMES to the tunnel.
+*/
+
+static int
+mux_write (Mux *mux, unsigned char *frames, size_t length)
+{
+  ssize_t n;
+
+  n = tunnel_write (mux->tunnel, frames, length);
+  log_annoying ("tunnel_write (%p, %p, %d) = %d",
+		mux->tunnel, frames, length, n);
+  if (n != length)
+    {
+      log_error ("mux_write: tunnel_write error: %s", strerror (errno));
+      *mux->closed = TRUE;
+      return -1;
+    }
+
+  return 0;
+}
+
+/*
+Send a frame of TYPE for stream ID.  The LENGTH bytes of data follow
+room for the header at the start of FRAME.
+*/
+
+static int
+mux_send (Mux *mux, enum mux_frame type, unsigned int id,
+	  unsigned char *frame, size_t length)
+{
+  mux_header (frame, type, id, length);
+  return mux_write (mux, frame, MUX_HEADER + length);
+}
+
+static void
+mux_stream_destroy (Mux_stream *stream)
+{
+  Mux *mux = stream->mux;
+  Mux_stream **sp;
+
+  for (sp = mux_bucket (mux, stream->id); *sp != NULL; sp = &(*sp)->next)
+    if (*sp == stream)
+      {
+	*sp = stream->next;
+	mux->count--;
+	break;
+      }
+
+  log_debug ("stream %u closed", stream->id);
+  if (stream->fd != -1)
+    {
+      event_remove (mux->loop, stream->fd);
+      close (stream->fd);
+    }
+  if (stream->queue != NULL)
+    free (stream->queue);
+  free (stream);
+}
+
+/*
+Poll STREAM for input if the peer can take it, and for output if
+there's something queued.
+*/
+
+static void
+mux_stream_poll (Mux_stream *stream)
+{
+  int events = 0;
+
+  if (stream->fd == -1)
+    return;
+
+  if (stream->connecting)
+    events = POLLOUT;
+  else
+    {
+      if (stream->mux->input && !stream->sent_close &&
+	  stream->send_window > 0)
+	events |= POLLIN;
+      if (stream->queue_len > 0)
+	events |= POLLOUT;
+    }
+
+  if (events != stream->events)
+    {
+      event_modify (stream->mux->loop, stream->fd, events);
+      stream->events = events;
+    }
+}
+
+/*
+Destroy STREAM if both ends have closed it, and everything received
+has been written.  Otherwise, bring its polling up to date.  Return
+TRUE if it was destroyed.
+*/
+
+static int
+mux_stream_check (Mux_stream *stream)
+{
+  if (stream->sent_close && stream->got_close && stream->queue_len == 0)
+    {
+      mux_stream_destroy (stream);
+      return TRUE;
+    }
+
+  mux_stream_poll (stream);
+  return FALSE;
+}
+
+/*
+Tell the peer that STREAM won't send any more data, and stop reading
+it.  The stream is gone once both ends have done this.  Return TRUE
+if it was destroyed.
+*/
+
+static int
+mux_stream_close (Mux_stream *stream)
+{
+  unsigned char frame[MUX_HEADER];
+
+  if (!stream->sent_close)
+    {
+      stream->sent_close = TRUE;
+      mux_send (stream->mux, MUX_CLOSE, stream->id, frame, 0);
+    }
+
+  return mux_stream_check (stream);
+}
+
+/*
+Write as much of STREAM's queue as FD takes.
+*/
+
+static int
+mux_stream_flush (Mux_stream *stream)
+{
+  ssize_t n;
+
+  while (stream->queue_len > 0)
+    {
+      n = write (stream->fd, stream->queue + stream->queue_start,
+		 stream->queue_len);
+      log_annoying ("write (%d, %p, %d) = %d", stream->fd,
+		    stream->queue + stream->queue_start, stream->queue_len, n);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return errno == EAGAIN ? 0 : -1;
+	}
+
+      stream->queue_start += n;
+      stream->queue_len -= n;
+      stream->consumed += n;
+    }
+
+  stream->queue_start = 0;
+  return 0;
+}
+
+/*
+Write LENGTH bytes of DATA received for STREAM, and queue what FD
+doesn't take right away.
+*/
+
+static int
+mux_stream_write (Mux_stream *stream, unsigned char *data, size_t length)
+{
+  ssize_t n = 0;
+
+  if (stream->queue_len == 0 && !stream->connecting)
+    {
+      n = write (stream->fd, data, length);
+      log_annoying ("write (%d, %p, %d) = %d", stream->fd, data, length, n);
+      if (n == -1)
+	{
+	  if (errno != EAGAIN && errno != EINTR)
+	    return -1;
+	  n = 0;
+	}
+      stream->consumed += n;
+      if (n == length)
+	return 0;
+    }
+
+  if (stream->queue == NULL)
+    {
+      stream->queue = malloc (MUX_WINDOW);
+      if (stream->queue == NULL)
+	{
+	  log_error ("mux_stream_write: out of memory");
+	  errno = ENOMEM;
+	  return -1;
+	}
+    }
+
+  if (stream->queue_start + stream->queue_len + length - n > MUX_WINDOW)
+    {
+      memmove (stream->queue, stream->queue + stream->queue_start,
+	       stream->queue_len);
+      stream->queue_start = 0;
+    }
+  memcpy (stream->queue + stream->queue_start + stream->queue_len,
+	  data + n, length - n);
+  stream->queue_len += length - n;
+  log_verbose ("stream %u: %d bytes queued", stream->id, stream->queue_len);
+  return 0;
+}
+
+/*
+Follow up on writing to STREAM, which returned STATUS: give up on the
+stream if it failed, shut down FD once the peer has closed the
+stream and all is written, and give the peer more credit.  Return
+TRUE if STREAM was destroyed.
+*/
+
+static int
+mux_stream_written (Mux_stream *stream, int status)
+{
+  unsigned char frame[MUX_HEADER + 4];
+
+  if (status == -1)
+    {
+      log_error ("stream %u write error: %s", stream->id, strerror (errno));
+      stream->failed = TRUE;
+      stream->queue_len = 0;
+      return mux_stream_close (stream);
+    }
+
+  if (stream->got_close && stream->queue_len == 0 && stream->fd != -1 &&
+      !stream->connecting)
+    shutdown (stream->fd, SHUT_WR);
+
+  if (!stream->got_close && stream->consumed >= MUX_WINDOW / 2)
+    {
+      frame[MUX_HEADER] = (stream->consumed >> 24) & 0xff;
+      frame[MUX_HEADER + 1] = (stream->consumed >> 16) & 0xff;
+      frame[MUX_HEADER + 2] = (stream->consumed >> 8) & 0xff;
+      frame[MUX_HEADER + 3] = stream->consumed & 0xff;
+      log_verbose ("stream %u: %d bytes of credit",
+		   stream->id, stream->consumed);
+      stream->recv_window += stream->consumed;
+      stream->consumed = 0;
+      mux_send (stream->mux, MUX_WINDOW_UPDATE, stream->id, frame, 4);
+    }
+
+  return mux_stream_check (stream);
+}
+
+/*
+Read from STREAM no more than its peer has room for, and send it.
+The data is read straight into the frames, up to MUX_BATCH of them,
+which go to the tunnel together, so bulk data is sent in large
+TUNNEL_DATA32 requests.
+*/
+
+static void
+mux_stream_read (Mux_stream *stream)
+{
+  static unsigned char frames[MUX_BATCH * (MUX_HEADER + MUX_DATA_MAX)];
+  struct iovec iov[MUX_BATCH];
+  size_t length;
+  ssize_t n;
+  int i;
+
+  /* The frames fit in one request. */
+  length = min (stream->send_window,
+		min (MUX_BATCH * MUX_DATA_MAX,
+		     TUNNEL_DATA_MAX - MUX_BATCH * MUX_HEADER));
+  for (i = 0; i * MUX_DATA_MAX < length; i++)
+    {
+      iov[i].iov_base = frames + i * (MUX_HEADER + MUX_DATA_MAX) + MUX_HEADER;
+      iov[i].iov_len = min (length - i * MUX_DATA_MAX, MUX_DATA_MAX);
+    }
+
+  n = readv (stream->fd, iov, i);
+  log_annoying ("readv (%d, %p, %d) = %d", stream->fd, iov, i, n);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (n > 0)
+    {
+      stream->send_window -= n;
+      /* Every frame but the last is full, so they follow each other. */
+      for (i = 0; i * MUX_DATA_MAX < n; i++)
+	mux_header (frames + i * (MUX_HEADER + MUX_DATA_MAX), MUX_DATA,
+		    stream->id, min (n - i * MUX_DATA_MAX, MUX_DATA_MAX));
+      if (mux_write (stream->mux, frames, i * MUX_HEADER + n) == 0)
+	mux_stream_poll (stream);
+    }
+  else
+    {
+      if (n == -1)
+	log_error ("stream %u read error: %s", stream->id, strerror (errno));
+      mux_stream_close (stream);
+    }
+}
+
+/*
+Finish connecting STREAM when its FD polls writable, and write what
+has been queued for it.  If the connection failed, the stream is
+closed.  Return TRUE if it was destroyed.
+*/
+
+static int
+mux_stream_connected (Mux_stream *stream)
+{
+  Mux *mux = stream->mux;
+
+  stream->connecting = FALSE;
+  if (connect_result (stream->fd) == 0)
+    {
+      log_debug ("stream %u connected", stream->id);
+      return mux_stream_written (stream, mux_stream_flush (stream));
+    }
+
+  log_error ("stream %u couldn't connect: %s", stream->id, strerror (errno));
+  event_remove (mux->loop, stream->fd);
+  close (stream->fd);
+  stream->fd = -1;
+  stream->failed = TRUE;
+  stream->queue_len = 0;
+  return mux_stream_close (stream);
+}
+
+static void
+mux_stream_event (Event_loop *loop, int fd, int events, void *data)
+{
+  Mux_stream *stream = data;
+  Mux *mux = stream->mux;
+  int done = FALSE;
+
+  /* STREAM isn't touched again once it has been destroyed. */
+  if (stream->connecting &&
+      (mux_stream_connected (stream) || stream->fd == -1))
+    done = TRUE;
+  else if (stream->queue_len > 0 && (events & (POLLOUT | POLLERR | POLLHUP)))
+    done = mux_stream_written (stream, mux_stream_flush (stream));
+
+  if (!done && (events & ~POLLOUT) && (stream->events & POLLIN))
+    mux_stream_read (stream);
+
+  mux->update (mux->data);
+}
+
+static Mux_stream *
+mux_stream_new (Mux *mux, unsigned int id, int fd, int connecting)
+{
+  Mux_stream *stream;
+
+  stream = malloc (sizeof (Mux_stream));
+  if (stream == NULL)
+    {
+      log_error ("mux_stream_new: out of memory");
+      return NULL;
+    }
+
+  stream->id = id;
+  stream->fd = fd;
+  stream->connecting = connecting && fd != -1;
+  stream->events = stream->connecting ? POLLOUT : mux->input ? POLLIN : 0;
+  stream->sent_close = FALSE;
+  stream->got_close = FALSE;
+  stream->failed = FALSE;
+  stream->send_window = MUX_WINDOW;
+  stream->recv_window = MUX_WINDOW;
+  stream->consumed = 0;
+  stream->queue = NULL;
+  stream->queue_start = 0;
+  stream->queue_len = 0;
+  stream->mux = mux;
+
+  if (fd != -1 &&
+      (set_nonblocking (fd) == -1 ||
+       event_add (mux->loop, fd, stream->events,
+		  mux_stream_event, stream) == -1))
+    {
+      log_error ("mux_stream_new: couldn't poll stream: %s",
+		 strerror (errno));
+      free (stream);
+      return NULL;
+    }
+
+  stream->next = *mux_bucket (mux, id);
+  *mux_bucket (mux, id) = stream;
+  mux->count++;
+
+  log_debug ("stream %u opened", id);
+  return stream;
+}
+
+/*
+Handle a frame received from the peer.  Return -1 if the peer has
+broken the protocol.  Failures to write to the tunnel are reported
+through *mux->closed.
+*/
+
+static int
+mux_frame (Mux *mux, enum mux_frame type, unsigned int id,
+	   unsigned char *data, size_t length)
+{
+  Mux_stream *stream = mux_lookup (mux, id);
+  int fd;
+
+  log_verbose ("mux_frame: type %d, stream %u, %d bytes", type, id, length);
+
+  switch (type)
+    {
+    case MUX_OPEN:
+      if (stream != NULL)
+	{
+	  log_error ("mux_frame: stream %u opened twice", id);
+	  errno = EIO;
+	  return -1;
+	}
+
+      fd = mux->connect != NULL ? mux->connect (mux->data) : -1;
+      stream = mux_stream_new (mux, id, fd, TRUE);
+      if (stream == NULL)
+	{
+	  if (fd != -1)
+	    close (fd);
+	  errno = ENOMEM;
+	  return -1;
+	}
+
+      /* The peer still has to close its end. */
+      if (fd == -1)
+	{
+	  stream->failed = TRUE;
+	  mux_stream_close (stream);
+	}
+      break;
+
+    case MUX_DATA:
+      if (stream == NULL || stream->got_close)
+	{
+	  log_verbose ("mux_frame: data for stream %u dropped", id);
+	  break;
+	}
+
+      if (length > stream->recv_window)
+	{
+	  log_error ("mux_frame: stream %u overran its window", id);
+	  errno = EIO;
+	  return -1;
+	}
+      stream->recv_window -= length;
+
+      if (stream->failed)
+	break;
+      mux_stream_written (stream, mux_stream_write (stream, data, length));
+      break;
+
+    case MUX_CLOSE:
+      if (stream == NULL)
+	break;
+
+      stream->got_close = TRUE;
+      mux_stream_written (stream, 0);
+      break;
+
+    case MUX_WINDOW_UPDATE:
+      if (length != 4)
+	{
+	  log_error ("mux_frame: bad window update for stream %u", id);
+	  errno = EIO;
+	  return -1;
+	}
+
+      if (stream == NULL)
+	break;
+
+      stream->send_window += ((size_t)data[0] << 24) | (data[1] << 16) |
+			     (data[2] << 8) | data[3];
+      mux_stream_poll (stream);
+      break;
+
+    default:
+      log_error ("mux_frame: unknown frame type %d", type);
+      errno = EIO;
+      return -1;
+    }
+
+  return 0;
+}
+
+Mux *
+mux_new (Event_loop *loop, Tunnel *tunnel,
+	 Mux_connect *connect, Mux_update *update, void *data, int *closed)
+{
+  Mux *mux;
+  int i;
+
+  mux = malloc (sizeof (Mux));
+  if (mux == NULL)
+    {
+      log_error ("mux_new: out of memory");
+      return NULL;
+    }
+
+  mux->loop = loop;
+  mux->tunnel = tunnel;
+  mux->connect = connect;
+  mux->update = update;
+  mux->data = data;
+  mux->closed = closed;
+  mux->input = TRUE;
+  mux->next_id = 1;
+  mux->count = 0;
+  for (i = 0; i < MUX_BUCKETS; i++)
+    mux->streams[i] = NULL;
+  mux->in_len = 0;
+
+  return mux;
+}
+
+int
+mux_open (Mux *mux, int fd)
+{
+  unsigned char frame[MUX_HEADER];
+  Mux_stream *stream;
+  unsigned int id;
+  int i;
+
+  /* Stream ids are reused once both ends are done with them. */
+  for (i = 0; i < 65535; i++)
+    {
+      id = mux->next_id;
+      mux->next_id = mux->next_id == 65535 ? 1 : mux->next_id + 1;
+      if (mux_lookup (mux, id) == NULL)
+	break;
+    }
+  if (i == 65535)
+    {
+      log_error ("mux_open: too many streams");
+      close (fd);
+      errno = EAGAIN;
+      return -1;
+    }
+
+  stream = mux_stream_new (mux, id, fd, FALSE);
+  if (stream == NULL)
+    {
+      close (fd);
+      return -1;
+    }
+
+  if (mux_send (mux, MUX_OPEN, id, frame, 0) == -1)
+    {
+      mux_stream_destroy (stream);
+      return -1;
+    }
+
+  return 0;
+}
+
+/*
+Handle all complete frames in the input buffer, and keep the rest
+for later.
+*/
+
+static int
+mux_frames (Mux *mux)
+{
+  unsigned char *p = mux->in_buf;
+  unsigned char *end = mux->in_buf + mux->in_len;
+  size_t length;
+  int n = 0;
+
+  while (end - p >= MUX_HEADER)
+    {
+      length = (p[3] << 8) | p[4];
+      if (end - p < MUX_HEADER + length)
+	break;
+
+      n = mux_frame (mux, p[0], (p[1] << 8) | p[2], p + MUX_HEADER, length);
+      if (n == -1)
+	break;
+      p += MUX_HEADER + length;
+    }
+
+  mux->in_len = end - p;
+  memmove (mux->in_buf, p, mux->in_len);
+  return n;
+}
+
+void
+mux_tunnel_input (Mux *mux)
+{
+  ssize_t n;
+  int multiplex;
+
+  /* Handle everything the tunnel has buffered, since poll() won't
+     report it. */
+  do
+    {
+      n = tunnel_read (mux->tunnel, mux->in_buf + mux->in_len,
+		       sizeof mux->in_buf - mux->in_len);
+      log_annoying ("tunnel_read (%p, %p, %d) = %d",
+		    mux->tunnel, mux->in_buf + mux->in_len,
+		    sizeof mux->in_buf - mux->in_len, n);
+      if (n == -1 && errno == EAGAIN)
+	{
+	  /* If the server has answered that it can't multiplex, what
+	     follows isn't frames. */
+	  tunnel_getopt (mux->tunnel, "multiplex", &multiplex);
+	  if (multiplex == 0)
+	    return;
+	  continue;
+	}
+      else if (n <= 0)
+	break;
+
+      mux->in_len += n;
+      if (mux_frames (mux) == -1)
+	{
+	  n = -1;
+	  break;
+	}
+    }
+  while (tunnel_pending (mux->tunnel));
+
+  if (n == 0)
+    log_debug ("tunnel closed");
+  else if (n == -1 && errno != EAGAIN)
+    log_error ("tunnel read error: %s", strerror (errno));
+  else
+    return;
+  *mux->closed = TRUE;
+}
+
+void
+mux_set_input (Mux *mux, int on)
+{
+  Mux_stream *stream;
+  int i;
+
+  on = on ? TRUE : FALSE;
+  if (on == mux->input)
+    return;
+
+  mux->input = on;
+  for (i = 0; i < MUX_BUCKETS; i++)
+    for (stream = mux->streams[i]; stream != NULL; stream = stream->next)
+      mux_stream_poll (stream);
+}
+
+int
+mux_streams (Mux *mux)
+{
+  return mux->count;
+}
+
+void
+mux_destroy (Mux *mux)
+{
+  int i;
+
+  for (i = 0; i < MUX_BUCKETS; i++)
+    while (mux->streams[i] != NULL)
+      mux_stream_destroy (mux->streams[i]);
+
+  free (mux);
+}
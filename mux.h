@@ -0,0 +1,72 @@
+/*
+mux.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+This is the interface to the stream multiplexer, which carries many
+TCP connections in one tunnel.  Each connection is a stream, and its
+data is sent in frames which carry a stream id.  The frames are data
+to the tunnel; see HACKING for their format.  Each stream has a
+window of data which the peer may send before it's been written, so
+a stream whose connection is slow to take data doesn't hold up the
+others.  It consists of the following functions:
+
+Mux *mux_new (Event_loop *loop, Tunnel *tunnel,
+              Mux_connect *connect, Mux_update *update, void *data,
+              int *closed);
+
+  Create a multiplexer that sends and receives stream frames through
+  TUNNEL.  The streams are polled by LOOP.  CONNECT (DATA) is called
+  when the peer opens a stream, and should return a socket for it,
+  or -1; it's NULL if the peer may not open streams.  The socket may
+  still be connecting without blocking; the stream's data is queued
+  until it polls writable.
+  UPDATE (DATA) is called after stream input has been written to the
+  tunnel.  If that fails, *CLOSED is set first.
+
+int mux_open (Mux *mux, int fd);
+
+  Open a new stream to the peer, carrying the connection FD.  The
+  multiplexer then owns FD, and closes it if no stream can be opened.
+  Return -1 in that case.
+
+void mux_tunnel_input (Mux *mux);
+
+  Read everything the tunnel has, and pass it on to the streams.  If
+  the tunnel is closed, or fails, *CLOSED is set.  If the server
+  answers that it can't multiplex, the rest is left in the tunnel.
+
+void mux_set_input (Mux *mux, int on);
+
+  Stop reading the streams if ON is zero, for instance while the
+  tunnel can't be written to, and start again if it's nonzero.
+
+int mux_streams (Mux *mux);
+
+  Return the number of open streams.
+
+void mux_destroy (Mux *mux);
+
+  Close all streams and free the multiplexer.  The tunnel is left
+  alone.  */
+
+#ifndef MUX_H
+#define MUX_H
+
+#include "tunnel.h"
+#include "event.h"
+
+typedef struct mux Mux;
+typedef int Mux_connect (void *data);
+typedef void Mux_update (void *data);
+
+extern Mux *mux_new (Event_loop *loop, Tunnel *tunnel,
+		     Mux_connect *connect, Mux_update *update, void *data,
+		     int *closed);
+extern int mux_open (Mux *mux, int fd);
+extern void mux_tunnel_input (Mux *mux);
+extern void mux_set_input (Mux *mux, int on);
+extern int mux_streams (Mux *mux);
+extern void mux_destroy (Mux *mux);
+
+#endif /* MUX_H */
@@ -6,7 +6,13 @@ Copyright (C) 1999, 2000 Lars Brinkhoff.  See COPYING for terms and conditions.
 See tunnel.h for some documentation about the programming interface.
 */
 
+#include "config.h"
+#ifdef HAVE_SPLICE
+#define _GNU_SOURCE /* for splice() */
+#endif
+
 #include <time.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <netdb_.h>
 #include <fcntl.h>
@@ -14,7 +20,11 @@ See tunnel.h for some documentation about the programming interface.
 #include <sys/poll_.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #include "http.h"
 #include "tunnel.h"
@@ -23,8 +33,21 @@ See tunnel.h for some documentation about the programming interface.
 /* #define IO_COUNT_HTTP_HEADER */
 /* #define USE_SHUTDOWN */
 
-#define READ_TRAIL_TIMEOUT (1 * 1000) /* milliseconds */
-#define ACCEPT_TIMEOUT 10 /* seconds */
+#define LISTEN_BACKLOG 16
+#define IN_BUF_SIZE (TUNNEL_DATA_MAX + 65536) /* bytes; must hold at least
+						 one request */
+#define OUT_BATCH_MAX 32 /* requests per writev() */
+#define TOKEN_LENGTH 16 /* hex digits in a session token */
+#define STANDBY_MAX 4 /* queued GETs */
+#define CHUNKED_LENGTH (1 << 30) /* bytes in a chunked message */
+#define SPLICE_MIN 4096 /* bytes; less tunnel data is copied instead */
+#define OPEN_DATA32 0x01 /* TUNNEL_OPEN flags; see tunnel_open_data() */
+#define OPEN_MULTIPLEX 0x02
+#define OPEN_COMPRESS 0x04
+#define READ_SIZE_MIN 4096 /* bytes; the smallest device read */
+#define ZDATA_SKIP 16 /* requests sent uncompressed after one that
+			 didn't compress */
+#define ZDATA_SKIP_MIN 1024 /* bytes; less data doesn't tell */
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define TUNNEL_IN 1
@@ -42,6 +65,12 @@ typedef unsigned short Length;
 #error "FIXME: Can't handle SIZEOF_SHORT != 2"
 #endif
 
+#if SIZEOF_INT == 4
+typedef unsigned int Length32;
+#else
+#error "FIXME: Can't handle SIZEOF_INT != 4"
+#endif
+
 enum tunnel_request
 {
   TUNNEL_SIMPLE = 0x40,
@@ -49,11 +78,25 @@ enum tunnel_request
   TUNNEL_DATA = 0x02,
   TUNNEL_PADDING = 0x03,
   TUNNEL_ERROR = 0x04,
+  TUNNEL_DATA32 = 0x05,
+  TUNNEL_ZDATA = 0x06,
   TUNNEL_PAD1 = TUNNEL_SIMPLE | 0x05,
   TUNNEL_CLOSE = TUNNEL_SIMPLE | 0x06,
   TUNNEL_DISCONNECT = TUNNEL_SIMPLE | 0x07
 };
 
+/* Where the decoder of a chunked message body is. */
+enum chunk_state
+{
+  CHUNK_SIZE,			/* reading the chunk size */
+  CHUNK_EXTENSION,		/* skipping the rest of the size line */
+  CHUNK_DATA,
+  CHUNK_DATA_END,		/* skipping the CRLF after the data */
+  CHUNK_TRAILER,		/* at the start of a trailer line */
+  CHUNK_TRAILER_LINE,		/* skipping a trailer line */
+  CHUNK_END			/* the message has ended */
+};
+
 static inline const char *
 REQ_TO_STRING (Request request)
 {
@@ -63,6 +106,8 @@ REQ_TO_STRING (Request request)
     case TUNNEL_DATA:		return "TUNNEL_DATA";
     case TUNNEL_PADDING:	return "TUNNEL_PADDING";
     case TUNNEL_ERROR:		return "TUNNEL_ERROR";
+    case TUNNEL_DATA32:		return "TUNNEL_DATA32";
+    case TUNNEL_ZDATA:		return "TUNNEL_ZDATA";
     case TUNNEL_PAD1:		return "TUNNEL_PAD1";
     case TUNNEL_CLOSE:		return "TUNNEL_CLOSE";
     case TUNNEL_DISCONNECT:	return "TUNNEL_DISCONNECT";
@@ -70,17 +115,95 @@ REQ_TO_STRING (Request request)
     }
 }
 
+/* An accepted connection whose HTTP request header is being read. */
+struct tunnel_connection
+{
+  int fd;
+  struct sockaddr_in address;
+  char key[TOKEN_LENGTH + 1];
+  unsigned long sequence;	/* of a POST, or 0 if not numbered */
+  Http_request request;
+  Http_buffer buf;
+  int persistent;		/* may carry another request */
+  int chunked;			/* has a chunked body */
+  Tunnel_connection *next;	/* in a standby queue */
+};
+
 struct tunnel
 {
   int in_fd, out_fd;
-  int server_socket;
+  unsigned int in_generation, out_generation;
+  int server;
+  Tunnel_connection *next_in, *next_out; /* standby queues */
+  unsigned long in_sequence;	/* of the last POST attached */
+  int standby_fd;		/* next POST, connecting or connected */
+  int standby_ready;
+  size_t standby_bytes;
+  int in_standby_fd;		/* next GET, connecting or sent */
+  int in_standby_ready;
+  size_t in_conn_bytes;		/* received in the current connection */
+  size_t in_conn_length;	/* Content-Length of the current connection */
+  int in_persistent, out_persistent;
+  int in_reuse_fd;		/* GET to send the next request on */
+  int in_connect_fd;		/* GET whose response is awaited, or -1 */
+  int in_connect_sent;		/* ... once connected and sent */
+  int in_connect_reused;	/* ... was a standby or persistent one */
+  Http_buffer in_connect_buf;	/* its response header so far */
+  int out_idle_fd;		/* POST waiting for its response */
+  Http_buffer out_idle_buf;
+  int out_connect_fd;		/* POST whose header isn't sent yet, or -1 */
+  int in_answered;		/* a GET has been responded to */
+  Tunnel_connection *released;	/* ended persistent connections */
+  int chunked;			/* output messages are chunked */
+  int out_ended;		/* TUNNEL_DISCONNECT was the last request */
+  int in_chunked;		/* the current input message is chunked */
+  enum chunk_state in_chunk_state;
+  size_t in_chunk_left;		/* data bytes or size being decoded */
+  int in_ending;		/* the end of the message is awaited */
+  int pipe_fd[2];		/* for splice(), or -1 */
+  size_t pipe_len;		/* tunnel data in the pipe */
+  size_t in_splice_left;	/* of TUNNEL_DATA being spliced */
+  int no_splice;		/* an fd couldn't be spliced */
+  size_t out_data_max;		/* most data the peer takes in a request */
+  size_t read_size;		/* of the next device read */
+  int coalesce_window;		/* microseconds */
+  char *held;			/* see tunnel_hold_from() */
+  size_t held_len;
+  int open_answer;		/* the client's TUNNEL_OPEN is unanswered */
+  int open_answered;		/* the server's TUNNEL_OPEN has arrived */
+  int multiplex;		/* the data carries streams; see mux.h */
+  int compress_level;		/* of output data, or 0 */
+  int out_zdata;		/* the peer takes TUNNEL_ZDATA */
+#ifdef HAVE_LIBZ
+  z_stream *out_z, *in_z;	/* see tunnel_deflate() */
+  int out_z_fresh, in_z_fresh;	/* the next TUNNEL_ZDATA starts a stream */
+  int out_z_skip;		/* requests to send uncompressed */
+  char *out_zbuf;		/* compressed data in the output batch */
+  size_t out_zbuf_len;
+  char *in_zbuf;		/* inflated data */
+#endif
   Http_destination dest;
+  char token[TOKEN_LENGTH + 1];
   struct sockaddr_in address;
   size_t bytes;
   size_t content_length;
-  char buf[65536];
+  char in_buf[IN_BUF_SIZE];
+  size_t in_buf_start;
+  size_t in_buf_len;
   char *buf_ptr;
   size_t buf_len;
+  struct iovec out_iov[2 * OUT_BATCH_MAX];
+  int out_iovcnt;
+  unsigned char out_hdr[OUT_BATCH_MAX][sizeof (Request) + sizeof (Length32)];
+  int out_reqs;
+  char *out_pending;
+  size_t out_pending_len;
+  char *out_queue;		/* output the connection hasn't taken */
+  size_t out_queue_len;
+  int out_queue_fd;		/* the connection it's for, or -1 */
+  int out_queue_keep;		/* it's kept once written; see tunnel_flush() */
+  char *to_queue;		/* read, but not yet written to the fd */
+  size_t to_queue_len;
   int padding_only;
   size_t in_total_raw;
   size_t in_total_data;
@@ -90,9 +213,19 @@ struct tunnel
   int strict_content_length;
   int keep_alive;
   int max_connection_age;
+  int standby_threshold;
+  int persistent;
 };
 
 static const size_t sizeof_header = sizeof (Request) + sizeof (Length);
+static const size_t sizeof_header32 = sizeof (Request) + sizeof (Length32);
+
+/* Stands for tunnel data that is in the pipe instead of in memory. */
+#ifdef HAVE_SPLICE
+static char tunnel_spliced[1];
+#else
+#define tunnel_spliced NULL
+#endif
 
 static inline int
 tunnel_is_disconnected (Tunnel *tunnel)
@@ -109,7 +242,7 @@ tunnel_is_connected (Tunnel *tunnel)
 static inline int
 tunnel_is_server (Tunnel *tunnel)
 {
-  return tunnel->server_socket != -1;
+  return tunnel->server;
 }
 
 static inline int
@@ -119,6 +252,17 @@ tunnel_is_client (Tunnel *tunnel)
 }
 
 #if 1
+/*
+Return the number of bytes that fit in an output message.  A chunked
+message has no Content-Length, but is still ended after a while.
+*/
+
+static inline size_t
+tunnel_out_length (Tunnel *tunnel)
+{
+  return tunnel->chunked ? CHUNKED_LENGTH : tunnel->content_length;
+}
+
 static int
 get_proto_number (const char *name)
 {
@@ -303,936 +447,3724 @@ tunnel_out_setsockopts (int fd)
   return 0;
 }
 
+static ssize_t tunnel_queue_padding (Tunnel *tunnel, size_t length);
+static int tunnel_answer_open (Tunnel *tunnel);
+static Tunnel_connection *tunnel_connection_new (int fd);
+static ssize_t tunnel_fill_in_buf (Tunnel *tunnel);
+static int tunnel_out_pend (Tunnel *tunnel, const char *data, size_t length);
+
+/*
+Hand FD back for another request, since it's a persistent connection
+whose current message has ended.  LENGTH bytes at DATA have already
+been read from it.  The caller of tunnel_released() takes it from
+here.  (Server only.)
+*/
+
 static void
-tunnel_out_disconnect (Tunnel *tunnel)
+tunnel_release (Tunnel *tunnel, int fd, const char *data, size_t length)
 {
-  if (tunnel_is_disconnected (tunnel))
-    return;
+  Tunnel_connection *conn, **p;
+  socklen_t len;
+
+  conn = tunnel_connection_new (fd);
+  len = sizeof conn->address;
+  if (conn == NULL ||
+      length > sizeof conn->buf.data ||
+      set_nonblocking (fd) == -1 ||
+      getpeername (fd, (struct sockaddr *)&conn->address, &len) == -1)
+    {
+      if (conn)
+	free (conn);
+      close (fd);
+      return;
+    }
 
-#ifdef DEBUG_MODE
-  if (tunnel_is_client (tunnel) &&
-      tunnel->bytes != tunnel->content_length + 1)
-    log_error ("tunnel_out_disconnect: warning: "
-	       "bytes=%d != content_length=%d",
-	       tunnel->bytes, tunnel->content_length + 1);
-#endif
+  memcpy (conn->buf.data, data, length);
+  conn->buf.length = length;
 
-  close (tunnel->out_fd);
-  tunnel->out_fd = -1;
-  tunnel->bytes = 0;
-  tunnel->buf_ptr = tunnel->buf;
-  tunnel->buf_len = 0;
+  for (p = &tunnel->released; *p != NULL; p = &(*p)->next)
+    ;
+  *p = conn;
 
-  log_debug ("tunnel_out_disconnect: output disconnected");
+  log_debug ("tunnel_release: connection %d released", fd);
 }
 
-static void
-tunnel_in_disconnect (Tunnel *tunnel)
+/*
+Write LENGTH bytes of tunnel data to FD without blocking, after what
+is already queued for it.  What FD doesn't take is queued, to be
+written by tunnel_flush_to().  Return LENGTH, or -1 on error.
+*/
+
+static ssize_t
+tunnel_to_write (Tunnel *tunnel, int fd, const char *data, size_t length)
 {
-  if (tunnel->in_fd == -1)
-    return;
+  ssize_t n;
+  char *p;
 
-  close (tunnel->in_fd);
-  tunnel->in_fd = -1;
+  n = 0;
+  if (tunnel->to_queue_len == 0)
+    {
+      n = write (fd, data, length);
+      log_annoying ("write (%d, %p, %d) = %d", fd, data, length, n);
+      if (n == -1)
+	{
+	  if (errno != EAGAIN && errno != EINTR)
+	    return -1;
+	  n = 0;
+	}
+    }
+  if (n == length)
+    return length;
 
-  log_debug ("tunnel_in_disconnect: input disconnected");
+  p = realloc (tunnel->to_queue, tunnel->to_queue_len + length - n);
+  if (p == NULL)
+    {
+      log_error ("tunnel_to_write: out of memory");
+      errno = ENOMEM;
+      return -1;
+    }
+
+  memcpy (p + tunnel->to_queue_len, data + n, length - n);
+  tunnel->to_queue = p;
+  tunnel->to_queue_len += length - n;
+  log_annoying ("tunnel_to_write: %d bytes queued for %d",
+		tunnel->to_queue_len, fd);
+  return length;
 }
 
-static int
-tunnel_out_connect (Tunnel *tunnel)
+ssize_t
+tunnel_flush_to (Tunnel *tunnel, int fd)
 {
+  size_t written;
   ssize_t n;
 
-  if (tunnel_is_connected (tunnel))
+  for (written = 0; written < tunnel->to_queue_len; written += n)
     {
-      log_debug ("tunnel_out_connect: already connected");
-      tunnel_out_disconnect (tunnel);
+      n = write (fd, tunnel->to_queue + written,
+		 tunnel->to_queue_len - written);
+      log_annoying ("write (%d, %p, %d) = %d", fd,
+		    tunnel->to_queue + written,
+		    tunnel->to_queue_len - written, n);
+      if (n == -1 && errno == EINTR)
+	n = 0;
+      else if (n == -1 && errno == EAGAIN)
+	break;
+      else if (n <= 0)
+	return -1;
     }
 
-  tunnel->out_fd = do_connect (&tunnel->address);
-  if (tunnel->out_fd == -1)
+  tunnel->to_queue_len -= written;
+  memmove (tunnel->to_queue, tunnel->to_queue + written,
+	   tunnel->to_queue_len);
+  return tunnel->to_queue_len;
+}
+
+size_t
+tunnel_queued (Tunnel *tunnel)
+{
+  return tunnel->to_queue_len;
+}
+
+#ifdef HAVE_SPLICE
+static int
+tunnel_pipe (Tunnel *tunnel)
+{
+  if (tunnel->pipe_fd[0] != -1)
+    return 0;
+
+  if (pipe (tunnel->pipe_fd) == -1)
     {
-      log_error ("tunnel_out_connect: do_connect (%d.%d.%d.%d:%u) error: %s",
-		  ntohl (tunnel->address.sin_addr.s_addr) >> 24,
-		 (ntohl (tunnel->address.sin_addr.s_addr) >> 16) & 0xff,
-		 (ntohl (tunnel->address.sin_addr.s_addr) >>  8) & 0xff,
-		  ntohl (tunnel->address.sin_addr.s_addr)        & 0xff,
-		  ntohs (tunnel->address.sin_port),
-		 strerror (errno));
+      log_error ("tunnel_pipe: pipe() error: %s", strerror (errno));
+      tunnel->pipe_fd[0] = tunnel->pipe_fd[1] = -1;
+      tunnel->no_splice = TRUE;
       return -1;
     }
 
-  tunnel_out_setsockopts (tunnel->out_fd);
-
-#ifdef USE_SHUTDOWN
-  shutdown (tunnel->out_fd, 0);
-#endif
-
-  /* + 1 to allow for TUNNEL_DISCONNECT */
-  n = http_post (tunnel->out_fd,
-		 &tunnel->dest,
-		 tunnel->content_length + 1);
-  if (n == -1)
-    return -1;
-#ifdef IO_COUNT_HTTP_HEADER
-  tunnel->out_total_raw += n;
-  log_annoying ("tunnel_out_connect: out_total_raw = %u",
-		tunnel->out_total_raw);
+#ifdef F_SETPIPE_SZ
+  /* Make room for a whole TUNNEL_DATA32 request. */
+  fcntl (tunnel->pipe_fd[1], F_SETPIPE_SZ, TUNNEL_DATA_MAX);
 #endif
 
-  tunnel->bytes = 0;
-  tunnel->buf_ptr = tunnel->buf;
-  tunnel->buf_len = 0;
-  tunnel->padding_only = TRUE;
-  time (&tunnel->out_connect_time);
+  return 0;
+}
 
-  log_debug ("tunnel_out_connect: output connected");
+static void
+tunnel_pipe_close (Tunnel *tunnel)
+{
+  if (tunnel->pipe_fd[0] == -1)
+    return;
 
-  return 0;
+  close (tunnel->pipe_fd[0]);
+  close (tunnel->pipe_fd[1]);
+  tunnel->pipe_fd[0] = tunnel->pipe_fd[1] = -1;
+  tunnel->pipe_len = 0;
 }
 
-static int
-tunnel_in_connect (Tunnel *tunnel)
+/*
+Move at most LENGTH bytes from the pipe to FD without blocking.  MORE
+says that more output follows right away.  Return the number of bytes
+moved, or -1 with errno EAGAIN if FD takes none now, or can't be
+spliced to; the rest is then read from the pipe by tunnel_out_queue().
+*/
+
+static ssize_t
+tunnel_pipe_out (Tunnel *tunnel, int fd, size_t length, int more)
 {
-  Http_response *response;
   ssize_t n;
 
-  log_verbose ("tunnel_in_connect()");
-
-  if (tunnel->in_fd != -1)
+  do
+    n = splice (tunnel->pipe_fd[0], NULL, fd, NULL, length,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+		(more ? SPLICE_F_MORE : 0));
+  while (n == -1 && errno == EINTR);
+  if (n == -1 && errno == EINVAL)
     {
-      log_error ("tunnel_in_connect: already connected");
-      return -1;
+      log_debug ("tunnel_pipe_out: can't splice to %d; copying", fd);
+      tunnel->no_splice = TRUE;
+      errno = EAGAIN;
     }
-
-  tunnel->in_fd = do_connect (&tunnel->address);
-  if (tunnel->in_fd == -1)
+  if (n == 0)
     {
-      log_error ("tunnel_in_connect: do_connect() error: %s",
-		 strerror (errno));
+      errno = EIO;
       return -1;
     }
+  if (n > 0)
+    tunnel->pipe_len -= n;
 
-  tunnel_in_setsockopts (tunnel->in_fd);
+  return n;
+}
 
-  if (http_get (tunnel->in_fd, &tunnel->dest) == -1)
-    return -1;
+/*
+Move LENGTH bytes from the pipe to FD like tunnel_to_write() does,
+queueing the ones FD won't take right away.  Return 0, or -1 on error.
+*/
 
-#ifdef USE_SHUTDOWN
-  if (shutdown (tunnel->in_fd, 1) == -1)
-    {
-      log_error ("tunnel_in_connect: shutdown() error: %s",
-		 strerror (errno));
-      return -1;
-    }
-#endif
+static int
+tunnel_pipe_to (Tunnel *tunnel, int fd, size_t length)
+{
+  char buf[10240];
+  ssize_t n;
 
-  n = http_parse_response (tunnel->in_fd, &response);
-  if (n <= 0)
-    {
-      if (n == 0)
-	log_error ("tunnel_in_connect: no response; peer "
-		   "closed connection");
-      else
-	log_error ("tunnel_in_connect: no response; error: %s",
-		   strerror (errno));
-    }
-  else if (response->major_version != 1 ||
-	   (response->minor_version != 1 &&
-	    response->minor_version != 0))
-    {
-      log_error ("tunnel_in_connect: unknown HTTP version: %d.%d",
-		 response->major_version, response->minor_version);
-      n = -1;
-    }
-  else if (response->status_code != 200)
+  while (length > 0)
     {
-      log_error ("tunnel_in_connect: HTTP error %d", response->status_code);
-      errno = http_error_to_errno (-response->status_code);
       n = -1;
-    }
-
-  if (response)
-    http_destroy_response (response);
+      errno = EAGAIN;
+      if (tunnel->to_queue_len == 0 && !tunnel->no_splice)
+	n = splice (tunnel->pipe_fd[0], NULL, fd, NULL, length,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n == -1 && (errno == EAGAIN || errno == EINVAL))
+	{
+	  if (errno == EINVAL)
+	    {
+	      log_debug ("tunnel_pipe_to: can't splice to %d; copying", fd);
+	      tunnel->no_splice = TRUE;
+	    }
+	  n = read (tunnel->pipe_fd[0], buf, min (length, sizeof buf));
+	  if (n > 0 && tunnel_to_write (tunnel, fd, buf, n) == -1)
+	    n = -1;
+	}
+      if (n <= 0)
+	return -1;
 
-  if (n > 0)
-    {
-#ifdef IO_COUNT_HTTP_HEADER
-      tunnel->in_total_raw += n;
-      log_annoying ("tunnel_in_connect: in_total_raw = %u",
-		    tunnel->in_total_raw);
-#endif
-    }
-  else
-    {
-      return n;
+      tunnel->pipe_len -= n;
+      length -= n;
     }
 
-  log_debug ("tunnel_in_connect: input connected");
-  return 1;
+  return 0;
 }
 
-static inline ssize_t
-tunnel_write_data (Tunnel *tunnel, void *data, size_t length)
+/*
+Empty the pipe after a failed write.  A server keeps the data, if KEEP,
+to send when the client connects again.
+*/
+
+static void
+tunnel_pipe_drain (Tunnel *tunnel, int keep)
 {
-  if (write_all (tunnel->out_fd, data, length) == -1)
+  char buf[10240];
+  ssize_t n;
+
+  while (tunnel->pipe_len > 0)
     {
-      log_error ("tunnel_write_data: write error: %s", strerror (errno));
-      return -1;
+      n = read (tunnel->pipe_fd[0], buf, min (tunnel->pipe_len, sizeof buf));
+      if (n <= 0)
+	{
+	  tunnel_pipe_close (tunnel);
+	  return;
+	}
+      tunnel->pipe_len -= n;
+      if (keep)
+	tunnel_out_pend (tunnel, buf, n);
     }
-  tunnel->bytes += length;
-  return length;
 }
+#endif /* HAVE_SPLICE */
+
+/*
+Queue IOV for the output connection, to be written by tunnel_flush().
+Tunnel data in the pipe is read into the queue.  Return 0, or -1 on
+error.
+*/
 
 static int
-tunnel_write_request (Tunnel *tunnel, Request request,
-		      void *data, Length length)
+tunnel_out_queue (Tunnel *tunnel, struct iovec *iov, int iovcnt)
 {
-  if (tunnel->bytes + sizeof request +
-      (data ? sizeof length + length : 0) > tunnel->content_length)
-    tunnel_padding (tunnel, tunnel->content_length - tunnel->bytes);
-
-#if 1 /* FIXME: this is a kludge */
-  {
-    time_t t;
-
-    time (&t);
-    if (tunnel_is_client (tunnel) &&
-	tunnel_is_connected (tunnel) &&
-	t - tunnel->out_connect_time > tunnel->max_connection_age)
-      {
-	char c = TUNNEL_DISCONNECT;
+  size_t length;
+#ifdef HAVE_SPLICE
+  ssize_t n;
+#endif
+  char *p;
+  int i;
 
-	log_debug ("tunnel_write_request: connection > %d seconds old",
-		   tunnel->max_connection_age);
+  length = 0;
+  for (i = 0; i < iovcnt; i++)
+    length += iov[i].iov_len;
 
-	if (tunnel->strict_content_length)
-	  {
-	    int l = tunnel->content_length - tunnel->bytes - 1;
+  p = realloc (tunnel->out_queue, tunnel->out_queue_len + length);
+  if (p == NULL)
+    {
+      log_error ("tunnel_out_queue: out of memory");
+      errno = ENOMEM;
+      return -1;
+    }
+  tunnel->out_queue = p;
 
-	    log_debug ("tunnel_write_request: write padding (%d bytes)",
-		       tunnel->content_length - tunnel->bytes - 1);
-	    if (l > 3)
+  p += tunnel->out_queue_len;
+  for (i = 0; i < iovcnt; i++)
+    {
+#ifdef HAVE_SPLICE
+      if (iov[i].iov_base == tunnel_spliced)
+	{
+	  for (length = 0; length < iov[i].iov_len; length += n)
 	    {
-		char c;
-		short s;
-		int i;
+	      n = read (tunnel->pipe_fd[0], p + length,
+			iov[i].iov_len - length);
+	      if (n == -1 && errno == EINTR)
+		n = 0;
+	      else if (n <= 0)
+		{
+		  if (n == 0)
+		    errno = EIO;
+		  return -1;
+		}
+	    }
+	  tunnel->pipe_len -= length;
+	}
+      else
+#endif
+	memcpy (p, iov[i].iov_base, iov[i].iov_len);
+      p += iov[i].iov_len;
+      tunnel->out_queue_len += iov[i].iov_len;
+    }
 
-		c = TUNNEL_PADDING;
-  		tunnel_write_data (tunnel, &c, sizeof c);
+  tunnel->out_queue_fd = tunnel->out_fd;
+  log_annoying ("tunnel_out_queue: %d bytes queued for %d",
+		tunnel->out_queue_len, tunnel->out_fd);
+  return 0;
+}
 
-		s = htons(l-2);
-		tunnel_write_data (tunnel, &s, sizeof s);
+/*
+Write IOV to the output connection without blocking.  Tunnel data
+that is in the pipe is spliced in its place.  What comes before it is
+sent with MSG_MORE, so that it goes out in the same segment as the
+data.  What the connection doesn't take is queued, and so is anything
+while output is already queued, or while a client's POST is still
+being connected.  Return 0, or -1 on error.
+*/
 
-		l -= 2;
-		c = 0;
-	    	for (i=0; i<l; i++)
-  			tunnel_write_data (tunnel, &c, sizeof c);
-	    }
-	    else
-	    {
-		char c = TUNNEL_PAD1;
-		int i;
+static int
+tunnel_writev (Tunnel *tunnel, struct iovec *iov, int iovcnt)
+{
+  ssize_t n;
+  int i;
 
-	    	for (i=0; i<l; i++)
-  			tunnel_write_data (tunnel, &c, sizeof c);
-	    }
-	  }
+  while (iovcnt > 0 && tunnel->out_queue_len == 0 &&
+	 tunnel->out_fd != tunnel->out_connect_fd)
+    {
+      for (i = 0; i < iovcnt && iov[i].iov_base != tunnel_spliced; i++)
+	;
+#ifdef HAVE_SPLICE
+      if (i == 0)
+	n = tunnel_pipe_out (tunnel, tunnel->out_fd, iov->iov_len,
+			     iovcnt > 1);
+      else if (i < iovcnt)
+	{
+	  struct msghdr msg;
 
-	log_debug ("tunnel_write_request: closing old connection");
-	if (tunnel_write_data (tunnel, &c, sizeof c) <= 0)
-	  return -1;
-	tunnel_out_disconnect (tunnel);
-      }
-  }
+	  memset (&msg, 0, sizeof msg);
+	  msg.msg_iov = iov;
+	  msg.msg_iovlen = i;
+	  n = sendmsg (tunnel->out_fd, &msg, MSG_MORE);
+	}
+      else
 #endif
+	n = writev (tunnel->out_fd, iov, iovcnt);
+      log_annoying ("tunnel_writev: write (%d, %p, %d) = %d",
+		    tunnel->out_fd, iov, iovcnt, n);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n == -1 && errno == EAGAIN)
+	break;
+      if (n == -1)
+	return -1;
 
-  if (tunnel_is_disconnected (tunnel))
-    {
-      if (tunnel_is_client (tunnel))
+      /* Skip what was written; IOV is modified in place. */
+      while (iovcnt > 0 && n >= iov->iov_len)
 	{
-	  if (tunnel_out_connect (tunnel) == -1)
-	    return -1;
+	  n -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
 	}
-      else
+      if (iovcnt > 0 && n > 0)
 	{
-#if 0
-	  log_error ("tunnel_write_request: output is disconnected");
-	  errno = EIO;
-	  return -1;
-#else
-	  if (tunnel_accept (tunnel) == -1)
-	    return -1;
-#endif
+	  if (iov->iov_base != tunnel_spliced)
+	    iov->iov_base = (char *)iov->iov_base + n;
+	  iov->iov_len -= n;
 	}
     }
 
-  if (request != TUNNEL_PADDING && request != TUNNEL_PAD1)
-    tunnel->padding_only = FALSE;
+  if (iovcnt == 0)
+    return 0;
+  return tunnel_out_queue (tunnel, iov, iovcnt);
+}
 
-  if (tunnel_write_data (tunnel, &request, sizeof request) == -1)
-    {
-      if (errno != EPIPE)
-	return -1;
+/*
+Close the output connection after a write error.  It's useless now,
+along with what's queued for it.  A client makes a new one, and a
+server waits for the client to.
+*/
 
-      tunnel_out_disconnect (tunnel);
-      if (tunnel_is_client (tunnel))
-	tunnel_out_connect (tunnel);
-      else
+static void
+tunnel_out_fail (Tunnel *tunnel)
+{
+#ifdef HAVE_SPLICE
+  tunnel_pipe_drain (tunnel, FALSE);
+#endif
+  if (tunnel->out_queue_fd != -1 && tunnel->out_queue_fd != tunnel->out_fd)
+    close (tunnel->out_queue_fd);
+  tunnel->out_queue_fd = -1;
+  tunnel->out_queue_len = 0;
+  tunnel->out_connect_fd = -1;
+
+  if (tunnel->out_fd == -1)
+    return;
+  close (tunnel->out_fd);
+  tunnel->out_fd = -1;
+  tunnel->bytes = 0;
+#ifdef HAVE_LIBZ
+  tunnel->out_z_fresh = TRUE;
+#endif
+}
+
+/*
+Write all requests queued in the output batch with one writev().  A
+chunked message gets the batch as one chunk, and is ended right after
+TUNNEL_DISCONNECT.
+*/
+
+static int
+tunnel_out_flush (Tunnel *tunnel)
+{
+  static char crlf[] = "\r\n";
+  static char last[] = "\r\n0\r\n\r\n";
+  struct iovec iov[2 * OUT_BATCH_MAX + 2];
+  struct iovec *v = tunnel->out_iov;
+  int iovcnt = tunnel->out_iovcnt;
+  char size[16];
+  size_t length;
+  ssize_t n;
+  int i;
+
+  if (tunnel->out_iovcnt == 0)
+    return 0;
+
+  if (tunnel->chunked)
+    {
+      length = 0;
+      for (i = 0; i < iovcnt; i++)
 	{
-	  log_error ("tunnel_write_request: couldn't write request: "
-		     "output is disconnected");
-	  errno = EIO;
-	  return -1;
+	  iov[i + 1] = v[i];
+	  length += v[i].iov_len;
 	}
-      /* return tunnel_write_request (tunnel, request, data, length); */
-      if (tunnel_write_data (tunnel, &request, sizeof request) == -1)
-	return -1;
+      iov[0].iov_base = size;
+      iov[0].iov_len = snprintf (size, sizeof size, "%lx\r\n",
+				 (unsigned long)length);
+      iov[iovcnt + 1].iov_base = tunnel->out_ended ? last : crlf;
+      iov[iovcnt + 1].iov_len = (tunnel->out_ended
+				 ? sizeof last : sizeof crlf) - 1;
+      v = iov;
+      iovcnt += 2;
     }
 
-  if (data)
+  n = tunnel_writev (tunnel, v, iovcnt);
+  tunnel->out_iovcnt = 0;
+  tunnel->out_reqs = 0;
+#ifdef HAVE_LIBZ
+  tunnel->out_zbuf_len = 0;
+#endif
+  if (n == -1)
     {
-      Length network_length = htons ((short)length);
-      if (tunnel_write_data (tunnel,
-			     &network_length,
-			     sizeof network_length) == -1)
-	return -1;
+      log_error ("tunnel_out_flush: write error: %s", strerror (errno));
+      tunnel_out_fail (tunnel);
+      return -1;
+    }
 
-#ifdef DEBUG_MODE
-      if (request == TUNNEL_DATA && debug_level >= 5)
-	{
-	  log_annoying ("tunnel_write_request: TUNNEL_DATA:");
-	  dump_buf (debug_file, data, (size_t)length);
-	}
-#endif
+  return 0;
+}
 
-      if (tunnel_write_data (tunnel, data, (size_t)length) == -1)
-	return -1;
-    }
+/*
+Close the output connection FD, whose message has been written, or
+keep it for another request if KEEP.  A POST that never got its
+header sent is closed.
+*/
 
-  if (data)
+static void
+tunnel_out_done (Tunnel *tunnel, int fd, int keep)
+{
+  if (fd == tunnel->out_connect_fd)
     {
-      tunnel->out_total_raw += 3 + length;
-
-      if (request == TUNNEL_DATA)
-	log_verbose ("tunnel_write_request: %s (%d)",
-		     REQ_TO_STRING (request), length);
-      else
-	log_debug ("tunnel_write_request: %s (%d)",
-		     REQ_TO_STRING (request), length);
+      tunnel->out_connect_fd = -1;
+      keep = FALSE;
     }
-  else
+
+  if (keep && tunnel_is_client (tunnel))
     {
-      tunnel->out_total_raw += 1;
-      log_debug ("tunnel_write_request: %s", REQ_TO_STRING (request));
+      if (tunnel->out_idle_fd != -1)
+	close (tunnel->out_idle_fd);
+      tunnel->out_idle_fd = fd;
+      tunnel->out_idle_buf.length = 0;
+      tunnel->out_idle_buf.header_length = 0;
     }
+  else if (keep)
+    tunnel_release (tunnel, fd, NULL, 0);
+  else
+    close (fd);
+}
 
-  log_annoying ("tunnel_write_data: out_total_raw = %u",
-		tunnel->out_total_raw);
+static void
+tunnel_out_disconnect (Tunnel *tunnel)
+{
+  int complete, keep;
+
+  if (tunnel_is_disconnected (tunnel))
+    return;
+
+  if (tunnel_out_flush (tunnel) == -1)
+    return;
 
 #ifdef DEBUG_MODE
-  if (tunnel->bytes > tunnel->content_length)
-    log_debug ("tunnel_write_request: tunnel->bytes > tunnel->content_length");
+  if (tunnel_is_client (tunnel) && !tunnel->chunked &&
+      tunnel->bytes != tunnel->content_length + 1)
+    log_error ("tunnel_out_disconnect: warning: "
+	       "bytes=%d != content_length=%d",
+	       tunnel->bytes, tunnel->content_length + 1);
 #endif
 
-  if (tunnel->bytes >= tunnel->content_length)
+  /* A complete message leaves a persistent connection reusable.  The
+     connection is left to tunnel_flush() while output is queued. */
+  complete = (tunnel->chunked ? tunnel->out_ended
+	      : tunnel->bytes == tunnel->content_length + 1);
+  keep = complete && (tunnel_is_client (tunnel) ? tunnel->persistent
+		      : tunnel->out_persistent);
+  if (tunnel->out_queue_len > 0)
     {
-      char c = TUNNEL_DISCONNECT;
-      tunnel_write_data (tunnel, &c, sizeof c);
-      tunnel_out_disconnect (tunnel);
-#if 0
-      if (tunnel_is_server (tunnel))
-	tunnel_accept (tunnel);
-#endif
+      tunnel->out_queue_keep = keep;
+      log_debug ("tunnel_out_disconnect: %d bytes left to write",
+		 tunnel->out_queue_len);
     }
+  else
+    tunnel_out_done (tunnel, tunnel->out_fd, keep);
+  tunnel->out_fd = -1;
+  tunnel->bytes = 0;
+  tunnel->out_ended = FALSE;
+#ifdef HAVE_LIBZ
+  tunnel->out_z_fresh = TRUE;
+#endif
 
-  return 0;
+  log_debug ("tunnel_out_disconnect: output disconnected");
 }
 
-int
-tunnel_connect (Tunnel *tunnel)
+static void
+tunnel_in_disconnect (Tunnel *tunnel)
 {
-  char auth_data[1] = { 42 }; /* dummy data, not used by server */
-
-  log_verbose ("tunnel_connect()");
-
-  if (tunnel_is_connected (tunnel))
-    {
-      log_error ("tunnel_connect: already connected");
-      errno = EINVAL;
-      return -1;
-    }
-
-  if (tunnel_write_request (tunnel, TUNNEL_OPEN,
-			    auth_data, sizeof auth_data) == -1)
-    return -1;
+  if (tunnel->in_fd == -1)
+    return;
 
-  if (tunnel_in_connect (tunnel) <= 0)
-    return -1;
+  close (tunnel->in_fd);
+  tunnel->in_fd = -1;
+  tunnel->in_buf_start = 0;
+  tunnel->in_buf_len = 0;
+  tunnel->buf_len = 0;
+  tunnel->in_splice_left = 0;
+  tunnel->in_ending = FALSE;
 
-  return 0;
+  log_debug ("tunnel_in_disconnect: input disconnected");
 }
 
-static inline int
-tunnel_write_or_padding (Tunnel *tunnel, Request request, void *data,
-			 size_t length)
-{
-  static char padding[65536];
-  size_t n, remaining;
-  char *wdata = data;
+/*
+Close the POST or GET connection which has just been used up by
+receiving TUNNEL_DISCONNECT.  A persistent connection is kept, if the
+whole message has been received.  A server responds to a POST.  The
+end of a chunked message may not have arrived yet; the connection is
+then left as it is until tunnel_in_ending() has read it.
+*/
 
-  for (remaining = length; remaining > 0; remaining -= n, wdata += n)
+static void
+tunnel_in_end (Tunnel *tunnel)
+{
+  static const char response[] =
+"HTTP/1.1 200 OK\r\n"
+"Content-Length: 0\r\n"
+"Connection: keep-alive\r\n"
+"\r\n";
+  int fd = tunnel->in_fd;
+  int complete;
+
+  tunnel->in_ending = FALSE;
+  if (!tunnel->in_chunked)
+    complete = (tunnel->in_conn_bytes - tunnel->in_buf_len ==
+		tunnel->in_conn_length);
+  else if (tunnel->in_persistent && tunnel->in_chunk_state != CHUNK_END)
     {
-      if (tunnel->bytes + remaining > tunnel->content_length - sizeof_header &&
-	  tunnel->content_length - tunnel->bytes > sizeof_header)
-	n = tunnel->content_length - sizeof_header - tunnel->bytes;
-      else if (remaining > tunnel->content_length - sizeof_header)
-	n = tunnel->content_length - sizeof_header;
-      else
-	n = remaining;
+      log_debug ("tunnel_in_end: waiting for the end of the message");
+      tunnel->in_ending = TRUE;
+      return;
+    }
+  else
+    complete = (tunnel->in_chunk_state == CHUNK_END);
 
-      if (n > 65535)
-	n = 65535;
+  if (!tunnel->in_persistent || !complete)
+    {
+      tunnel_in_disconnect (tunnel);
+      return;
+    }
 
-      if (request == TUNNEL_PADDING)
+  if (tunnel_is_client (tunnel))
+    {
+      /* Requests aren't pipelined, so nothing more can have arrived. */
+      if (tunnel->in_buf_len > 0)
 	{
-	  if (n + sizeof_header > remaining)
-	    n = remaining - sizeof_header;
-	  if (tunnel_write_request (tunnel, request, padding, n) == -1)
-	    break;
-	  n += sizeof_header;
+	  tunnel_in_disconnect (tunnel);
+	  return;
 	}
-      else
+      if (tunnel->in_reuse_fd != -1)
+	close (tunnel->in_reuse_fd);
+      tunnel->in_reuse_fd = fd;
+    }
+  else
+    {
+      /* The response is the only output on the connection, so it
+	 fits unless the client isn't reading. */
+      if (write (fd, response, sizeof response - 1) != sizeof response - 1)
 	{
-	  if (tunnel_write_request (tunnel, request, wdata, n) == -1)
-	    break;
+	  tunnel_in_disconnect (tunnel);
+	  return;
 	}
+      tunnel_release (tunnel, fd, tunnel->in_buf + tunnel->in_buf_start,
+		      tunnel->in_buf_len);
     }
 
-  return length - remaining;
+  tunnel->in_fd = -1;
+  tunnel->in_buf_start = 0;
+  tunnel->in_buf_len = 0;
+  tunnel->buf_len = 0;
+
+  log_debug ("tunnel_in_end: input disconnected, connection kept");
 }
 
-ssize_t
-tunnel_write (Tunnel *tunnel, void *data, size_t length)
+/*
+Read what has arrived of the end of a chunked message after
+TUNNEL_DISCONNECT, and end the connection with tunnel_in_end() once
+it's all in, or close it if it fails.
+*/
+
+static void
+tunnel_in_ending (Tunnel *tunnel)
 {
   ssize_t n;
 
-  n = tunnel_write_or_padding (tunnel, TUNNEL_DATA, data, length);
-  tunnel->out_total_data += length;
-  log_verbose ("tunnel_write: out_total_data = %u", tunnel->out_total_data);
-  return n;
+  n = tunnel_fill_in_buf (tunnel);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  else if (n <= 0)
+    {
+      log_debug ("tunnel_in_ending: message not ended");
+      tunnel_in_disconnect (tunnel);
+    }
+  else if (tunnel->in_chunk_state == CHUNK_END)
+    tunnel_in_end (tunnel);
 }
 
-ssize_t
-tunnel_padding (Tunnel *tunnel, size_t length)
+static void
+tunnel_standby_close (Tunnel *tunnel)
 {
-  if (length < sizeof_header + 1)
-    {
-      int i;
-
-      for (i = 0; i < length; i++)
-	tunnel_write_request (tunnel, TUNNEL_PAD1, NULL, 0);
-      return length;
-    }
+  if (tunnel->standby_fd == -1)
+    return;
 
-  return tunnel_write_or_padding (tunnel, TUNNEL_PADDING, NULL, length);
+  close (tunnel->standby_fd);
+  tunnel->standby_fd = -1;
+  tunnel->standby_ready = FALSE;
+  tunnel->standby_bytes = 0;
 }
 
-int
-tunnel_close (Tunnel *tunnel)
+/*
+Start connecting to the server without waiting for the connection to
+complete.  Return the socket, or -1 on error.  (Client only.)
+*/
+
+static int
+tunnel_connect_start (Tunnel *tunnel)
 {
-  struct pollfd p;
-  char buf[10240];
-  ssize_t n;
+  int fd;
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
 
-  if (tunnel->strict_content_length)
+  if (set_nonblocking (fd) == -1 ||
+      (connect (fd, (struct sockaddr *)&tunnel->address,
+		sizeof (struct sockaddr_in)) == -1 &&
+       errno != EINPROGRESS))
     {
-      log_debug ("tunnel_close: write padding (%d bytes)",
-		 tunnel->content_length - tunnel->bytes - 1);
-      tunnel_padding (tunnel, tunnel->content_length - tunnel->bytes - 1);
+      log_debug ("tunnel_connect_start: connect error: %s",
+		 strerror (errno));
+      close (fd);
+      return -1;
     }
 
-  log_debug ("tunnel_close: write TUNNEL_CLOSE request");
-  tunnel_write_request (tunnel, TUNNEL_CLOSE, NULL, 0);
+  return fd;
+}
 
-  tunnel_out_disconnect (tunnel);
+/*
+Wait at most TIMEOUT milliseconds for a connection started by
+tunnel_connect_start() to complete.  Return 1 if it's connected, 0 if
+it's still connecting, or -1 if it failed.
+*/
 
-  log_debug ("tunnel_close: reading trailing data from input ...");
-  p.fd = tunnel->in_fd;
-  p.events = POLLIN;
-  while (poll (&p, 1, READ_TRAIL_TIMEOUT) > 0)
+static int
+tunnel_connect_finish (int fd, int timeout)
+{
+  struct pollfd p;
+  socklen_t len;
+  int err;
+  int n;
+
+  p.fd = fd;
+  p.events = POLLOUT;
+  n = poll (&p, 1, timeout);
+  if (n == 0)
+    return 0;
+
+  len = sizeof err;
+  if (n == -1 ||
+      getsockopt (fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) == -1)
+    err = errno;
+  if (err != 0)
     {
-      if (p.revents & POLLIN)
-	{
-	  n = read (tunnel->in_fd, buf, sizeof buf);
-	  if (n > 0)
-	    {
-	      log_annoying ("read (%d, %p, %d) = %d",
-			    tunnel->in_fd, buf, sizeof buf, n);
-	      continue;
-	    }
-	  else if (n == -1 && errno == EAGAIN)
-	    continue;
-	  else if (n == -1)
-	    log_debug ("tunnel_close: ... error: %s", strerror (errno));
-	  else
-	    log_debug ("tunnel_close: ... done (tunnel closed)");
-	}
-      if (p.revents & POLLHUP)
-	log_debug ("POLLHUP");
-      if (p.revents & POLLERR)
-	log_debug ("POLLERR");
-      if (p.revents & POLLNVAL)
-	log_debug ("POLLNVAL");
-      break;
+      log_error ("tunnel_connect_finish: connect error: %s", strerror (err));
+      errno = err;
+      return -1;
     }
 
-  tunnel_in_disconnect (tunnel);
+  return 1;
+}
 
-  tunnel->buf_len = 0;
-  tunnel->in_total_raw = 0;
-  tunnel->in_total_data = 0;
-  tunnel->out_total_raw = 0;
-  tunnel->out_total_data = 0;
+/*
+Start connecting the next POST, so that it's ready when the current
+one is used up.  (Client only.)
+*/
 
-  return 0;
+static void
+tunnel_standby_connect (Tunnel *tunnel)
+{
+  tunnel->standby_fd = tunnel_connect_start (tunnel);
+  tunnel->standby_ready = FALSE;
+  if (tunnel->standby_fd != -1)
+    log_debug ("tunnel_standby_connect: connecting standby output");
 }
 
+/*
+If the standby POST has been connected, send the request header.
+Wait at most TIMEOUT milliseconds for it.  Return 1 if the standby
+connection is ready to take over, 0 if it's still connecting, or -1
+if it failed and was closed.  (Client only.)
+*/
+
 static int
-tunnel_read_request (Tunnel *tunnel, enum tunnel_request *request,
-		     char *buf, size_t *length)
+tunnel_standby_finish (Tunnel *tunnel, int timeout)
 {
-  Request req;
-  Length len;
+  static unsigned char pad1[] = { '1', '\r', '\n', TUNNEL_PAD1, '\r', '\n' };
   ssize_t n;
 
-  log_annoying ("read (%d, %p, %d) ...", tunnel->in_fd, &req, 1);
-  n = read (tunnel->in_fd, &req, 1);
-  log_annoying ("... = %d", n);
+  if (tunnel->standby_fd == -1)
+    return -1;
+  if (tunnel->standby_ready)
+    return 1;
+
+  n = tunnel_connect_finish (tunnel->standby_fd, timeout);
+  if (n == 0)
+    return 0;
   if (n == -1)
     {
-      if (errno != EAGAIN)
-	log_error ("tunnel_read_request: error reading request: %s",
-		   strerror (errno));
-      return n;
-    }
-  else if (n == 0)
-    {
-      log_debug ("tunnel_read_request: connection closed by peer");
-      tunnel_in_disconnect (tunnel);
-
-      if (tunnel_is_client (tunnel)
-	  && tunnel_in_connect (tunnel) == -1)
-	return -1;
-
-      errno = EAGAIN;
+      tunnel_standby_close (tunnel);
       return -1;
     }
-  *request = req;
-  tunnel->in_total_raw += n;
-  log_annoying ("request = 0x%x (%s)", req, REQ_TO_STRING (req));
 
-  if (req & TUNNEL_SIMPLE)
-    {
-      log_annoying ("tunnel_read_request: in_total_raw = %u",
-		    tunnel->in_total_raw);
-      log_debug ("tunnel_read_request:  %s", REQ_TO_STRING (req));
-      *length = 0;
-      return 1;
-    }
+  tunnel_out_setsockopts (tunnel->standby_fd);
 
-  n = read_all (tunnel->in_fd, &len, 2);
-  if (n <= 0)
+  /* The server attaches a POST connection when the first byte of the
+     body has arrived, so send a padding byte right away.  In a chunked
+     body, it's a chunk of its own.  If that fails, the server never
+     takes the POST, and its number is used for the next. */
+  tunnel->dest.sequence++;
+  n = http_post (tunnel->standby_fd, &tunnel->dest,
+		 tunnel->content_length + 1);
+  if (n == -1 ||
+      (tunnel->chunked
+       ? write_all (tunnel->standby_fd, pad1, sizeof pad1) != sizeof pad1
+       : write_all (tunnel->standby_fd, pad1 + 3, 1) != 1))
     {
-      log_error ("tunnel_read_request: error reading request length: %s",
-		 strerror (errno));
-      if (n == 0)
-	errno = EIO;
+      log_error ("tunnel_standby_finish: write error: %s", strerror (errno));
+      tunnel->dest.sequence--;
+      tunnel_standby_close (tunnel);
       return -1;
     }
-  len = ntohs (len);
-  *length = len;
-  tunnel->in_total_raw += n;
-  log_annoying ("length = %d", len);
+#ifdef IO_COUNT_HTTP_HEADER
+  tunnel->out_total_raw += n;
+#endif
+  tunnel->out_total_raw += 1;
+  tunnel->standby_bytes = 1;
+  tunnel->standby_ready = TRUE;
 
-  if (len > 0)
-    {
-      n = read_all (tunnel->in_fd, buf, (size_t)len);
-      if (n <= 0)
-	{
-	  log_error ("tunnel_read_request: error reading request data: %s",
-		     strerror (errno));
-	  if (n == 0)
-	    errno = EIO;
-	  return -1;
-	}
+  log_debug ("tunnel_standby_finish: standby output connected");
+  return 1;
+}
+
+/*
+Make the POST connection kept after the previous request the standby
+for the next, once the server has responded.  The response isn't
+waited for; the connection is kept until it arrives.  Return 0 on
+success, or -1 if the connection can't be reused yet.  (Client only.)
+*/
+
+static int
+tunnel_out_reuse (Tunnel *tunnel)
+{
+  Http_response response;
+  Http_buffer *buf = &tunnel->out_idle_buf;
+  int fd = tunnel->out_idle_fd;
+  ssize_t n;
+
+  if (fd == -1 || tunnel->standby_fd != -1)
+    return -1;
+
+  n = -1;
+  errno = EAGAIN;
+  while (buf->header_length == 0 &&
+	 n == -1 && errno == EAGAIN &&
+	 wait_for_fd_timeout (fd, POLLIN, 0) > 0)
+    n = http_fill_header (fd, buf);
+  if (buf->header_length == 0 && n == -1 && errno == EAGAIN)
+    {
+      log_debug ("tunnel_out_reuse: no response yet");
+      return -1;
+    }
+  else if (buf->header_length == 0 ||
+	   http_parse_response_header (buf, &response) == -1)
+    log_debug ("tunnel_out_reuse: no response");
+  else if (response.status_code != 200 ||
+	   buf->length != buf->header_length ||
+	   !http_persistent (response.major_version,
+			     response.minor_version, response.header) ||
+	   wait_for_fd_timeout (fd, POLLIN, 0) != 0)
+    log_debug ("tunnel_out_reuse: connection not kept");
+  else
+    {
+      tunnel->out_idle_fd = -1;
+      tunnel->standby_fd = fd;
+      tunnel->standby_ready = FALSE;
+      log_debug ("tunnel_out_reuse: reusing persistent connection");
+      return 0;
+    }
+
+  close (fd);
+  tunnel->out_idle_fd = -1;
+  return -1;
+}
+
+static void
+tunnel_in_standby_close (Tunnel *tunnel)
+{
+  if (tunnel->in_standby_fd == -1)
+    return;
+
+  close (tunnel->in_standby_fd);
+  tunnel->in_standby_fd = -1;
+  tunnel->in_standby_ready = FALSE;
+}
+
+/*
+If the standby GET has been connected, send the request.  The server
+queues it, and responds when the current GET is used up.  Return as
+tunnel_standby_finish().  (Client only.)
+*/
+
+static int
+tunnel_in_standby_finish (Tunnel *tunnel, int timeout)
+{
+  int n;
+
+  if (tunnel->in_standby_fd == -1)
+    return -1;
+  if (tunnel->in_standby_ready)
+    return 1;
+
+  n = tunnel_connect_finish (tunnel->in_standby_fd, timeout);
+  if (n == 0)
+    return 0;
+  if (n == -1)
+    {
+      tunnel_in_standby_close (tunnel);
+      return -1;
+    }
+
+  tunnel_in_setsockopts (tunnel->in_standby_fd);
+
+  if (http_get (tunnel->in_standby_fd, &tunnel->dest) == -1)
+    {
+      log_error ("tunnel_in_standby_finish: write error: %s",
+		 strerror (errno));
+      tunnel_in_standby_close (tunnel);
+      return -1;
+    }
+
+  tunnel->in_standby_ready = TRUE;
+  log_debug ("tunnel_in_standby_finish: standby input connected");
+  return 1;
+}
+
+/*
+Keep track of how much of the current GET has been received, and
+start the next one once past the standby threshold.  (Client only.)
+*/
+
+static void
+tunnel_in_standby_update (Tunnel *tunnel, size_t n)
+{
+  tunnel->in_conn_bytes += n;
+
+  /* A chunked GET has no length to measure against.  A server that
+     hasn't answered TUNNEL_OPEN is an older one, which turns away a
+     GET while it still has one. */
+  if (!tunnel_is_client (tunnel) || tunnel->standby_threshold <= 0 ||
+      tunnel->in_chunked || !tunnel->open_answered)
+    return;
+
+  if (tunnel->in_standby_fd != -1)
+    tunnel_in_standby_finish (tunnel, 0);
+  else if (tunnel->in_conn_bytes >= (tunnel->in_conn_length / 100 *
+				     tunnel->standby_threshold))
+    {
+      /* The server has the current GET by now, so a GET sent on the
+	 connection kept from the previous one is queued after it. */
+      if (tunnel->in_reuse_fd != -1)
+	{
+	  tunnel->in_standby_fd = tunnel->in_reuse_fd;
+	  tunnel->in_reuse_fd = -1;
+	  if (http_get (tunnel->in_standby_fd, &tunnel->dest) != -1)
+	    {
+	      tunnel->in_standby_ready = TRUE;
+	      log_debug ("tunnel_in_standby_update: reusing persistent "
+			 "connection");
+	      return;
+	    }
+	  tunnel_in_standby_close (tunnel);
+	}
+
+      tunnel->in_standby_fd = tunnel_connect_start (tunnel);
+      tunnel->in_standby_ready = FALSE;
+      if (tunnel->in_standby_fd != -1)
+	log_debug ("tunnel_in_standby_update: connecting standby input");
+    }
+}
+
+/*
+Send the header of the POST started by tunnel_out_connect(), once it's
+connected.  Until then, output is queued for it.  Return 1 when it's
+sent, 0 if the connection isn't made yet, or -1 if it failed, and the
+output was lost with it.  (Client only.)
+*/
+
+static int
+tunnel_out_connect_step (Tunnel *tunnel)
+{
+  int fd = tunnel->out_connect_fd;
+  ssize_t n;
+
+  n = tunnel_connect_finish (fd, 0);
+  if (n == 0)
+    return 0;
+
+  if (n == 1)
+    {
+      tunnel_out_setsockopts (fd);
+#ifdef USE_SHUTDOWN
+      shutdown (fd, 0);
+#endif
+
+      /* + 1 to allow for TUNNEL_DISCONNECT */
+      tunnel->dest.sequence++;
+      n = http_post (fd, &tunnel->dest, tunnel->content_length + 1);
+      if (n == -1)
+	tunnel->dest.sequence--;
+    }
+  if (n == -1)
+    {
+      log_error ("tunnel_out_connect_step: couldn't connect output: %s",
+		 strerror (errno));
+      tunnel_out_fail (tunnel);
+      return -1;
+    }
+#ifdef IO_COUNT_HTTP_HEADER
+  tunnel->out_total_raw += n;
+  log_annoying ("tunnel_out_connect_step: out_total_raw = %u",
+		tunnel->out_total_raw);
+#endif
+
+  tunnel->out_connect_fd = -1;
+  log_debug ("tunnel_out_connect_step: output connected");
+  return 1;
+}
+
+/*
+Start a POST for tunnel output on the standby connection, or a new
+one, without waiting for the network.  Requests are queued until it's
+connected; see tunnel_out_connect_step().  A new POST isn't started
+while output is still queued for the previous one.  Return 0, or -1
+with errno EAGAIN in that case.  (Client only.)
+*/
+
+static int
+tunnel_out_connect (Tunnel *tunnel)
+{
+  if (tunnel_is_connected (tunnel))
+    {
+      log_debug ("tunnel_out_connect: already connected");
+      tunnel_out_disconnect (tunnel);
+    }
+
+  if (tunnel->out_queue_len > 0)
+    {
+      log_debug ("tunnel_out_connect: previous output still queued");
+      errno = EAGAIN;
+      return -1;
+    }
+
+  tunnel_out_reuse (tunnel);
+  if (tunnel_standby_finish (tunnel, 0) == 1)
+    {
+      tunnel->out_fd = tunnel->standby_fd;
+      tunnel->out_generation++;
+      tunnel->bytes = tunnel->standby_bytes;
+      tunnel->standby_fd = -1;
+      tunnel->standby_ready = FALSE;
+      tunnel->padding_only = TRUE;
+      time (&tunnel->out_connect_time);
+      log_debug ("tunnel_out_connect: switched to standby output");
+      return 0;
+    }
+
+  /* A standby that's still connecting is as good as a new one. */
+  if (tunnel->standby_fd != -1)
+    {
+      tunnel->out_fd = tunnel->standby_fd;
+      tunnel->standby_fd = -1;
+      tunnel->standby_ready = FALSE;
+      tunnel->standby_bytes = 0;
+    }
+  else
+    tunnel->out_fd = tunnel_connect_start (tunnel);
+  if (tunnel->out_fd == -1)
+    {
+      log_error ("tunnel_out_connect: connect (%d.%d.%d.%d:%u) error: %s",
+		  ntohl (tunnel->address.sin_addr.s_addr) >> 24,
+		 (ntohl (tunnel->address.sin_addr.s_addr) >> 16) & 0xff,
+		 (ntohl (tunnel->address.sin_addr.s_addr) >>  8) & 0xff,
+		  ntohl (tunnel->address.sin_addr.s_addr)        & 0xff,
+		  ntohs (tunnel->address.sin_port),
+		 strerror (errno));
+      return -1;
+    }
+
+  tunnel->out_connect_fd = tunnel->out_fd;
+  tunnel->out_generation++;
+  tunnel->bytes = 0;
+  tunnel->padding_only = TRUE;
+  time (&tunnel->out_connect_time);
+
+  log_debug ("tunnel_out_connect: connecting output");
+  return 0;
+}
+
+/*
+Decode LENGTH bytes of a chunked message body at DATA in place, and
+return how many bytes of tunnel data they held.  Anything after the
+end of the message is left as it is.
+*/
+
+static size_t
+tunnel_dechunk (Tunnel *tunnel, char *data, size_t length)
+{
+  char *p = data, *q = data, *end = data + length;
+  size_t n;
+  int c;
+
+  while (p < end)
+    switch (tunnel->in_chunk_state)
+      {
+      case CHUNK_SIZE:
+	c = (unsigned char)*p;
+	if (!isxdigit (c))
+	  {
+	    tunnel->in_chunk_state = CHUNK_EXTENSION;
+	    break;
+	  }
+	c = isdigit (c) ? c - '0' : tolower (c) - 'a' + 10;
+	tunnel->in_chunk_left = 16 * tunnel->in_chunk_left + c;
+	p++;
+	break;
+
+      case CHUNK_EXTENSION:
+	if (*p++ == '\n')
+	  tunnel->in_chunk_state = (tunnel->in_chunk_left > 0
+				    ? CHUNK_DATA : CHUNK_TRAILER);
+	break;
+
+      case CHUNK_DATA:
+	n = min (tunnel->in_chunk_left, end - p);
+	memmove (q, p, n);
+	p += n;
+	q += n;
+	tunnel->in_chunk_left -= n;
+	if (tunnel->in_chunk_left == 0)
+	  tunnel->in_chunk_state = CHUNK_DATA_END;
+	break;
+
+      case CHUNK_DATA_END:
+	if (*p++ == '\n')
+	  tunnel->in_chunk_state = CHUNK_SIZE;
+	break;
+
+      case CHUNK_TRAILER:
+	c = *p++;
+	if (c == '\n')
+	  tunnel->in_chunk_state = CHUNK_END;
+	else if (c != '\r')
+	  tunnel->in_chunk_state = CHUNK_TRAILER_LINE;
+	break;
+
+      case CHUNK_TRAILER_LINE:
+	if (*p++ == '\n')
+	  tunnel->in_chunk_state = CHUNK_TRAILER;
+	break;
+
+      case CHUNK_END:
+	n = end - p;
+	memmove (q, p, n);
+	p += n;
+	q += n;
+	break;
+      }
+
+  return q - data;
+}
+
+/*
+Put message body bytes that were read together with an HTTP header
+into the empty receive buffer.
+*/
+
+static void
+tunnel_in_buf_init (Tunnel *tunnel, Http_buffer *buf)
+{
+  size_t n = buf->length - buf->header_length;
+
+  tunnel->in_chunk_state = CHUNK_SIZE;
+  tunnel->in_chunk_left = 0;
+  memcpy (tunnel->in_buf, buf->data + buf->header_length, n);
+  tunnel->in_buf_start = 0;
+  tunnel->in_buf_len = (tunnel->in_chunked
+			? tunnel_dechunk (tunnel, tunnel->in_buf, n) : n);
+  tunnel->in_total_raw += n;
+  tunnel->in_conn_bytes = n;
+#ifdef HAVE_LIBZ
+  tunnel->in_z_fresh = TRUE;
+#endif
+  log_annoying ("tunnel_in_buf_init: %d bytes after header", n);
+}
+
+/*
+Stop waiting for the response to a GET.  (Client only.)
+*/
+
+static void
+tunnel_in_connect_close (Tunnel *tunnel)
+{
+  if (tunnel->in_connect_fd == -1)
+    return;
+
+  close (tunnel->in_connect_fd);
+  tunnel->in_connect_fd = -1;
+  tunnel->in_connect_sent = FALSE;
+}
+
+/*
+Note that the GET on in_connect_fd has been sent.  (Client only.)
+*/
+
+static int
+tunnel_in_connect_sent (Tunnel *tunnel)
+{
+  tunnel->in_connect_sent = TRUE;
+
+#ifdef USE_SHUTDOWN
+  if (shutdown (tunnel->in_connect_fd, 1) == -1)
+    {
+      log_error ("tunnel_in_connect_sent: shutdown() error: %s",
+		 strerror (errno));
+      return -1;
+    }
+#endif
+
+  return 0;
+}
+
+/*
+Start a GET for tunnel input on the standby connection, a persistent
+one, or else a new one.  Return -1 if no connection can be started.
+(Client only.)
+*/
+
+static int
+tunnel_in_connect_start (Tunnel *tunnel)
+{
+  /* The server responds to a standby GET as soon as the previous
+     one is used up, so its response should be on the way already.
+     A standby or persistent connection may have been closed by a
+     proxy meanwhile, and then a new connection is made. */
+  tunnel->in_connect_reused = TRUE;
+  if (tunnel->in_standby_fd != -1)
+    {
+      tunnel->in_connect_fd = tunnel->in_standby_fd;
+      tunnel->in_connect_sent = FALSE;
+      if (tunnel->in_standby_ready &&
+	  tunnel_in_connect_sent (tunnel) == -1)
+	{
+	  tunnel->in_connect_fd = -1;
+	  return -1;
+	}
+      tunnel->in_standby_fd = -1;
+      tunnel->in_standby_ready = FALSE;
+      log_debug ("tunnel_in_connect_start: switched to standby input");
+    }
+  else if (tunnel->in_reuse_fd != -1 &&
+	   http_get (tunnel->in_reuse_fd, &tunnel->dest) != -1)
+    {
+      tunnel->in_connect_fd = tunnel->in_reuse_fd;
+      tunnel->in_reuse_fd = -1;
+      log_debug ("tunnel_in_connect_start: reusing persistent connection");
+      if (tunnel_in_connect_sent (tunnel) == -1)
+	return -1;
+    }
+  else
+    {
+      if (tunnel->in_reuse_fd != -1)
+	{
+	  close (tunnel->in_reuse_fd);
+	  tunnel->in_reuse_fd = -1;
+	}
+
+      tunnel->in_connect_reused = FALSE;
+      tunnel->in_connect_sent = FALSE;
+      tunnel->in_connect_fd = tunnel_connect_start (tunnel);
+      if (tunnel->in_connect_fd == -1)
+	{
+	  log_error ("tunnel_in_connect_start: connect error: %s",
+		     strerror (errno));
+	  return -1;
+	}
+    }
+
+  tunnel->in_connect_buf.length = 0;
+  tunnel->in_connect_buf.header_length = 0;
+  tunnel->in_generation++;
+  return 0;
+}
+
+/*
+Go on with the GET started by tunnel_in_connect_start(), as far as it
+goes without waiting.  Return values are as for tunnel_in_connect().
+(Client only.)
+*/
+
+static int
+tunnel_in_connect_step (Tunnel *tunnel)
+{
+  Http_response response;
+  const char *length;
+  int fd = tunnel->in_connect_fd;
+  ssize_t n;
+
+  if (!tunnel->in_connect_sent)
+    {
+      n = tunnel_connect_finish (fd, 0);
+      if (n == 0)
+	{
+	  errno = EAGAIN;
+	  return 0;
+	}
+      else if (n == 1)
+	{
+	  tunnel_in_setsockopts (fd);
+	  if (http_get (fd, &tunnel->dest) == -1)
+	    log_error ("tunnel_in_connect_step: write error: %s",
+		       strerror (errno));
+	  else if (tunnel_in_connect_sent (tunnel) != -1)
+	    {
+	      /* Now it's polled for the response. */
+	      tunnel->in_generation++;
+	      errno = EAGAIN;
+	      return 0;
+	    }
+	}
+      n = -1;
+    }
+  else
+    {
+      n = http_fill_header (fd, &tunnel->in_connect_buf);
+      if (n == -1 && errno == EAGAIN)
+	return 0;
+
+      if (n == 0)
+	log_error ("tunnel_in_connect_step: no response; peer "
+		   "closed connection");
+      else if (n == -1)
+	log_error ("tunnel_in_connect_step: no response; error: %s",
+		   strerror (errno));
+      else if (http_parse_response_header (&tunnel->in_connect_buf,
+					   &response) == -1)
+	n = -1;
+      else if (response.major_version != 1 ||
+	       (response.minor_version != 1 &&
+		response.minor_version != 0))
+	{
+	  log_error ("tunnel_in_connect_step: unknown HTTP version: %d.%d",
+		     response.major_version, response.minor_version);
+	  n = -1;
+	}
+      else if (response.status_code != 200)
+	{
+	  log_error ("tunnel_in_connect_step: HTTP error %d",
+		     response.status_code);
+	  errno = http_error_to_errno (-response.status_code);
+	  n = -1;
+	}
+    }
+
+  if (n <= 0)
+    {
+      int reused = tunnel->in_connect_reused;
+      int saved_errno = errno;
+
+      tunnel_in_connect_close (tunnel);
+      errno = saved_errno;
+      if (!reused || tunnel_in_connect_start (tunnel) == -1)
+	return -1;
+
+      return tunnel_in_connect_step (tunnel);
+    }
+
+  tunnel->in_fd = fd;
+  tunnel->in_connect_fd = -1;
+  tunnel->in_connect_sent = FALSE;
+  tunnel->in_answered = TRUE;
+  tunnel->in_generation++;
+
+#ifdef IO_COUNT_HTTP_HEADER
+  tunnel->in_total_raw += n;
+  log_annoying ("tunnel_in_connect_step: in_total_raw = %u",
+		tunnel->in_total_raw);
+#endif
+  length = http_header_get (response.header, "Content-Length");
+  tunnel->in_conn_length = (length ? (size_t)atol (length)
+			    : tunnel->content_length + 1);
+  tunnel->in_chunked = http_chunked (response.header);
+  tunnel->in_persistent = (tunnel->persistent &&
+			   http_persistent (response.major_version,
+					    response.minor_version,
+					    response.header));
+  tunnel_in_buf_init (tunnel, &tunnel->in_connect_buf);
+  tunnel_in_standby_update (tunnel, 0);
+
+  log_debug ("tunnel_in_connect_step: input connected");
+  return 1;
+}
+
+/*
+Connect the tunnel input with a GET, or go on connecting it, without
+waiting for the network.  Return 1 once the response header is in, 0
+with errno set to EAGAIN while it isn't yet, or -1 on error.  The
+descriptor to poll meanwhile is tunnel_pollin_fd().  (Client only.)
+*/
+
+static int
+tunnel_in_connect (Tunnel *tunnel)
+{
+  log_verbose ("tunnel_in_connect()");
+
+  if (tunnel->in_fd != -1)
+    {
+      log_error ("tunnel_in_connect: already connected");
+      return -1;
+    }
+
+  if (tunnel->in_connect_fd == -1 &&
+      tunnel_in_connect_start (tunnel) == -1)
+    return -1;
+
+  return tunnel_in_connect_step (tunnel);
+}
+
+/*
+Use the POST connection CONN for tunnel input.  (Server only.)
+*/
+
+static void
+tunnel_in_attach (Tunnel *tunnel, Tunnel_connection *conn)
+{
+  const char *length;
+
+  tunnel->in_fd = conn->fd;
+  tunnel->in_generation++;
+  if (conn->sequence != 0)
+    tunnel->in_sequence = conn->sequence;
+
+#ifdef IO_COUNT_HTTP_HEADER
+  tunnel->in_total_raw += conn->buf.header_length;
+  log_annoying ("tunnel_in_attach: in_total_raw = %u",
+		tunnel->in_total_raw);
+#endif
+  length = http_header_get (conn->request.header, "Content-Length");
+  tunnel->in_conn_length = length ? (size_t)atol (length) : 0;
+  tunnel->in_chunked = http_chunked (conn->request.header);
+  tunnel->in_persistent = (conn->persistent &&
+			   (length != NULL || tunnel->in_chunked));
+
+  /* A client that sends chunked POSTs gets chunked GET responses. */
+  if (tunnel->in_chunked)
+    tunnel->chunked = TRUE;
+  tunnel_in_buf_init (tunnel, &conn->buf);
+  free (conn);
+
+  set_nonblocking (tunnel->in_fd);
+
+  tunnel_in_setsockopts (tunnel->in_fd);
+
+  log_debug ("tunnel_in_attach: input connected");
+}
+
+/*
+Use the GET connection CONN for tunnel output, and send the response
+header.  (Server only.)
+*/
+
+static int
+tunnel_out_attach (Tunnel *tunnel, Tunnel_connection *conn)
+{
+  char str[1024];
+  char length[64];
+  struct iovec iov;
+
+  tunnel->out_fd = conn->fd;
+  tunnel->out_generation++;
+  tunnel->out_persistent = conn->persistent;
+  free (conn);
+
+  /* Output the client is slow to take is queued; see tunnel_flush(). */
+  set_nonblocking (tunnel->out_fd);
+  tunnel_out_setsockopts (tunnel->out_fd);
+
+  if (tunnel->chunked)
+    snprintf (length, sizeof length, "Transfer-Encoding: chunked");
+  else
+    /* +1 to allow for TUNNEL_DISCONNECT */
+    snprintf (length, sizeof length, "Content-Length: %lu",
+	      (unsigned long)tunnel->content_length + 1);
+
+  snprintf (str, sizeof(str),
+"HTTP/1.1 200 OK\r\n"
+/* "Date: %s\r\n" */
+/* "Server: %s\r\n" */
+/* "Last-Modified: %s\r\n" */
+/* "ETag: %s\r\n" */
+/* "Accept-Ranges: %s\r\n" */
+"%s\r\n"
+"Connection: %s\r\n"
+"Pragma: no-cache\r\n"
+"Cache-Control: no-cache, no-store, must-revalidate\r\n"
+"Expires: 0\r\n" /* FIXME: "0" is not a legitimate HTTP date. */
+"Content-Type: text/html\r\n"
+"\r\n",
+	    length,
+	    tunnel->out_persistent ? "keep-alive" : "close");
+  iov.iov_base = str;
+  iov.iov_len = strlen (str);
+  if (tunnel_writev (tunnel, &iov, 1) == -1)
+    {
+      log_error ("tunnel_out_attach: couldn't write GET header: %s",
+		 strerror (errno));
+      tunnel_out_fail (tunnel);
+      return -1;
+    }
+
+  tunnel->bytes = 0;
+#ifdef IO_COUNT_HTTP_HEADER
+  tunnel->out_total_raw += strlen (str);
+  log_annoying ("tunnel_out_attach: out_total_raw = %u",
+		tunnel->out_total_raw);
+#endif
+  log_debug ("tunnel_out_attach: output connected");
+
+  /* The client's TUNNEL_OPEN came before there was a GET to answer
+     it on.  The answer is written with the next output. */
+  if (tunnel->open_answer)
+    tunnel_answer_open (tunnel);
+  return 0;
+}
+
+/*
+Return TRUE if the POST connection CONN comes right after the last
+one attached.  A client that goes through several proxies may have
+its POSTs arrive out of order, or at different hts workers, so the
+client numbers them.  Connections without a number are taken in the
+order they arrive.  (Server only.)
+*/
+
+static int
+tunnel_in_is_next (Tunnel *tunnel, Tunnel_connection *conn)
+{
+  return (conn->sequence == 0 || tunnel->in_sequence == 0 ||
+	  conn->sequence <= tunnel->in_sequence + 1);
+}
+
+/*
+When a connection has ended, switch to the standby connection the
+client opened in advance, if any.  (Server only.)
+*/
+
+static void
+tunnel_in_promote (Tunnel *tunnel)
+{
+  Tunnel_connection *conn = tunnel->next_in;
+
+  if (tunnel->in_fd != -1 || conn == NULL ||
+      !tunnel_in_is_next (tunnel, conn))
+    return;
+
+  tunnel->next_in = conn->next;
+  tunnel_in_attach (tunnel, conn);
+}
+
+static int
+tunnel_out_promote (Tunnel *tunnel)
+{
+  Tunnel_connection *conn = tunnel->next_out;
+
+  if (tunnel_is_connected (tunnel))
+    return 0;
+
+  /* The GETs are answered one at a time. */
+  if (conn == NULL || tunnel->out_queue_len > 0)
+    {
+      log_debug ("tunnel_out_promote: waiting for client");
+      errno = EAGAIN;
+      return -1;
+    }
+
+  tunnel->next_out = conn->next;
+  return tunnel_out_attach (tunnel, conn);
+}
+
+/*
+Put CONN last in the standby queue *QUEUE, or before the first
+connection with a higher sequence number.  Return -1 if the queue
+already holds MAX connections; a MAX of 0 is no limit.
+*/
+
+static int
+tunnel_standby_queue (Tunnel_connection **queue, Tunnel_connection *conn,
+		      int max)
+{
+  Tunnel_connection **p;
+  int n = 0;
+
+  for (p = queue; *p != NULL; p = &(*p)->next)
+    if (max > 0 && ++n == max)
+      {
+	errno = EBUSY;
+	return -1;
+      }
+
+  if (conn->sequence != 0)
+    for (p = queue; *p != NULL; p = &(*p)->next)
+      if ((*p)->sequence > conn->sequence)
+	break;
+
+  conn->next = *p;
+  *p = conn;
+  return 0;
+}
+
+static void
+tunnel_standby_destroy (Tunnel_connection **queue)
+{
+  Tunnel_connection *conn;
+
+  while (*queue != NULL)
+    {
+      conn = *queue;
+      *queue = conn->next;
+      tunnel_connection_destroy (conn);
+    }
+}
+
+/*
+Append a request to the output batch.  Nothing is written until
+tunnel_out_flush() is called, so DATA must stay valid until then.
+*/
+
+static int
+tunnel_queue_request (Tunnel *tunnel, Request request,
+		      void *data, size_t length)
+{
+  unsigned char *header;
+  size_t n;
+
+  if (tunnel->out_reqs == OUT_BATCH_MAX && tunnel_out_flush (tunnel) == -1)
+    return -1;
+
+  header = tunnel->out_hdr[tunnel->out_reqs++];
+  header[0] = request;
+  n = sizeof request;
+  if (request == TUNNEL_DATA32 || request == TUNNEL_ZDATA)
+    {
+      header[1] = (length >> 24) & 0xff;
+      header[2] = (length >> 16) & 0xff;
+      header[3] = (length >> 8) & 0xff;
+      header[4] = length & 0xff;
+      n = sizeof_header32;
+    }
+  else if (data)
+    {
+      header[1] = length >> 8;
+      header[2] = length & 0xff;
+      n = sizeof_header;
+    }
+
+  tunnel->out_iov[tunnel->out_iovcnt].iov_base = header;
+  tunnel->out_iov[tunnel->out_iovcnt].iov_len = n;
+  tunnel->out_iovcnt++;
+
+  if (data && length > 0)
+    {
+      tunnel->out_iov[tunnel->out_iovcnt].iov_base = data;
+      tunnel->out_iov[tunnel->out_iovcnt].iov_len = length;
+      tunnel->out_iovcnt++;
+      n += length;
+    }
+
+  tunnel->bytes += n;
+  tunnel->out_ended = (request == TUNNEL_DISCONNECT);
+  return 0;
+}
+
+#ifdef HAVE_LIBZ
+/*
+Compress LENGTH bytes of DATA, which would be sent in a request with a
+HEADER byte header, into the output batch.  The TUNNEL_ZDATA requests
+of one HTTP message are a raw deflate stream, each ending with a sync
+flush whose last four bytes, always 00 00 ff ff, are left out.  Set
+*ZDATA to the compressed data and return its length, or return 0 if
+DATA should be sent as it is, which also ends the stream.
+*/
+
+static ssize_t
+tunnel_deflate (Tunnel *tunnel, void *data, size_t length, size_t header,
+		char **zdata)
+{
+  z_stream *z = tunnel->out_z;
+  size_t n;
+  int err;
+
+  if (z == NULL)
+    {
+      z = calloc (1, sizeof *z);
+      tunnel->out_zbuf = malloc (TUNNEL_DATA_MAX);
+      if (z == NULL || tunnel->out_zbuf == NULL ||
+	  deflateInit2 (z, tunnel->compress_level, Z_DEFLATED, -15, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+	  log_error ("tunnel_deflate: can't compress; sending data as is");
+	  free (z);
+	  free (tunnel->out_zbuf);
+	  tunnel->out_zbuf = NULL;
+	  tunnel->compress_level = 0;
+	  return 0;
+	}
+      tunnel->out_z = z;
+      tunnel->out_z_fresh = FALSE;
+    }
+  else if (tunnel->out_z_fresh)
+    {
+      deflateReset (z);
+      deflateParams (z, tunnel->compress_level, Z_DEFAULT_STRATEGY);
+      tunnel->out_z_fresh = FALSE;
+    }
+
+  /* The compressed data stays in the buffer until the batch is
+     written, so write it first if it's full. */
+  if ((tunnel->out_zbuf_len + length > TUNNEL_DATA_MAX ||
+       tunnel->out_reqs == OUT_BATCH_MAX) &&
+      tunnel_out_flush (tunnel) == -1)
+    return -1;
+
+  z->next_in = data;
+  z->avail_in = length;
+  z->next_out = (unsigned char *)tunnel->out_zbuf + tunnel->out_zbuf_len;
+  z->avail_out = length;
+  err = deflate (z, Z_SYNC_FLUSH);
+  n = length - z->avail_out;
+
+  if (err != Z_OK || z->avail_in > 0 || z->avail_out == 0 ||
+      n - 4 + sizeof_header32 >= length + header)
+    {
+      log_annoying ("tunnel_deflate: %d bytes don't compress", length);
+      tunnel->out_z_fresh = TRUE;
+      if (length >= ZDATA_SKIP_MIN)
+	tunnel->out_z_skip = ZDATA_SKIP;
+      return 0;
+    }
+
+  log_annoying ("tunnel_deflate: %d bytes compressed to %d", length, n - 4);
+  *zdata = tunnel->out_zbuf + tunnel->out_zbuf_len;
+  tunnel->out_zbuf_len += n - 4;
+  return n - 4;
+}
+#endif /* HAVE_LIBZ */
+
+static int
+tunnel_write_request (Tunnel *tunnel, Request request,
+		      void *data, size_t length)
+{
+  size_t limit = tunnel_out_length (tunnel);
+  size_t header;
+
+  if (request == TUNNEL_DATA32)
+    header = sizeof_header32;
+  else
+    header = data ? sizeof_header : sizeof request;
+
+  if (tunnel->bytes + header + (data ? length : 0) > limit)
+    tunnel_queue_padding (tunnel, limit - tunnel->bytes);
+
+#if 1 /* FIXME: this is a kludge */
+  {
+    time_t t;
+
+    time (&t);
+    if (request != TUNNEL_PADDING &&
+	request != TUNNEL_PAD1 &&
+	tunnel_is_client (tunnel) &&
+	tunnel_is_connected (tunnel) &&
+	t - tunnel->out_connect_time > tunnel->max_connection_age)
+      {
+	log_debug ("tunnel_write_request: connection > %d seconds old",
+		   tunnel->max_connection_age);
+
+	if (tunnel->strict_content_length && !tunnel->chunked)
+	  {
+	    log_debug ("tunnel_write_request: write padding (%d bytes)",
+		       tunnel->content_length - tunnel->bytes);
+	    tunnel_queue_padding (tunnel,
+				  tunnel->content_length - tunnel->bytes);
+	  }
+
+	/* Padding up to Content-Length ends with TUNNEL_DISCONNECT. */
+	if (tunnel_is_connected (tunnel))
+	  {
+	    log_debug ("tunnel_write_request: closing old connection");
+	    if (tunnel_queue_request (tunnel, TUNNEL_DISCONNECT,
+				      NULL, 0) == -1 ||
+		tunnel_out_flush (tunnel) == -1)
+	      return -1;
+	    tunnel_out_disconnect (tunnel);
+	  }
+      }
+  }
+#endif
+
+  if (tunnel_is_disconnected (tunnel))
+    {
+      if (tunnel_is_client (tunnel))
+	{
+	  if (tunnel_out_connect (tunnel) == -1)
+	    return -1;
+	}
+      else
+	{
+	  if (tunnel_out_promote (tunnel) == -1)
+	    return -1;
+	}
+    }
+
+  if (request != TUNNEL_PADDING && request != TUNNEL_PAD1)
+    tunnel->padding_only = FALSE;
+
+#ifdef DEBUG_MODE
+  if ((request == TUNNEL_DATA || request == TUNNEL_DATA32) &&
+      data != tunnel_spliced && debug_level >= 5)
+    {
+      log_annoying ("tunnel_write_request: %s:", REQ_TO_STRING (request));
+      dump_buf (debug_file, data, (size_t)length);
+    }
+#endif
+
+#ifdef HAVE_LIBZ
+  /* Padding is never compressed; it must stay as long as it is. */
+  if ((request == TUNNEL_DATA || request == TUNNEL_DATA32) &&
+      tunnel->out_zdata && tunnel->compress_level > 0)
+    {
+      ssize_t n = 0;
+      char *zdata;
+
+      if (tunnel->out_z_skip > 0)
+	tunnel->out_z_skip--;
+      else if (data != tunnel_spliced)
+	n = tunnel_deflate (tunnel, data, length, header, &zdata);
+      if (n == -1)
+	return -1;
+
+      if (n > 0)
+	{
+	  request = TUNNEL_ZDATA;
+	  data = zdata;
+	  length = n;
+	  header = sizeof_header32;
+	}
+      else
+	tunnel->out_z_fresh = TRUE;
+    }
+#endif
+
+  if (tunnel_queue_request (tunnel, request, data, length) == -1)
+    return -1;
+
+  if (data)
+    {
+      tunnel->out_total_raw += header + length;
+
+      if (request == TUNNEL_DATA || request == TUNNEL_DATA32 ||
+	  request == TUNNEL_ZDATA)
+	log_verbose ("tunnel_write_request: %s (%d)",
+		     REQ_TO_STRING (request), length);
+      else
+	log_debug ("tunnel_write_request: %s (%d)",
+		     REQ_TO_STRING (request), length);
+    }
+  else
+    {
+      tunnel->out_total_raw += 1;
+      log_debug ("tunnel_write_request: %s", REQ_TO_STRING (request));
+    }
+
+  log_annoying ("tunnel_write_request: out_total_raw = %u",
+		tunnel->out_total_raw);
+
+#ifdef DEBUG_MODE
+  if (tunnel->bytes > limit)
+    log_debug ("tunnel_write_request: tunnel->bytes > tunnel->content_length");
+#endif
+
+  /* Past the threshold, have the next connection ready before this
+     one is used up.  It's started before the batch is written, so
+     that the connect overlaps the write, but not before this one has
+     its header sent, so that they are numbered in order.  An older
+     server doesn't answer TUNNEL_OPEN, and turns away a POST that
+     arrives before this one has ended. */
+  if (tunnel_is_client (tunnel) && tunnel->standby_threshold > 0 &&
+      tunnel->open_answered && tunnel->out_connect_fd == -1)
+    {
+      if (tunnel->standby_fd != -1)
+	tunnel_standby_finish (tunnel, 0);
+      else if (tunnel->bytes >= (limit / 100 * tunnel->standby_threshold) &&
+	       tunnel_out_reuse (tunnel) == -1 &&
+	       tunnel->out_idle_fd == -1)
+	tunnel_standby_connect (tunnel);
+    }
+
+  if (tunnel->bytes >= limit)
+    {
+      tunnel_queue_request (tunnel, TUNNEL_DISCONNECT, NULL, 0);
+      tunnel_out_disconnect (tunnel);
+
+      /* The client waits for the response to its standby GET. */
+      if (!tunnel_is_client (tunnel) && tunnel->next_out != NULL)
+	tunnel_out_promote (tunnel);
+    }
+
+  return 0;
+}
+
+/*
+Fill in the data of a TUNNEL_OPEN request, and return its length.
+The first byte is a dummy, and is all that older versions send.  If
+the second has OPEN_DATA32 set, the sender takes TUNNEL_DATA32
+requests with up to as many bytes of data as the 32-bit number after
+it.  The client offers this in its TUNNEL_OPEN, and the server answers
+with a TUNNEL_OPEN of its own on the GET connection.  OPEN_MULTIPLEX
+is set by a client that wants to carry many streams in the tunnel,
+and by a server that agrees to.  OPEN_COMPRESS is set by a sender that
+takes TUNNEL_ZDATA requests.
+*/
+
+static size_t
+tunnel_open_data (Tunnel *tunnel, unsigned char *data)
+{
+  data[0] = 42; /* dummy data, not used by server */
+  data[1] = OPEN_DATA32 | (tunnel->multiplex ? OPEN_MULTIPLEX : 0);
+#ifdef HAVE_LIBZ
+  data[1] |= OPEN_COMPRESS;
+#endif
+  data[2] = (TUNNEL_DATA_MAX >> 24) & 0xff;
+  data[3] = (TUNNEL_DATA_MAX >> 16) & 0xff;
+  data[4] = (TUNNEL_DATA_MAX >> 8) & 0xff;
+  data[5] = TUNNEL_DATA_MAX & 0xff;
+  return 6;
+}
+
+/*
+Queue the server's answer to the client's TUNNEL_OPEN.
+*/
+
+static int
+tunnel_answer_open (Tunnel *tunnel)
+{
+  static unsigned char open_data[6];
+
+  tunnel->open_answer = FALSE;
+  return tunnel_write_request (tunnel, TUNNEL_OPEN, open_data,
+			       tunnel_open_data (tunnel, open_data));
+}
+
+static void
+tunnel_open_received (Tunnel *tunnel, const unsigned char *data,
+		      size_t length)
+{
+  size_t max;
+
+  if (length < 6 || !(data[1] & OPEN_DATA32))
+    return;
+
+  max = ((size_t)data[2] << 24) | (data[3] << 16) | (data[4] << 8) | data[5];
+  if (max < 65535)
+    max = 65535;
+  tunnel->out_data_max = min (max, TUNNEL_DATA_MAX);
+  tunnel->out_zdata = (data[1] & OPEN_COMPRESS) != 0;
+  log_debug ("tunnel_open_received: peer takes %d bytes per request%s",
+	     tunnel->out_data_max, tunnel->out_zdata ? ", compressed" : "");
+
+  if (tunnel_is_server (tunnel))
+    {
+      tunnel->open_answer = TRUE;
+      if (tunnel_can_write (tunnel) && tunnel_answer_open (tunnel) == 0)
+	tunnel_out_flush (tunnel);
+    }
+  else
+    {
+      tunnel->open_answered = TRUE;
+      tunnel->multiplex = tunnel->multiplex && (data[1] & OPEN_MULTIPLEX);
+    }
+}
+
+int
+tunnel_connect (Tunnel *tunnel)
+{
+  unsigned char open_data[6];
+
+  log_verbose ("tunnel_connect()");
+
+  if (tunnel->in_answered)
+    return 1;
+  if (tunnel->in_connect_fd != -1)
+    return tunnel_in_connect (tunnel);
+
+  if (tunnel_is_connected (tunnel))
+    {
+      log_error ("tunnel_connect: already connected");
+      errno = EINVAL;
+      return -1;
+    }
+
+  /* Until the server answers, it may not know TUNNEL_DATA32. */
+  tunnel->out_data_max = 65535;
+  if (tunnel_write_request (tunnel, TUNNEL_OPEN, open_data,
+			    tunnel_open_data (tunnel, open_data)) == -1 ||
+      tunnel_out_flush (tunnel) == -1)
+    return -1;
+
+  return tunnel_in_connect (tunnel);
+}
+
+/*
+Return how many of LENGTH bytes fit in a request with a HEADER byte
+header, filling what's left of the current connection, or a new one.
+*/
+
+static inline size_t
+tunnel_data_fit (Tunnel *tunnel, size_t length, size_t header)
+{
+  size_t limit = tunnel_out_length (tunnel);
+
+  if (tunnel->bytes + length > limit - header &&
+      limit - tunnel->bytes > header)
+    return limit - header - tunnel->bytes;
+  else if (length > limit - header)
+    return limit - header;
+  else
+    return length;
+}
+
+/*
+Return how many of LENGTH bytes of data to send in the next request.
+More than 65535 bytes are sent in a TUNNEL_DATA32 request, if the peer
+takes those.
+*/
+
+static size_t
+tunnel_data_length (Tunnel *tunnel, size_t length)
+{
+  size_t n;
+
+  n = tunnel_data_fit (tunnel, length, sizeof_header);
+  if (n <= 65535)
+    return n;
+  if (tunnel->out_data_max <= 65535)
+    return 65535;
+
+  n = tunnel_data_fit (tunnel, length, sizeof_header32);
+  return min (n, tunnel->out_data_max);
+}
+
+/*
+Queue LENGTH bytes of DATA as TUNNEL_DATA or TUNNEL_DATA32 requests,
+split so that they fit in the current connection.  Return the number
+of bytes queued.
+*/
+
+static inline int
+tunnel_write_data (Tunnel *tunnel, void *data, size_t length)
+{
+  size_t n, remaining;
+  char *wdata = data;
+
+  for (remaining = length; remaining > 0; remaining -= n, wdata += n)
+    {
+      n = tunnel_data_length (tunnel, remaining);
+      if (tunnel_write_request (tunnel, (n > 65535
+					 ? TUNNEL_DATA32 : TUNNEL_DATA),
+				wdata, n) == -1)
+	break;
+    }
+
+  return length - remaining;
+}
+
+/*
+Keep data that can't be sent until the client opens a new GET
+connection.  (Server only.)
+*/
+
+static int
+tunnel_out_pend (Tunnel *tunnel, const char *data, size_t length)
+{
+  char *p;
+
+  p = realloc (tunnel->out_pending, tunnel->out_pending_len + length);
+  if (p == NULL)
+    {
+      log_error ("tunnel_out_pend: out of memory");
+      errno = ENOMEM;
+      return -1;
+    }
+
+  memcpy (p + tunnel->out_pending_len, data, length);
+  tunnel->out_pending = p;
+  tunnel->out_pending_len += length;
+  log_debug ("tunnel_out_pend: %d bytes pending", tunnel->out_pending_len);
+  return 0;
+}
+
+static void
+tunnel_out_send_pending (Tunnel *tunnel)
+{
+  size_t n;
+
+  if (tunnel->out_pending_len == 0)
+    return;
+
+  n = tunnel_write_data (tunnel, tunnel->out_pending,
+			 tunnel->out_pending_len);
+  tunnel_out_flush (tunnel);
+
+  tunnel->out_pending_len -= n;
+  memmove (tunnel->out_pending, tunnel->out_pending + n,
+	   tunnel->out_pending_len);
+  log_debug ("tunnel_out_send_pending: %d bytes sent, %d bytes pending",
+	     n, tunnel->out_pending_len);
+}
+
+ssize_t
+tunnel_write (Tunnel *tunnel, void *data, size_t length)
+{
+  ssize_t n;
+
+  if (tunnel->out_pending_len > 0)
+    n = 0;
+  else
+    n = tunnel_write_data (tunnel, data, length);
+  if (tunnel_out_flush (tunnel) == -1)
+    return -1;
+
+  /* A client's data waits like this while the previous POST still
+     has output queued. */
+  if (n < length && tunnel_is_disconnected (tunnel) &&
+      (tunnel_is_server (tunnel) || tunnel->out_queue_len > 0))
+    {
+      if (tunnel_out_pend (tunnel, (char *)data + n, length - n) == -1)
+	return n > 0 ? n : -1;
+      n = length;
+    }
+
+  tunnel->out_total_data += length;
+  log_verbose ("tunnel_write: out_total_data = %u", tunnel->out_total_data);
+  return n;
+}
+
+ssize_t
+tunnel_flush (Tunnel *tunnel)
+{
+  size_t written;
+  ssize_t n;
+  int fd;
+
+  if (tunnel->out_connect_fd != -1)
+    {
+      n = tunnel_out_connect_step (tunnel);
+      if (n == -1)
+	return -1;
+      if (n == 0)
+	return tunnel->out_queue_len;
+    }
+
+  fd = tunnel->out_queue_fd;
+  if (tunnel->out_queue_len == 0)
+    return 0;
+
+  for (written = 0; written < tunnel->out_queue_len; written += n)
+    {
+      n = write (fd, tunnel->out_queue + written,
+		 tunnel->out_queue_len - written);
+      log_annoying ("write (%d, %p, %d) = %d", fd,
+		    tunnel->out_queue + written,
+		    tunnel->out_queue_len - written, n);
+      if (n == -1 && errno == EINTR)
+	n = 0;
+      else if (n == -1 && errno == EAGAIN)
+	break;
+      else if (n <= 0)
+	{
+	  log_error ("tunnel_flush: write error: %s", strerror (errno));
+	  tunnel_out_fail (tunnel);
+	  return -1;
+	}
+    }
+
+  tunnel->out_queue_len -= written;
+  memmove (tunnel->out_queue, tunnel->out_queue + written,
+	   tunnel->out_queue_len);
+  if (tunnel->out_queue_len > 0)
+    return tunnel->out_queue_len;
+
+  /* The connection may have ended with output queued.  A server can
+     answer the next GET now, and a client make the next POST. */
+  tunnel->out_queue_fd = -1;
+  if (fd != tunnel->out_fd)
+    {
+      tunnel_out_done (tunnel, fd, tunnel->out_queue_keep);
+      if (tunnel_is_client (tunnel) || tunnel_out_promote (tunnel) == 0)
+	{
+	  tunnel_out_send_pending (tunnel);
+	  tunnel_out_flush (tunnel);
+	}
+    }
+
+  return tunnel->out_queue_len;
+}
+
+/*
+Adapt the size of device reads to the traffic: double it whenever a
+read of ASKED bytes fills it, up to TUNNEL_DATA_MAX, and halve it when
+a read uses less than a quarter.  Bulk transfers then get few large
+requests, and interactive traffic doesn't tie up a large buffer.
+*/
+
+static void
+tunnel_read_adapt (Tunnel *tunnel, size_t asked, size_t n)
+{
+  /* A read cut short to fit the connection says nothing. */
+  if (asked < tunnel->read_size)
+    return;
+
+  if (n >= asked && tunnel->read_size < TUNNEL_DATA_MAX)
+    tunnel->read_size = min (2 * tunnel->read_size, TUNNEL_DATA_MAX);
+  else if (n < asked / 4 && tunnel->read_size > READ_SIZE_MIN)
+    tunnel->read_size /= 2;
+  else
+    return;
+
+  log_verbose ("tunnel_read_adapt: read size %d", tunnel->read_size);
+}
+
+#ifdef HAVE_SPLICE
+/*
+Return nonzero if data written now would be compressed.
+*/
+
+static int
+tunnel_compressing (Tunnel *tunnel)
+{
+#ifdef HAVE_LIBZ
+  return (tunnel->out_zdata && tunnel->compress_level > 0 &&
+	  tunnel->out_z_skip == 0);
+#else
+  return FALSE;
+#endif
+}
+
+/*
+Splice at most LENGTH bytes from FD into the pipe, and send them as
+one TUNNEL_DATA or TUNNEL_DATA32 request.  Return -1 with errno ENOSYS
+if the data must be read into memory instead, as it must to be
+compressed.
+*/
+
+static ssize_t
+tunnel_splice_from (Tunnel *tunnel, int fd, size_t length)
+{
+  ssize_t n;
+
+  /* Data that can't be sent right away is kept in memory anyway. */
+  if (tunnel->no_splice || tunnel->out_pending_len > 0 ||
+      tunnel->out_queue_len > 0 || tunnel->out_connect_fd != -1 ||
+      !tunnel_can_write (tunnel) || tunnel_compressing (tunnel) ||
+      tunnel_pipe (tunnel) == -1)
+    {
+      errno = ENOSYS;
+      return -1;
+    }
+
+  /* Fill what's left of the current connection, like
+     tunnel_write_data() does. */
+  length = tunnel_data_length (tunnel, length);
+
+  n = splice (fd, NULL, tunnel->pipe_fd[1], NULL, length,
+	      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n == -1 && errno == EINVAL)
+    {
+      log_debug ("tunnel_splice_from: can't splice from %d; copying", fd);
+      tunnel->no_splice = TRUE;
+      errno = ENOSYS;
+    }
+  if (n <= 0)
+    return n;
+  tunnel->pipe_len = n;
+  tunnel_read_adapt (tunnel, length, n);
+
+  if (tunnel_write_request (tunnel, n > 65535 ? TUNNEL_DATA32 : TUNNEL_DATA,
+			    tunnel_spliced, n) == -1)
+    {
+      if (tunnel_is_client (tunnel) || !tunnel_is_disconnected (tunnel))
+	{
+	  tunnel_pipe_drain (tunnel, FALSE);
+	  return -1;
+	}
+      tunnel_pipe_drain (tunnel, TRUE);
+    }
+  else if (tunnel_out_flush (tunnel) == -1)
+    return -1;
+
+  tunnel->out_total_data += n;
+  log_verbose ("tunnel_write: out_total_data = %u", tunnel->out_total_data);
+  return n;
+}
+#endif /* HAVE_SPLICE */
+
+ssize_t
+tunnel_write_held (Tunnel *tunnel)
+{
+  size_t n = tunnel->held_len;
+
+  if (n == 0)
+    return 0;
+
+  tunnel->held_len = 0;
+  tunnel_read_adapt (tunnel, tunnel->read_size, n);
+  return tunnel_write (tunnel, tunnel->held, n);
+}
+
+size_t
+tunnel_held (Tunnel *tunnel)
+{
+  return tunnel->held_len;
+}
+
+/*
+Read at most LENGTH bytes from FD, after what's already held back.
+Once LENGTH bytes are held, send them in one request; until then,
+they wait for the caller to call tunnel_write_held().  Return as
+read().
+*/
+
+static ssize_t
+tunnel_hold_from (Tunnel *tunnel, int fd, size_t length)
+{
+  ssize_t n;
+
+  if (tunnel->held == NULL)
+    {
+      tunnel->held = malloc (TUNNEL_DATA_MAX);
+      if (tunnel->held == NULL)
+	return -1;
+    }
+
+  /* LENGTH may be less than the caller asked for before. */
+  if (tunnel->held_len >= length && tunnel_write_held (tunnel) == -1)
+    return -1;
+
+  n = read (fd, tunnel->held + tunnel->held_len,
+	    length - tunnel->held_len);
+  if (n <= 0)
+    return n;
+
+  tunnel->held_len += n;
+  if (tunnel->held_len == length && tunnel_write_held (tunnel) == -1)
+    return -1;
+  return n;
+}
+
+ssize_t
+tunnel_write_from (Tunnel *tunnel, int fd, size_t length)
+{
+  static char buf[TUNNEL_DATA_MAX];
+  ssize_t n;
+
+  length = min (length, tunnel->read_size);
+
+  /* Data that may be held back is read into memory. */
+  if (tunnel->coalesce_window > 0)
+    return tunnel_hold_from (tunnel, fd, length);
+
+#ifdef HAVE_SPLICE
+  n = tunnel_splice_from (tunnel, fd, length);
+  if (n != -1 || errno != ENOSYS)
+    return n;
+#endif
+
+  n = read (fd, buf, length);
+  if (n <= 0)
+    return n;
+  tunnel_read_adapt (tunnel, length, n);
+
+  return tunnel_write (tunnel, buf, (size_t)n);
+}
+
+/*
+Queue LENGTH bytes of padding in as few requests as possible.  They
+all point into one static buffer of zeros, so however much padding
+is needed to fill a connection, it's written with the rest of the
+output batch in a single writev().  Return the number of bytes queued.
+*/
+
+static ssize_t
+tunnel_queue_padding (Tunnel *tunnel, size_t length)
+{
+  static char padding[65535];
+  size_t remaining, n;
+
+  for (remaining = length; remaining > 0; remaining -= n)
+    {
+      /* One or two bytes don't fit a TUNNEL_PADDING header. */
+      if (remaining < sizeof_header)
+	{
+	  n = 1;
+	  if (tunnel_write_request (tunnel, TUNNEL_PAD1, NULL, 0) == -1)
+	    break;
+	  continue;
+	}
+
+      /* Don't leave less than a header's worth for the last request. */
+      n = min (remaining, sizeof_header + sizeof padding);
+      if (remaining - n > 0 && remaining - n < sizeof_header)
+	n -= sizeof_header;
+
+      if (tunnel_write_request (tunnel, TUNNEL_PADDING,
+				padding, n - sizeof_header) == -1)
+	break;
+    }
+
+  return length - remaining;
+}
+
+ssize_t
+tunnel_padding (Tunnel *tunnel, size_t length)
+{
+  ssize_t n;
+
+  n = tunnel_queue_padding (tunnel, length);
+  if (tunnel_out_flush (tunnel) == -1)
+    return -1;
+  return n;
+}
+
+int
+tunnel_close (Tunnel *tunnel)
+{
+  struct pollfd p;
+  char buf[10240];
+  ssize_t n;
+
+  /* A server can only send TUNNEL_CLOSE if the client has a GET
+     connection open. */
+  if (tunnel_is_client (tunnel) || tunnel_out_promote (tunnel) == 0)
+    {
+      /* Data held back to be coalesced is sent first. */
+      tunnel_write_held (tunnel);
+
+      if (tunnel->strict_content_length && !tunnel->chunked)
+	{
+	  log_debug ("tunnel_close: write padding (%d bytes)",
+		     tunnel->content_length - tunnel->bytes - 1);
+	  tunnel_queue_padding (tunnel,
+				tunnel->content_length - tunnel->bytes - 1);
+	}
+
+      log_debug ("tunnel_close: write TUNNEL_CLOSE request");
+      tunnel_write_request (tunnel, TUNNEL_CLOSE, NULL, 0);
+
+      /* What's queued is still written by tunnel_flush(), but the
+	 connection isn't used again. */
+      tunnel_out_disconnect (tunnel);
+      tunnel->out_queue_keep = FALSE;
+    }
+
+  tunnel_standby_destroy (&tunnel->next_in);
+  tunnel_standby_destroy (&tunnel->next_out);
+  tunnel_standby_close (tunnel);
+  tunnel_in_standby_close (tunnel);
+  tunnel_in_connect_close (tunnel);
+  tunnel_standby_destroy (&tunnel->released);
+  if (tunnel->out_idle_fd != -1)
+    {
+      close (tunnel->out_idle_fd);
+      tunnel->out_idle_fd = -1;
+    }
+  if (tunnel->in_reuse_fd != -1)
+    {
+      close (tunnel->in_reuse_fd);
+      tunnel->in_reuse_fd = -1;
+    }
+  tunnel->out_pending_len = 0;
+
+  /* Neither waits here; a client may serve many tunnels too. */
+  log_debug ("tunnel_close: reading trailing data from input ...");
+  p.fd = tunnel->in_fd;
+  p.events = POLLIN;
+  while (tunnel_is_client (tunnel) && p.fd != -1 && poll (&p, 1, 0) > 0)
+    {
+      if (p.revents & POLLIN)
+	{
+	  n = read (tunnel->in_fd, buf, sizeof buf);
+	  if (n > 0)
+	    {
+	      log_annoying ("read (%d, %p, %d) = %d",
+			    tunnel->in_fd, buf, sizeof buf, n);
+	      continue;
+	    }
+	  else if (n == -1 && errno == EAGAIN)
+	    continue;
+	  else if (n == -1)
+	    log_debug ("tunnel_close: ... error: %s", strerror (errno));
+	  else
+	    log_debug ("tunnel_close: ... done (tunnel closed)");
+	}
+      if (p.revents & POLLHUP)
+	log_debug ("POLLHUP");
+      if (p.revents & POLLERR)
+	log_debug ("POLLERR");
+      if (p.revents & POLLNVAL)
+	log_debug ("POLLNVAL");
+      break;
+    }
+
+  tunnel_in_disconnect (tunnel);
+
+  tunnel->buf_len = 0;
+  tunnel->in_buf_start = 0;
+  tunnel->in_buf_len = 0;
+  tunnel->in_total_raw = 0;
+  tunnel->in_total_data = 0;
+  tunnel->out_total_raw = 0;
+  tunnel->out_total_data = 0;
+
+  return 0;
+}
+
+/*
+Read as much as is available from the tunnel input into the receive
+buffer.  Any partially received request is first moved to the start
+of the buffer to make room.  Return the number of bytes read, 0 if the
+peer closed the connection, or -1 on error.
+*/
+
+static ssize_t
+tunnel_fill_in_buf (Tunnel *tunnel)
+{
+  ssize_t n;
+
+  if (tunnel->in_buf_start > 0)
+    {
+      memmove (tunnel->in_buf,
+	       tunnel->in_buf + tunnel->in_buf_start,
+	       tunnel->in_buf_len);
+      tunnel->in_buf_start = 0;
+    }
+
+  log_annoying ("read (%d, %p, %d) ...",
+		tunnel->in_fd, tunnel->in_buf + tunnel->in_buf_len,
+		sizeof tunnel->in_buf - tunnel->in_buf_len);
+  n = read (tunnel->in_fd,
+	    tunnel->in_buf + tunnel->in_buf_len,
+	    sizeof tunnel->in_buf - tunnel->in_buf_len);
+  log_annoying ("... = %d", n);
+  if (n > 0)
+    {
+      if (tunnel->in_chunked)
+	tunnel->in_buf_len += tunnel_dechunk (tunnel, (tunnel->in_buf +
+						       tunnel->in_buf_len), n);
+      else
+	tunnel->in_buf_len += n;
       tunnel->in_total_raw += n;
-      log_annoying ("tunnel_read_request: in_total_raw = %u",
+      log_annoying ("tunnel_fill_in_buf: in_total_raw = %u",
 		    tunnel->in_total_raw);
+      tunnel_in_standby_update (tunnel, n);
+    }
+
+  return n;
+}
+
+/*
+Decode the header of the request at P, of which LEN bytes have been
+received, and set *LENGTH to the length of its data.  Return the size
+of the header, or 0 if it hasn't been received yet.
+*/
+
+static size_t
+tunnel_header_length (const unsigned char *p, size_t len, size_t *length)
+{
+  if (p[0] == TUNNEL_DATA32 || p[0] == TUNNEL_ZDATA)
+    {
+      if (len < sizeof_header32)
+	return 0;
+      *length = (((size_t)p[1] << 24) | (p[2] << 16) |
+		 (p[3] << 8) | p[4]);
+      return sizeof_header32;
+    }
+
+  if (len < sizeof_header)
+    return 0;
+  *length = (p[1] << 8) | p[2];
+  return sizeof_header;
+}
+
+/*
+Decode the request at the head of the receive buffer without
+consuming it.  Return 1 if a complete request is buffered, 0 if not,
+or -1 with errno EINVAL if its length is out of bounds.
+*/
+
+static int
+tunnel_peek_request (Tunnel *tunnel, Request *request,
+		     char **data, size_t *length)
+{
+  unsigned char *p;
+  size_t header;
+
+  if (tunnel->in_buf_len < sizeof (Request))
+    return 0;
+
+  p = (unsigned char *)tunnel->in_buf + tunnel->in_buf_start;
+  *request = p[0];
+  *data = NULL;
+  *length = 0;
+
+  if (*request & TUNNEL_SIMPLE)
+    return 1;
+
+  header = tunnel_header_length (p, tunnel->in_buf_len, length);
+  if (header == 0)
+    return 0;
+
+  /* A longer request could never fit in the receive buffer. */
+  if (*length > TUNNEL_DATA_MAX)
+    {
+      log_error ("tunnel_peek_request: %s of %lu bytes is too long",
+		 REQ_TO_STRING (*request), (unsigned long)*length);
+      errno = EINVAL;
+      return -1;
     }
 
-  if (req == TUNNEL_DATA)
+  if (tunnel->in_buf_len < header + *length)
+    return 0;
+
+  *data = (char *)p + header;
+  return 1;
+}
+
+static inline void
+tunnel_consume_request (Tunnel *tunnel, Request request, size_t length)
+{
+  size_t n = sizeof request;
+
+  if (request == TUNNEL_DATA32 || request == TUNNEL_ZDATA)
+    n = sizeof_header32 + length;
+  else if (!(request & TUNNEL_SIMPLE))
+    n = sizeof_header + length;
+
+  tunnel->in_buf_start += n;
+  tunnel->in_buf_len -= n;
+  if (tunnel->in_buf_len == 0)
+    tunnel->in_buf_start = 0;
+
+  if (request == TUNNEL_DATA || request == TUNNEL_DATA32 ||
+      request == TUNNEL_ZDATA)
     log_verbose ("tunnel_read_request:  %s (%d)",
-		 REQ_TO_STRING (req), len);
+		 REQ_TO_STRING (request), length);
+  else if (request & TUNNEL_SIMPLE)
+    log_debug ("tunnel_read_request:  %s", REQ_TO_STRING (request));
   else
     log_debug ("tunnel_read_request:  %s (%d)",
-	       REQ_TO_STRING (req), len);
+	       REQ_TO_STRING (request), length);
+}
 
-  return 1;
+/*
+Find the next complete request in the receive buffer.  If none is
+buffered and READ_OK is true, read once from the tunnel first.  The
+request is not consumed.  Return 1 if a request was found, or -1 with
+errno set.  EAGAIN means that no complete request is available yet,
+and EINVAL that the peer sent a malformed one.
+*/
+
+static int
+tunnel_read_request (Tunnel *tunnel, Request *request,
+		     char **data, size_t *length, int read_ok)
+{
+  ssize_t n;
+
+  n = tunnel_peek_request (tunnel, request, data, length);
+  if (n != 0)
+    return n;
+
+  if (!read_ok)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+
+  n = tunnel_fill_in_buf (tunnel);
+  if (n == -1)
+    {
+      if (errno != EAGAIN)
+	log_error ("tunnel_read_request: error reading request: %s",
+		   strerror (errno));
+      return n;
+    }
+  else if (n == 0)
+    {
+      if (tunnel->in_buf_len > 0)
+	log_error ("tunnel_read_request: connection closed by peer "
+		   "with %d bytes of partial request", tunnel->in_buf_len);
+      else
+	log_debug ("tunnel_read_request: connection closed by peer");
+      tunnel_in_disconnect (tunnel);
+
+      if (tunnel_is_client (tunnel))
+	{
+	  if (tunnel_in_connect (tunnel) == -1)
+	    return -1;
+	}
+      else
+	tunnel_in_promote (tunnel);
+
+      errno = EAGAIN;
+      return -1;
+    }
+
+  n = tunnel_peek_request (tunnel, request, data, length);
+  if (n != 0)
+    return n;
+
+  errno = EAGAIN;
+  return -1;
+}
+
+#ifdef HAVE_LIBZ
+/*
+Decompress the data of a TUNNEL_ZDATA request, and set *DATA and
+*LENGTH to the result.  See tunnel_deflate().
+*/
+
+static int
+tunnel_inflate (Tunnel *tunnel, char **data, size_t *length)
+{
+  static unsigned char sync_tail[] = { 0x00, 0x00, 0xff, 0xff };
+  z_stream *z = tunnel->in_z;
+  int err;
+
+  if (z == NULL)
+    {
+      z = calloc (1, sizeof *z);
+      tunnel->in_zbuf = malloc (TUNNEL_DATA_MAX);
+      if (z == NULL || tunnel->in_zbuf == NULL ||
+	  inflateInit2 (z, -15) != Z_OK)
+	{
+	  log_error ("tunnel_inflate: out of memory");
+	  free (z);
+	  free (tunnel->in_zbuf);
+	  tunnel->in_zbuf = NULL;
+	  errno = ENOMEM;
+	  return -1;
+	}
+      tunnel->in_z = z;
+      tunnel->in_z_fresh = FALSE;
+    }
+  else if (tunnel->in_z_fresh)
+    {
+      inflateReset (z);
+      tunnel->in_z_fresh = FALSE;
+    }
+
+  z->next_out = (unsigned char *)tunnel->in_zbuf;
+  z->avail_out = TUNNEL_DATA_MAX;
+  z->next_in = (unsigned char *)*data;
+  z->avail_in = *length;
+  err = inflate (z, Z_SYNC_FLUSH);
+  if (err == Z_OK || err == Z_BUF_ERROR)
+    {
+      z->next_in = sync_tail;
+      z->avail_in = sizeof sync_tail;
+      err = inflate (z, Z_SYNC_FLUSH);
+    }
+  if ((err != Z_OK && err != Z_BUF_ERROR) || z->avail_in > 0)
+    {
+      log_error ("tunnel_inflate: protocol error: bad compressed data");
+      errno = EINVAL;
+      return -1;
+    }
+
+  log_annoying ("tunnel_inflate: %d bytes decompressed to %d",
+		*length, TUNNEL_DATA_MAX - z->avail_out);
+  *data = tunnel->in_zbuf;
+  *length = TUNNEL_DATA_MAX - z->avail_out;
+  return 0;
 }
+#endif /* HAVE_LIBZ */
+
+/*
+Copy tunnel data to DATA, decoding as many requests from the receive
+buffer as fit.  At most one read() is made from the tunnel, and only
+when no complete request is buffered, so this never blocks after poll()
+has reported the tunnel readable.
+*/
 
 ssize_t
 tunnel_read (Tunnel *tunnel, void *data, size_t length)
 {
-  enum tunnel_request req;
+  char *rdata = data;
+  int read_ok;
+  Request req;
   size_t len;
+  char *buf;
+  size_t n;
+
+  n = 0;
+  if (tunnel->buf_len > 0)
+    {
+      n = min (tunnel->buf_len, length);
+      memcpy (rdata, tunnel->buf_ptr, n);
+      tunnel->buf_ptr += n;
+      tunnel->buf_len -= n;
+      if (tunnel->buf_len > 0 || n == length)
+	return n;
+    }
+
+  if (tunnel->in_ending)
+    {
+      if (n > 0)
+	return n;
+
+      tunnel_in_ending (tunnel);
+      if (tunnel->in_ending)
+	{
+	  errno = EAGAIN;
+	  return -1;
+	}
+    }
+
+  if (tunnel->in_fd == -1)
+    {
+      if (n > 0)
+	return n;
+
+      if (tunnel_is_client (tunnel))
+	{
+	  if (tunnel_in_connect (tunnel) == -1)
+	    return -1;
+	}
+      else
+	tunnel_in_promote (tunnel);
+
+      errno = EAGAIN;
+      return -1;
+    }
+
+  for (read_ok = (n == 0); n < length; read_ok = FALSE)
+    {
+      if (tunnel_read_request (tunnel, &req, &buf, &len, read_ok) == -1)
+	{
+	  if (n > 0)
+	    return n;
+	  log_annoying ("tunnel_read_request returned -1, returning -1");
+	  return -1;
+	}
+
+      /* Leave requests that end the data stream for the next call. */
+      if (n > 0 && req != TUNNEL_DATA && req != TUNNEL_DATA32 &&
+	  req != TUNNEL_ZDATA && req != TUNNEL_PADDING && req != TUNNEL_PAD1)
+	return n;
+
+      tunnel_consume_request (tunnel, req, len);
+
+#ifdef HAVE_LIBZ
+      /* Plain data ends the compressed stream. */
+      if (req == TUNNEL_ZDATA)
+	{
+	  if (tunnel_inflate (tunnel, &buf, &len) == -1)
+	    return -1;
+	  req = TUNNEL_DATA;
+	}
+      else if (req == TUNNEL_DATA || req == TUNNEL_DATA32)
+	tunnel->in_z_fresh = TRUE;
+#endif
+
+      switch (req)
+	{
+	case TUNNEL_OPEN:
+	  tunnel_open_received (tunnel, (unsigned char *)buf, len);
+	  /* The data that follows the server's answer depends on it,
+	     so let the caller see the answer first. */
+	  if (tunnel_is_client (tunnel))
+	    {
+	      if (n > 0)
+		return n;
+	      errno = EAGAIN;
+	      return -1;
+	    }
+	  break;
+
+	case TUNNEL_DATA:
+	case TUNNEL_DATA32:
+	  tunnel->in_total_data += len;
+	  log_verbose ("tunnel_read: in_total_data = %u",
+		       tunnel->in_total_data);
+	  tunnel->buf_ptr = buf;
+	  tunnel->buf_len = len;
+	  len = min (tunnel->buf_len, length - n);
+	  memcpy (rdata + n, tunnel->buf_ptr, len);
+	  tunnel->buf_ptr += len;
+	  tunnel->buf_len -= len;
+	  n += len;
+	  break;
+
+	case TUNNEL_PADDING:
+	  /* discard data */
+	  break;
+
+	case TUNNEL_PAD1:
+	  /* do nothing */
+	  break;
+
+	case TUNNEL_ERROR:
+	  log_error ("tunnel_read: received error: %.*s", (int)len, buf);
+	  errno = EIO;
+	  return -1;
+
+	case TUNNEL_CLOSE:
+	  return 0;
+
+	case TUNNEL_DISCONNECT:
+	  tunnel_in_end (tunnel);
+
+	  if (tunnel->in_ending)
+	    ;
+	  else if (tunnel_is_client (tunnel))
+	    {
+	      if (tunnel_in_connect (tunnel) == -1)
+		return -1;
+	    }
+	  else
+	    tunnel_in_promote (tunnel);
+
+	  errno = EAGAIN;
+	  return -1;
+
+	default:
+	  log_error ("tunnel_read: protocol error: unknown request 0x%02x",
+		     req);
+	  errno = EINVAL;
+	  return -1;
+	}
+    }
+
+  return n;
+}
+
+#ifdef HAVE_SPLICE
+/*
+If only the start of the next TUNNEL_DATA or TUNNEL_DATA32 request
+has been received,
+write that to FD, and splice the rest from the tunnel connection to
+FD as it arrives.  Return the number of bytes written, or -1 with
+errno ENOSYS if the request should be read into memory instead.
+*/
+
+static ssize_t
+tunnel_splice_to (Tunnel *tunnel, int fd)
+{
+  unsigned char *p = (unsigned char *)tunnel->in_buf + tunnel->in_buf_start;
+  size_t header, length, m;
   ssize_t n;
 
-  if (tunnel->buf_len > 0)
+  m = 0;
+  if (tunnel->in_splice_left == 0)
     {
-      n = min (tunnel->buf_len, length);
-      memcpy (data, tunnel->buf_ptr, n);
-      tunnel->buf_ptr += n;
-      tunnel->buf_len -= n;
-      return n;
+      if (tunnel->no_splice || tunnel->in_chunked || tunnel->in_fd == -1 ||
+	  tunnel->buf_len > 0 || tunnel->in_buf_len == 0 ||
+	  (p[0] != TUNNEL_DATA && p[0] != TUNNEL_DATA32) ||
+	  (header = tunnel_header_length (p, tunnel->in_buf_len,
+					  &length)) == 0 ||
+	  length > TUNNEL_DATA_MAX ||
+	  header + length < tunnel->in_buf_len + SPLICE_MIN ||
+	  tunnel_pipe (tunnel) == -1)
+	{
+	  errno = ENOSYS;
+	  return -1;
+	}
+
+      log_verbose ("tunnel_splice_to:  %s (%d)",
+		   REQ_TO_STRING (p[0]), length);
+      tunnel->in_total_data += length;
+#ifdef HAVE_LIBZ
+      tunnel->in_z_fresh = TRUE;
+#endif
+
+      m = tunnel->in_buf_len - header;
+      tunnel->in_splice_left = length - m;
+      tunnel->in_buf_start = 0;
+      tunnel->in_buf_len = 0;
+      if (m > 0 && tunnel_to_write (tunnel, fd, (char *)p + header, m) == -1)
+	return -1;
     }
 
-  if (tunnel->in_fd == -1)
+  n = splice (tunnel->in_fd, NULL, tunnel->pipe_fd[1], NULL,
+	      tunnel->in_splice_left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n == 0)
     {
+      log_error ("tunnel_splice_to: connection closed by peer "
+		 "with %d bytes of data left", tunnel->in_splice_left);
+      tunnel_in_disconnect (tunnel);
+
       if (tunnel_is_client (tunnel))
 	{
 	  if (tunnel_in_connect (tunnel) == -1)
 	    return -1;
 	}
       else
-	{
-#if 1
-	  if (tunnel_accept (tunnel) == -1)
-	    return -1;
-#else
-	  errno = EAGAIN;
-	  return -1;
-#endif
-	}
+	tunnel_in_promote (tunnel);
 
       errno = EAGAIN;
+      n = -1;
+    }
+  if (n == -1)
+    return m > 0 ? m : -1;
+
+  tunnel->pipe_len = n;
+  tunnel->in_total_raw += n;
+  tunnel->in_splice_left -= n;
+  tunnel_in_standby_update (tunnel, n);
+
+  if (tunnel_pipe_to (tunnel, fd, n) == -1)
+    {
+      tunnel_pipe_drain (tunnel, FALSE);
       return -1;
     }
 
-  if (tunnel->out_fd == -1 && tunnel_is_server (tunnel))
+  return m + n;
+}
+#endif /* HAVE_SPLICE */
+
+ssize_t
+tunnel_read_to (Tunnel *tunnel, int fd, size_t length)
+{
+  static char buf[TUNNEL_DATA_MAX];
+  ssize_t n;
+
+  /* Stop reading the tunnel while FD is slow to take its data. */
+  if (tunnel_flush_to (tunnel, fd) > TUNNEL_QUEUE_MAX)
     {
-      tunnel_accept (tunnel);
       errno = EAGAIN;
       return -1;
     }
 
-  if (tunnel_read_request (tunnel, &req, tunnel->buf, &len) <= 0)
+#ifdef HAVE_SPLICE
+  n = tunnel_splice_to (tunnel, fd);
+  if (n != -1 || errno != ENOSYS)
+    return n;
+#endif
+
+  n = tunnel_read (tunnel, buf, min (length, sizeof buf));
+  if (n <= 0)
+    return n;
+
+#ifdef DEBUG_MODE
+  log_annoying ("read %d bytes from tunnel:", n);
+  if (debug_level >= 5)
+    dump_buf (debug_file, (unsigned char *)buf, (size_t)n);
+#endif
+
+  return tunnel_to_write (tunnel, fd, buf, (size_t)n);
+}
+
+int
+tunnel_pending (Tunnel *tunnel)
+{
+  Request req;
+  size_t len;
+  char *buf;
+
+  if (tunnel->to_queue_len > TUNNEL_QUEUE_MAX)
+    return FALSE;
+
+  return (tunnel->buf_len > 0 ||
+	  (tunnel->in_fd != -1 && !tunnel->in_ending &&
+	   tunnel_peek_request (tunnel, &req, &buf, &len) != 0));
+}
+
+int
+tunnel_pollin_fd (Tunnel *tunnel)
+{
+  if (tunnel->in_fd != -1)
+    return tunnel->in_fd;
+  else if (tunnel->in_connect_fd != -1)
+    return tunnel->in_connect_fd;
+  else if (tunnel_is_server (tunnel))
+    {
+      log_verbose ("tunnel_pollin_fd: waiting for client; returning -1");
+      return -1;
+    }
+  else
     {
-log_annoying ("tunnel_read_request returned <= 0, returning -1");
+      log_error ("tunnel_pollin_fd: returning -1");
       return -1;
     }
+}
 
-  switch (req)
+int
+tunnel_pollin_events (Tunnel *tunnel)
+{
+  if (tunnel->in_fd == -1 && tunnel->in_connect_fd != -1 &&
+      !tunnel->in_connect_sent)
+    return POLLOUT;
+  else
+    return POLLIN;
+}
+
+unsigned int
+tunnel_pollin_generation (Tunnel *tunnel)
+{
+  return tunnel->in_generation;
+}
+
+int
+tunnel_pollout_fd (Tunnel *tunnel)
+{
+  if (tunnel->out_connect_fd != -1)
+    return tunnel->out_connect_fd;
+  return tunnel->out_queue_len > 0 ? tunnel->out_queue_fd : -1;
+}
+
+unsigned int
+tunnel_pollout_generation (Tunnel *tunnel)
+{
+  return tunnel->out_generation;
+}
+
+Tunnel_connection *
+tunnel_released (Tunnel *tunnel)
+{
+  Tunnel_connection *conn = tunnel->released;
+
+  if (conn != NULL)
     {
-    case TUNNEL_OPEN:
-      /* do something with tunnel->buf */
-      break;
+      tunnel->released = conn->next;
+      conn->next = NULL;
+    }
 
-    case TUNNEL_DATA:
-      tunnel->buf_ptr = tunnel->buf;
-      tunnel->buf_len = len;
-      tunnel->in_total_data += len;
-      log_verbose ("tunnel_read: in_total_data = %u", tunnel->in_total_data);
-      return tunnel_read (tunnel, data, length);
+  return conn;
+}
 
-    case TUNNEL_PADDING:
-      /* discard data */
-      break;
+int
+tunnel_can_write (Tunnel *tunnel)
+{
+  if (tunnel->out_queue_len + tunnel->out_pending_len > TUNNEL_QUEUE_MAX)
+    return FALSE;
 
-    case TUNNEL_PAD1:
-      /* do nothing */
-      break;
+  if (tunnel_is_client (tunnel))
+    return !(tunnel_is_disconnected (tunnel) && tunnel->out_queue_len > 0);
 
-    case TUNNEL_ERROR:
-      tunnel->buf[len] = 0;
-      log_error ("tunnel_read: received error: %s", tunnel->buf);
-      errno = EIO;
+  return tunnel_is_connected (tunnel) || tunnel->next_out != NULL;
+}
+
+int
+tunnel_is_attached (Tunnel *tunnel)
+{
+  if (tunnel_is_client (tunnel))
+    return tunnel->in_answered;
+
+  return ((tunnel->in_fd != -1 || tunnel->next_in != NULL) &&
+	  tunnel_can_write (tunnel));
+}
+
+/*
+If the write connection is up and needs padding to the block length
+specified in the second argument, send some padding.
+*/
+
+int
+tunnel_maybe_pad (Tunnel *tunnel, size_t length)
+{
+  size_t padding;
+
+  if (tunnel_is_disconnected (tunnel) ||
+      tunnel->bytes % length == 0 ||
+      tunnel->padding_only)
+    return 0;
+
+  padding = length - tunnel->bytes % length;
+  if (padding > tunnel_out_length (tunnel) - tunnel->bytes)
+    padding = tunnel_out_length (tunnel) - tunnel->bytes;
+
+  return tunnel_padding (tunnel, padding);
+}
+
+#if 0
+ssize_t
+old_parse_header (int s, int *type)
+{
+  static const char *end_of_header = "\r\n\r\n";
+  ssize_t n, len = 0;
+  char c;
+  int i;
+
+  *type = -1;
+
+  n = read_all (s, &c, 1);
+  if (n != 1)
+    return -1;
+  len += n;
+
+  if (c == 'P')
+    *type = TUNNEL_IN;
+  else if (c == 'G')
+    *type = TUNNEL_OUT;
+  else
+    {
+      log_error ("parse_header: unknown HTTP request starting with '%c'", c);
+      errno = EINVAL;
       return -1;
+    }
 
-    case TUNNEL_CLOSE:
-      return 0;
+  i = 0;
+  while (i < 4)
+    {
+      n = read_all (s, &c, 1);
+      if (n != 1 && errno != EAGAIN)
+	return n;
+      len += n;
 
-    case TUNNEL_DISCONNECT:
-      tunnel_in_disconnect (tunnel);
+      if (c == end_of_header[i])
+	i++;
+      else
+	i = 0;
+    }
+
+  return len;
+}
+#endif
+
+/*
+Make a random session token, which is sent in the URI of every
+request so that the server can tell which tunnel it belongs to.
+*/
+
+static void
+tunnel_new_token (char *token)
+{
+  static unsigned long counter = 0;
+  unsigned char r[TOKEN_LENGTH / 2];
+  unsigned long x;
+  size_t i;
+  int fd;
+
+  fd = open ("/dev/urandom", O_RDONLY);
+  if (fd == -1 || read (fd, r, sizeof r) != sizeof r)
+    {
+      /* Good enough to tell apart the tunnels of one server. */
+      x = (unsigned long)time (NULL) ^ ((unsigned long)getpid () << 16);
+      x += ++counter * 2654435761UL;
+      for (i = 0; i < sizeof r; i++)
+	{
+	  r[i] = x & 0xff;
+	  x = x * 69069 + (i ^ counter);
+	}
+    }
+  if (fd != -1)
+    close (fd);
+
+  for (i = 0; i < sizeof r; i++)
+    sprintf (token + 2 * i, "%02x", r[i]);
+}
+
+/*
+Find the session token in the URI of CONN's request.  It's the hex
+digits right before the last colon.  Return FALSE if there is none,
+as with clients that don't send one.  A POST's sequence number
+follows the time after the colon.
+*/
+
+static int
+tunnel_connection_token (Tunnel_connection *conn)
+{
+  const char *uri = conn->request.uri;
+  const char *p, *q;
+  int i;
+
+  conn->sequence = 0;
+  p = strrchr (uri, ':');
+  if (p == NULL || p - uri < TOKEN_LENGTH)
+    return FALSE;
+
+  q = strchr (p, '.');
+  if (q != NULL)
+    conn->sequence = strtoul (q + 1, NULL, 10);
+
+  p -= TOKEN_LENGTH;
+  for (i = 0; i < TOKEN_LENGTH; i++)
+    if (!isxdigit ((unsigned char)p[i]))
+      return FALSE;
+
+  memcpy (conn->key, p, TOKEN_LENGTH);
+  conn->key[TOKEN_LENGTH] = 0;
+  return TRUE;
+}
+
+static int
+tunnel_listen_addr (const char *host, struct in_addr *addr)
+{
+  struct hostent *hp;
 
-      if (tunnel_is_client (tunnel)
-	  && tunnel_in_connect (tunnel) == -1)
+  if (host == NULL)
+    addr->s_addr = INADDR_ANY;
+  else if ((addr->s_addr = inet_addr (host)) == INADDR_NONE)
+    {
+      hp = gethostbyname (host);
+      if (hp == NULL || hp->h_addrtype != AF_INET)
 	return -1;
+      memcpy (addr, hp->h_addr, hp->h_length);
+    }
 
-      errno = EAGAIN;
+  return 0;
+}
+
+int
+tunnel_listen (const char *host, int port)
+{
+  struct in_addr addr;
+  int fd;
+
+  if (tunnel_listen_addr (host, &addr) == -1)
+    return -1;
+
+  fd = server_socket (addr, port, LISTEN_BACKLOG);
+  if (fd == -1)
+    log_error ("tunnel_listen: server_socket (%d) = -1", port);
+
+  return fd;
+}
+
+int
+tunnel_listen_workers (const char *host, int port, int *fds, int n)
+{
+  struct in_addr addr;
+  int i;
+
+  if (tunnel_listen_addr (host, &addr) == -1)
+    return -1;
+
+  for (i = 0; i < n; i++)
+    {
+      fds[i] = server_socket_shared (addr, port, LISTEN_BACKLOG);
+      if (fds[i] == -1)
+	{
+	  log_error ("tunnel_listen_workers: server_socket_shared (%d) = -1",
+		     port);
+	  break;
+	}
+    }
+
+  if (i < n)
+    {
+      while (i > 0)
+	close (fds[--i]);
       return -1;
+    }
 
-    default:
-      log_error ("tunnel_read: protocol error: unknown request 0x%02x", req);
-      errno = EINVAL;
+  return 0;
+}
+
+static Tunnel_connection *
+tunnel_connection_new (int fd)
+{
+  Tunnel_connection *conn;
+
+  conn = malloc (sizeof (Tunnel_connection));
+  if (conn == NULL)
+    {
+      log_error ("tunnel_connection_new: out of memory");
+      return NULL;
+    }
+
+  conn->fd = fd;
+  conn->key[0] = 0;
+  conn->sequence = 0;
+  conn->buf.length = 0;
+  conn->buf.header_length = 0;
+  conn->request.method = -1;
+  conn->persistent = FALSE;
+  conn->chunked = FALSE;
+  conn->next = NULL;
+
+  return conn;
+}
+
+Tunnel_connection *
+tunnel_connection_accept (int fd)
+{
+  Tunnel_connection *conn;
+  struct sockaddr_in address;
+  socklen_t len;
+
+  len = sizeof address;
+  fd = accept (fd, (struct sockaddr *)&address, &len);
+  if (fd == -1)
+    {
+      log_error ("tunnel_connection_accept: accept error: %s",
+		 strerror (errno));
+      return NULL;
+    }
+
+  conn = tunnel_connection_new (fd);
+  if (conn == NULL)
+    {
+      close (fd);
+      return NULL;
+    }
+  conn->address = address;
+
+  log_notice ("connection from %s:%u", tunnel_connection_key (conn),
+	      ntohs (address.sin_port));
+
+  return conn;
+}
+
+int
+tunnel_connection_send (Tunnel_connection *conn, int sock)
+{
+  char data[HTTP_BUFFER_SIZE];
+  char control[CMSG_SPACE (sizeof (int))];
+  size_t body = conn->buf.length - conn->buf.header_length;
+  struct cmsghdr *cmsg;
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t n;
+
+  /* Parsing the header broke it up, so it's put together again. */
+  if (conn->buf.header_length == 0)
+    n = 0;
+  else if ((n = http_format_request (&conn->request, data,
+				     sizeof data)) == -1 ||
+	   n + body > sizeof data)
+    {
+      log_error ("tunnel_connection_send: request too long");
+      errno = EIO;
+      return -1;
+    }
+  memcpy (data + n, conn->buf.data + conn->buf.header_length, body);
+
+  iov[0].iov_base = &conn->address;
+  iov[0].iov_len = sizeof conn->address;
+  iov[1].iov_base = data;
+  iov[1].iov_len = n + body;
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &conn->fd, sizeof (int));
+
+  if (sendmsg (sock, &msg, MSG_DONTWAIT) == -1)
+    {
+      log_error ("tunnel_connection_send: sendmsg error: %s",
+		 strerror (errno));
       return -1;
     }
 
-  errno = EAGAIN;
-  return -1;
+  log_debug ("tunnel_connection_send: connection %d sent", conn->fd);
+  return 0;
 }
 
-int
-tunnel_pollin_fd (Tunnel *tunnel)
+Tunnel_connection *
+tunnel_connection_receive (int sock)
 {
-  if (tunnel_is_server (tunnel) &&
-      (tunnel->in_fd == -1 || tunnel->out_fd == -1))
+  char control[CMSG_SPACE (sizeof (int))];
+  Tunnel_connection *conn;
+  struct sockaddr_in address;
+  struct cmsghdr *cmsg;
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t n;
+  int fd;
+
+  conn = tunnel_connection_new (-1);
+  if (conn == NULL)
+    return NULL;
+
+  iov[0].iov_base = &address;
+  iov[0].iov_len = sizeof address;
+  iov[1].iov_base = conn->buf.data;
+  iov[1].iov_len = sizeof conn->buf.data;
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+
+  n = recvmsg (sock, &msg, MSG_DONTWAIT);
+  if (n == -1)
     {
-      if (tunnel->in_fd == -1)
-	log_verbose ("tunnel_pollin_fd: in_fd = -1; returning server_socket = %d",
-		     tunnel->server_socket);
-      else
-	log_verbose ("tunnel_pollin_fd: out_fd = -1; returning server_socket = %d",
-		     tunnel->server_socket);
-      return tunnel->server_socket;
+      if (errno != EAGAIN)
+	log_error ("tunnel_connection_receive: recvmsg error: %s",
+		   strerror (errno));
+      free (conn);
+      return NULL;
     }
-  else if (tunnel->in_fd != -1)
-    return tunnel->in_fd;
-  else
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN (sizeof (int)))
     {
-      log_error ("tunnel_pollin_fd: returning -1");
-      return -1;
+      log_error ("tunnel_connection_receive: no connection received");
+      free (conn);
+      errno = EIO;
+      return NULL;
+    }
+  memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+
+  conn->fd = fd;
+  if (n < sizeof address || (msg.msg_flags & MSG_TRUNC))
+    {
+      log_error ("tunnel_connection_receive: bad message");
+      tunnel_connection_destroy (conn);
+      errno = EIO;
+      return NULL;
     }
+  conn->address = address;
+  conn->buf.length = n - sizeof address;
+
+  log_debug ("tunnel_connection_receive: connection %d from %s", fd,
+	     tunnel_connection_key (conn));
+  return conn;
 }
 
 /*
-If the write connection is up and needs padding to the block length
-specified in the second argument, send some padding.
+Return the first byte of tunnel data that has been read after the
+request header of CONN, or NULL if there's none yet.  In a chunked
+body, it follows the size line of the first chunk.
 */
 
-int
-tunnel_maybe_pad (Tunnel *tunnel, size_t length)
+static const char *
+tunnel_connection_body (Tunnel_connection *conn)
 {
-  size_t padding;
-
-  if (tunnel_is_disconnected (tunnel) ||
-      tunnel->bytes % length == 0 ||
-      tunnel->padding_only)
-    return 0;
+  const char *p = conn->buf.data + conn->buf.header_length;
+  const char *end = conn->buf.data + conn->buf.length;
 
-  padding = length - tunnel->bytes % length;
-  if (padding > tunnel->content_length - tunnel->bytes)
-    padding = tunnel->content_length - tunnel->bytes;
+  if (conn->chunked)
+    {
+      p = memchr (p, '\n', end - p);
+      if (p == NULL)
+	return NULL;
+      p++;
+    }
 
-  return tunnel_padding (tunnel, padding);
+  return p < end ? p : NULL;
 }
 
-#if 0
-ssize_t
-old_parse_header (int s, int *type)
-{
-  static const char *end_of_header = "\r\n\r\n";
-  ssize_t n, len = 0;
-  char c;
-  int i;
+/*
+Return the flags byte of the TUNNEL_OPEN request that CONN's body
+starts with, 0 if the request has no flags, or -1 if more of the body
+must be read to tell.  A body which doesn't start with TUNNEL_OPEN
+has no flags either.
+*/
 
-  *type = -1;
+static int
+tunnel_connection_open_flags (Tunnel_connection *conn)
+{
+  const char *body = tunnel_connection_body (conn);
+  const char *end = conn->buf.data + conn->buf.length;
+  size_t length;
 
-  n = read_all (s, &c, 1);
-  if (n != 1)
+  if (body == NULL)
+    return -1;
+  if ((Request)*body != TUNNEL_OPEN)
+    return 0;
+  if (end - body < sizeof_header)
     return -1;
-  len += n;
-
-  if (c == 'P')
-    *type = TUNNEL_IN;
-  else if (c == 'G')
-    *type = TUNNEL_OUT;
-  else
-    {
-      log_error ("parse_header: unknown HTTP request starting with '%c'", c);
-      errno = EINVAL;
-      return -1;
-    }
-
-  i = 0;
-  while (i < 4)
-    {
-      n = read_all (s, &c, 1);
-      if (n != 1 && errno != EAGAIN)
-	return n;
-      len += n;
-
-      if (c == end_of_header[i])
-	i++;
-      else
-	i = 0;
-    }
 
-  return len;
+  length = ((unsigned char)body[1] << 8) | (unsigned char)body[2];
+  if (length < 2)
+    return 0;
+  if (end - body < sizeof_header + 2)
+    return -1;
+  return (unsigned char)body[sizeof_header + 1];
 }
-#endif
 
 int
-tunnel_accept (Tunnel *tunnel)
+tunnel_connection_read (Tunnel_connection *conn)
 {
-  if (tunnel->in_fd != -1 && tunnel->out_fd != -1)
-    {
-      log_debug ("tunnel_accept: tunnel already established");
-      return 0;
-    }
+  ssize_t n = 0;
 
-  while (tunnel->in_fd == -1 || tunnel->out_fd == -1)
+  if (conn->buf.header_length == 0)
     {
-      struct sockaddr_in addr;
-      Http_request *request;
-      struct pollfd p;
-      ssize_t m;
-      socklen_t len;
-      int n;
-      int s;
+      /* A persistent connection may have the next header buffered. */
+      n = -1;
+      errno = EAGAIN;
+      if (conn->buf.length > 0)
+	n = http_buffered_header (&conn->buf);
+      if (n == -1 && errno == EAGAIN)
+	n = http_fill_header (conn->fd, &conn->buf);
+      if (n <= 0)
+	return n;
 
-      p.fd = tunnel->server_socket;
-      p.events = POLLIN;
-      n = poll (&p, 1, (tunnel->in_fd != -1 || tunnel->out_fd != -1 ?
-			ACCEPT_TIMEOUT * 1000 : -1));
-      if (n == -1)
+      if (http_parse_request_header (&conn->buf, &conn->request) == -1)
 	{
-	  log_error ("tunnel_accept: poll error: %s", strerror (errno));
+	  log_error ("tunnel_connection_read: error parsing header: %s",
+		     strerror (errno));
 	  return -1;
 	}
-      else if (n == 0)
-	{
-	  log_error ("tunnel_accept: poll timed out");
-	  break;
-	}
 
-      len = sizeof addr;
-      s = accept (tunnel->server_socket, (struct sockaddr *)&addr, &len);
-      if (s == -1)
+      if (conn->request.method != HTTP_POST &&
+	  conn->request.method != HTTP_PUT &&
+	  conn->request.method != HTTP_GET)
 	{
-	  log_error ("tunnel_accept: accept error: %s", strerror (errno));
+	  log_error ("tunnel_connection_read: unknown header type");
+	  errno = EIO;
 	  return -1;
 	}
 
-      log_notice ("connection from %d.%d.%d.%d:%u",
-		  ntohl (addr.sin_addr.s_addr) >> 24,
-		 (ntohl (addr.sin_addr.s_addr) >> 16) & 0xff,
-		 (ntohl (addr.sin_addr.s_addr) >>  8) & 0xff,
-		  ntohl (addr.sin_addr.s_addr)        & 0xff,
-                  ntohs (addr.sin_port));
+      if (tunnel_connection_token (conn))
+	log_verbose ("tunnel_connection_read: session %s", conn->key);
 
-      m = http_parse_request (s, &request);
-      if (m <= 0)
-	return m;
+      conn->persistent = http_persistent (conn->request.major_version,
+					  conn->request.minor_version,
+					  conn->request.header);
+      conn->chunked = http_chunked (conn->request.header);
+    }
 
-      if (request->method == -1)
+  /* The first request in a POST body shows whether it opens a new
+     tunnel, and how.  Only one read() is made per call, since the
+     caller polls before each call. */
+  if (conn->request.method != HTTP_GET &&
+      tunnel_connection_open_flags (conn) == -1 &&
+      conn->buf.length < sizeof conn->buf.data)
+    {
+      if (n > 0)
 	{
-	  log_error ("tunnel_accept: error parsing header: %s",
-		     strerror (errno));
-	  close (s);
+	  errno = EAGAIN;
+	  return -1;
 	}
-      else if (request->method == HTTP_POST ||
-	       request->method == HTTP_PUT)
+
+      n = read (conn->fd, conn->buf.data + conn->buf.length,
+		sizeof conn->buf.data - conn->buf.length);
+      if (n <= 0)
+	return n;
+      conn->buf.length += n;
+
+      if (tunnel_connection_open_flags (conn) == -1 &&
+	  conn->buf.length < sizeof conn->buf.data)
 	{
-	  if (tunnel->in_fd == -1)
-	    {
-	      tunnel->in_fd = s;
+	  errno = EAGAIN;
+	  return -1;
+	}
+    }
 
-#ifdef IO_COUNT_HTTP_HEADER
-	      tunnel->in_total_raw += m; /* from parse_header() */
-	      log_annoying ("tunnel_accept: in_total_raw = %u",
-			    tunnel->in_total_raw);
-#endif
+  return 1;
+}
+
+int
+tunnel_connection_fd (Tunnel_connection *conn)
+{
+  return conn->fd;
+}
 
-	      fcntl (tunnel->in_fd,
-		     F_SETFL,
-		     fcntl (tunnel->in_fd, F_GETFL) | O_NONBLOCK);
+const char *
+tunnel_connection_key (Tunnel_connection *conn)
+{
+  unsigned long a;
 
-	      tunnel_in_setsockopts (tunnel->in_fd);
+  /* Connections without a session token are taken to belong to the
+     tunnel from the same address. */
+  if (conn->key[0] == 0)
+    {
+      a = ntohl (conn->address.sin_addr.s_addr);
+      snprintf (conn->key, sizeof conn->key, "%lu.%lu.%lu.%lu",
+		a >> 24, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff);
+    }
 
-	      log_debug ("tunnel_accept: input connected");
-	    }
-	  else
-	    {
-	      log_error ("rejected tunnel_in: already got a connection");
-	      close (s);
-	    }
-	}
-      else if (request->method == HTTP_GET)
-	{
-	  if (tunnel->out_fd == -1)
-	    {
-	      char str[1024];
+  return conn->key;
+}
 
-	      tunnel->out_fd = s;
+int
+tunnel_connection_opens (Tunnel_connection *conn)
+{
+  const char *body = tunnel_connection_body (conn);
 
-	      tunnel_out_setsockopts (tunnel->out_fd);
+  return ((conn->request.method == HTTP_POST ||
+	   conn->request.method == HTTP_PUT) &&
+	  body != NULL && (Request)*body == TUNNEL_OPEN);
+}
 
-	      snprintf (str, sizeof(str),
-"HTTP/1.1 200 OK\r\n"
-/* "Date: %s\r\n" */
-/* "Server: %s\r\n" */
-/* "Last-Modified: %s\r\n" */
-/* "ETag: %s\r\n" */
-/* "Accept-Ranges: %s\r\n" */
-"Content-Length: %lu\r\n"
-"Connection: close\r\n"
-"Pragma: no-cache\r\n"
-"Cache-Control: no-cache, no-store, must-revalidate\r\n"
-"Expires: 0\r\n" /* FIXME: "0" is not a legitimate HTTP date. */
-"Content-Type: text/html\r\n"
-"\r\n",
-		       /* +1 to allow for TUNNEL_DISCONNECT */
-		       tunnel->content_length + 1);
-	      if (write_all (tunnel->out_fd, str, strlen (str)) <= 0)
-		{
-		  log_error ("tunnel_accept: couldn't write GET header: %s",
-			     strerror (errno));
-		  close (tunnel->out_fd);
-		  tunnel->out_fd = -1;
-		}
-	      else
-		{
-		  tunnel->bytes = 0;
-		  tunnel->buf_len = 0;
-		  tunnel->buf_ptr = tunnel->buf;
-#ifdef IO_COUNT_HTTP_HEADER
-		  tunnel->out_total_raw += strlen (str);
-		  log_annoying ("tunnel_accept: out_total_raw = %u",
-				tunnel->out_total_raw);
-#endif
-		  log_debug ("tunnel_accept: output connected");
-		}
-	    }
-	  else
+int
+tunnel_connection_multiplexed (Tunnel_connection *conn)
+{
+  int flags;
+
+  if (!tunnel_connection_opens (conn))
+    return FALSE;
+  flags = tunnel_connection_open_flags (conn);
+  return flags != -1 && (flags & OPEN_MULTIPLEX);
+}
+
+void
+tunnel_connection_destroy (Tunnel_connection *conn)
+{
+  if (conn->fd != -1)
+    close (conn->fd);
+  free (conn);
+}
+
+int
+tunnel_attach (Tunnel *tunnel, Tunnel_connection *conn)
+{
+  if (conn->request.method == HTTP_POST ||
+      conn->request.method == HTTP_PUT)
+    {
+      if (tunnel->in_fd == -1 && tunnel->next_in == NULL &&
+	  tunnel_in_is_next (tunnel, conn))
+	tunnel_in_attach (tunnel, conn);
+      else
+	{
+	  /* A POST carries data the client won't send again, so it's
+	     never turned away.  It's left unread in the queue until
+	     the ones before it are done. */
+	  tunnel_standby_queue (&tunnel->next_in, conn, 0);
+	  log_debug ("tunnel_attach: standby input connected");
+	  /* It may be the one the queue was waiting for. */
+	  tunnel_in_promote (tunnel);
+	}
+    }
+  else if (conn->request.method == HTTP_GET)
+    {
+      if (tunnel_is_disconnected (tunnel) && tunnel->next_out == NULL &&
+	  tunnel->out_queue_len == 0)
+	{
+	  /* CONN is used up even if this fails. */
+	  if (tunnel_out_attach (tunnel, conn) == 0)
 	    {
-	      log_error ("tunnel_accept: rejected tunnel_out: "
-			 "already got a connection");
-	      close (s);
+	      tunnel_out_send_pending (tunnel);
+	      tunnel_out_flush (tunnel);
 	    }
 	}
+      else if (tunnel_standby_queue (&tunnel->next_out, conn,
+				     STANDBY_MAX) == 0)
+	log_debug ("tunnel_attach: standby output connected");
       else
 	{
-	  log_error ("tunnel_accept: unknown header type");
-	  log_debug ("tunnel_accept: closing connection");
-	  close (s);
+	  log_error ("tunnel_attach: rejected tunnel_out: "
+		     "too many connections");
+	  return -1;
 	}
-
-      http_destroy_request (request);
     }
-
-  if (tunnel->in_fd == -1 || tunnel->out_fd == -1)
+  else
     {
-      log_error ("tunnel_accept: in_fd = %d, out_fd = %d",
-		 tunnel->in_fd, tunnel->out_fd);
-
-      if (tunnel->in_fd != -1)
-	close (tunnel->in_fd);
-      tunnel->in_fd = -1;
-      log_debug ("tunnel_accept: input disconnected");
-
-      tunnel_out_disconnect (tunnel);
-
+      log_error ("tunnel_attach: unknown header type");
+      errno = EINVAL;
       return -1;
     }
 
@@ -1240,21 +4172,9 @@ tunnel_accept (Tunnel *tunnel)
 }
 
 Tunnel *
-tunnel_new_server (const char *host, int port, size_t content_length)
+tunnel_new_server (size_t content_length)
 {
   Tunnel *tunnel;
-  struct in_addr addr;
-  struct hostent *hp;
-
-  if (host == NULL)
-    addr.s_addr = INADDR_ANY;
-  else if ((addr.s_addr = inet_addr (host)) == INADDR_NONE)
-    {
-      hp = gethostbyname (host);
-      if (hp == NULL || hp->h_addrtype != AF_INET)
-	return NULL;
-      memcpy (&addr, hp->h_addr, hp->h_length);
-    }
 
   tunnel = malloc (sizeof (Tunnel));
   if (tunnel == NULL)
@@ -1267,11 +4187,59 @@ tunnel_new_server (const char *host, int port, size_t content_length)
 
   tunnel->in_fd = -1;
   tunnel->out_fd = -1;
-  tunnel->server_socket = -1;
-  tunnel->dest.host_name = host;
-  tunnel->dest.host_port = port;
-  tunnel->buf_ptr = tunnel->buf;
+  tunnel->in_generation = 0;
+  tunnel->out_generation = 0;
+  tunnel->server = TRUE;
+  tunnel->next_in = NULL;
+  tunnel->next_out = NULL;
+  tunnel->in_sequence = 0;
+  tunnel->standby_fd = -1;
+  tunnel->standby_ready = FALSE;
+  tunnel->standby_bytes = 0;
+  tunnel->standby_threshold = 0;
+  tunnel->in_standby_fd = -1;
+  tunnel->in_standby_ready = FALSE;
+  tunnel->in_conn_bytes = 0;
+  tunnel->in_conn_length = 0;
+  tunnel->in_persistent = FALSE;
+  tunnel->out_persistent = FALSE;
+  tunnel->in_reuse_fd = -1;
+  tunnel->in_connect_fd = -1;
+  tunnel->in_connect_sent = FALSE;
+  tunnel->out_idle_fd = -1;
+  tunnel->out_connect_fd = -1;
+  tunnel->in_answered = FALSE;
+  tunnel->released = NULL;
+  tunnel->persistent = FALSE;
+  tunnel->chunked = FALSE;
+  tunnel->out_ended = FALSE;
+  tunnel->in_chunked = FALSE;
+  tunnel->pipe_fd[0] = tunnel->pipe_fd[1] = -1;
+  tunnel->pipe_len = 0;
+  tunnel->in_splice_left = 0;
+  tunnel->in_ending = FALSE;
+  tunnel->no_splice = FALSE;
+  tunnel->out_data_max = 65535;
+  tunnel->open_answer = FALSE;
+  tunnel->open_answered = FALSE;
+  tunnel->multiplex = FALSE;
+  tunnel->read_size = 4 * READ_SIZE_MIN;
+  tunnel->coalesce_window = 0;
+  tunnel->held = NULL;
+  tunnel->held_len = 0;
+  tunnel->dest.host_name = NULL;
+  tunnel->dest.host_port = -1;
+  tunnel->dest.proxy_authorization = NULL;
+  tunnel->dest.user_agent = NULL;
+  tunnel->dest.base_uri = NULL;
+  tunnel->dest.persistent = FALSE;
+  tunnel->dest.chunked = FALSE;
+  tunnel->dest.session = NULL;
+  tunnel->dest.sequence = 0;
+  tunnel->buf_ptr = NULL;
   tunnel->buf_len = 0;
+  tunnel->in_buf_start = 0;
+  tunnel->in_buf_len = 0;
   /* -1 to allow for TUNNEL_DISCONNECT */
   tunnel->content_length = content_length - 1;
   tunnel->in_total_raw = 0;
@@ -1280,15 +4248,28 @@ tunnel_new_server (const char *host, int port, size_t content_length)
   tunnel->out_total_data = 0;
   tunnel->strict_content_length = FALSE;
   tunnel->bytes = 0;
-
-  tunnel->server_socket = server_socket (addr, tunnel->dest.host_port, 1);
-  if (tunnel->server_socket == -1)
-    {
-      log_error ("tunnel_new_server: server_socket (%d) = -1",
-		 tunnel->dest.host_port);
-      tunnel_destroy (tunnel);
-      return NULL;
-    }
+  tunnel->out_iovcnt = 0;
+  tunnel->out_reqs = 0;
+  tunnel->out_pending = NULL;
+  tunnel->out_pending_len = 0;
+  tunnel->out_queue = NULL;
+  tunnel->out_queue_len = 0;
+  tunnel->out_queue_fd = -1;
+  tunnel->out_queue_keep = FALSE;
+  tunnel->to_queue = NULL;
+  tunnel->to_queue_len = 0;
+  tunnel->compress_level = 0;
+  tunnel->out_zdata = FALSE;
+#ifdef HAVE_LIBZ
+  tunnel->out_z = NULL;
+  tunnel->in_z = NULL;
+  tunnel->out_z_fresh = TRUE;
+  tunnel->in_z_fresh = TRUE;
+  tunnel->out_z_skip = 0;
+  tunnel->out_zbuf = NULL;
+  tunnel->out_zbuf_len = 0;
+  tunnel->in_zbuf = NULL;
+#endif
 
   return tunnel;
 }
@@ -1315,7 +4296,46 @@ tunnel_new_client (const char *host, int host_port,
 
   tunnel->in_fd = -1;
   tunnel->out_fd = -1;
-  tunnel->server_socket = -1;
+  tunnel->in_generation = 0;
+  tunnel->out_generation = 0;
+  tunnel->server = FALSE;
+  tunnel->next_in = NULL;
+  tunnel->next_out = NULL;
+  tunnel->in_sequence = 0;
+  tunnel->standby_fd = -1;
+  tunnel->standby_ready = FALSE;
+  tunnel->standby_bytes = 0;
+  tunnel->standby_threshold = 0;
+  tunnel->in_standby_fd = -1;
+  tunnel->in_standby_ready = FALSE;
+  tunnel->in_conn_bytes = 0;
+  tunnel->in_conn_length = 0;
+  tunnel->in_persistent = FALSE;
+  tunnel->out_persistent = FALSE;
+  tunnel->in_reuse_fd = -1;
+  tunnel->in_connect_fd = -1;
+  tunnel->in_connect_sent = FALSE;
+  tunnel->out_idle_fd = -1;
+  tunnel->out_connect_fd = -1;
+  tunnel->in_answered = FALSE;
+  tunnel->released = NULL;
+  tunnel->persistent = FALSE;
+  tunnel->chunked = FALSE;
+  tunnel->out_ended = FALSE;
+  tunnel->in_chunked = FALSE;
+  tunnel->pipe_fd[0] = tunnel->pipe_fd[1] = -1;
+  tunnel->pipe_len = 0;
+  tunnel->in_splice_left = 0;
+  tunnel->in_ending = FALSE;
+  tunnel->no_splice = FALSE;
+  tunnel->out_data_max = 65535;
+  tunnel->open_answer = FALSE;
+  tunnel->open_answered = FALSE;
+  tunnel->multiplex = FALSE;
+  tunnel->read_size = 4 * READ_SIZE_MIN;
+  tunnel->coalesce_window = 0;
+  tunnel->held = NULL;
+  tunnel->held_len = 0;
   tunnel->dest.host_name = host;
   tunnel->dest.host_port = host_port;
   tunnel->dest.proxy_name = proxy;
@@ -1323,16 +4343,45 @@ tunnel_new_client (const char *host, int host_port,
   tunnel->dest.proxy_authorization = NULL;
   tunnel->dest.user_agent = NULL;
   tunnel->dest.base_uri = NULL;
+  tunnel->dest.persistent = FALSE;
+  tunnel->dest.chunked = FALSE;
+  tunnel_new_token (tunnel->token);
+  tunnel->dest.session = tunnel->token;
+  tunnel->dest.sequence = 0;
   /* -1 to allow for TUNNEL_DISCONNECT */
   tunnel->content_length = content_length - 1;
-  tunnel->buf_ptr = tunnel->buf;
+  tunnel->buf_ptr = NULL;
   tunnel->buf_len = 0;
+  tunnel->in_buf_start = 0;
+  tunnel->in_buf_len = 0;
   tunnel->in_total_raw = 0;
   tunnel->in_total_data = 0;
   tunnel->out_total_raw = 0;
   tunnel->out_total_data = 0;
   tunnel->strict_content_length = FALSE;
   tunnel->bytes = 0;
+  tunnel->out_iovcnt = 0;
+  tunnel->out_reqs = 0;
+  tunnel->out_pending = NULL;
+  tunnel->out_pending_len = 0;
+  tunnel->out_queue = NULL;
+  tunnel->out_queue_len = 0;
+  tunnel->out_queue_fd = -1;
+  tunnel->out_queue_keep = FALSE;
+  tunnel->to_queue = NULL;
+  tunnel->to_queue_len = 0;
+  tunnel->compress_level = 0;
+  tunnel->out_zdata = FALSE;
+#ifdef HAVE_LIBZ
+  tunnel->out_z = NULL;
+  tunnel->in_z = NULL;
+  tunnel->out_z_fresh = TRUE;
+  tunnel->in_z_fresh = TRUE;
+  tunnel->out_z_skip = 0;
+  tunnel->out_zbuf = NULL;
+  tunnel->out_zbuf_len = 0;
+  tunnel->in_zbuf = NULL;
+#endif
 
   if (tunnel->dest.proxy_name == NULL)
     {
@@ -1358,11 +4407,48 @@ tunnel_new_client (const char *host, int host_port,
 void
 tunnel_destroy (Tunnel *tunnel)
 {
-  if (tunnel_is_connected (tunnel) || tunnel->in_fd != -1)
+  if (tunnel_is_connected (tunnel) || tunnel->in_fd != -1 ||
+      tunnel->next_in != NULL || tunnel->next_out != NULL ||
+      tunnel->standby_fd != -1 || tunnel->in_standby_fd != -1 ||
+      tunnel->out_idle_fd != -1 || tunnel->in_reuse_fd != -1 ||
+      tunnel->in_connect_fd != -1 || tunnel->released != NULL)
     tunnel_close (tunnel);
 
-  if (tunnel->server_socket != -1)
-    close (tunnel->server_socket);
+  if (tunnel->out_pending)
+    free (tunnel->out_pending);
+
+  /* Output still queued for a connection that has ended is lost. */
+  if (tunnel->out_queue_fd != -1 && tunnel->out_queue_fd != tunnel->out_fd)
+    close (tunnel->out_queue_fd);
+  if (tunnel->out_queue)
+    free (tunnel->out_queue);
+
+  if (tunnel->to_queue)
+    free (tunnel->to_queue);
+
+  if (tunnel->held)
+    free (tunnel->held);
+
+#ifdef HAVE_LIBZ
+  if (tunnel->out_z)
+    {
+      deflateEnd (tunnel->out_z);
+      free (tunnel->out_z);
+    }
+  if (tunnel->in_z)
+    {
+      inflateEnd (tunnel->in_z);
+      free (tunnel->in_z);
+    }
+  if (tunnel->out_zbuf)
+    free (tunnel->out_zbuf);
+  if (tunnel->in_zbuf)
+    free (tunnel->in_zbuf);
+#endif
+
+#ifdef HAVE_SPLICE
+  tunnel_pipe_close (tunnel);
+#endif
 
   if (tunnel->dest.proxy_authorization)
     free ((char *)tunnel->dest.proxy_authorization);
@@ -1400,6 +4486,78 @@ tunnel_opt (Tunnel *tunnel, const char *opt, void *data, int get_flag)
       else
 	tunnel->max_connection_age = *(int *)data;
     }
+  else if (strcmp (opt, "persistent") == 0)
+    {
+      if (get_flag)
+	*(int *)data = tunnel->persistent;
+      else
+	{
+	  /* Messages must fill their Content-Length to be followed by
+	     another on the same connection. */
+	  tunnel->persistent = *(int *)data;
+	  tunnel->dest.persistent = *(int *)data;
+	  if (tunnel->persistent)
+	    tunnel->strict_content_length = TRUE;
+	}
+    }
+  else if (strcmp (opt, "chunked") == 0)
+    {
+      if (get_flag)
+	*(int *)data = tunnel->chunked;
+      else
+	{
+	  tunnel->chunked = *(int *)data;
+	  tunnel->dest.chunked = *(int *)data;
+	}
+    }
+  else if (strcmp (opt, "coalesce_window") == 0)
+    {
+      if (get_flag)
+	*(int *)data = tunnel->coalesce_window;
+      else if (*(int *)data < 0 || *(int *)data > TUNNEL_COALESCE_MAX ||
+	       (*(int *)data > 0 && !tunnel_is_client (tunnel)))
+	{
+	  errno = EINVAL;
+	  return -1;
+	}
+      else
+	tunnel->coalesce_window = *(int *)data;
+    }
+  else if (strcmp (opt, "compression") == 0)
+    {
+      if (get_flag)
+	*(int *)data = tunnel->compress_level;
+      else if (*(int *)data < 0 || *(int *)data > 9)
+	{
+	  errno = EINVAL;
+	  return -1;
+	}
+#ifndef HAVE_LIBZ
+      else if (*(int *)data > 0)
+	{
+	  errno = ENOSYS;
+	  return -1;
+	}
+#endif
+      else
+	tunnel->compress_level = *(int *)data;
+    }
+  else if (strcmp (opt, "multiplex") == 0)
+    {
+      /* A client doesn't know until the server has answered. */
+      if (get_flag)
+	*(int *)data = (tunnel_is_client (tunnel) && tunnel->multiplex &&
+			!tunnel->open_answered) ? -1 : tunnel->multiplex;
+      else
+	tunnel->multiplex = *(int *)data;
+    }
+  else if (strcmp (opt, "standby_threshold") == 0)
+    {
+      if (get_flag)
+	*(int *)data = tunnel->standby_threshold;
+      else
+	tunnel->standby_threshold = *(int *)data;
+    }
   else if (strcmp (opt, "proxy_authorization") == 0)
     {
       if (get_flag)
@@ -14,32 +14,210 @@ Tunnel *tunnel_new_client (const char *host, int host_port,
 
   Create a new HTTP tunnel client.
 
-Tunnel *tunnel_new_server (const char *host, int port,
-			   size_t content_length);
+Tunnel *tunnel_new_server (size_t content_length);
 
   Create a new HTTP tunnel server.  If CONTENT_LENGTH is 0, the
   Content-Length of the HTTP GET response will be determined
-  automatically in some way.  If HOST is not NULL, use it to bind the
-  server socket to a specific network interface.
+  automatically in some way.  The server doesn't accept connections
+  itself; they are given to it with tunnel_attach(), so one process
+  can serve many tunnels.
 
 int tunnel_connect (Tunnel *tunnel);
 
-  Open the tunnel.  (Client only.)
+  Open the tunnel, or go on opening it, without waiting for the
+  network.  Return 1 once the server has answered, 0 with errno EAGAIN
+  while it hasn't yet, or -1 on error.  Meanwhile, call it again when
+  tunnel_pollin_fd() polls ready for tunnel_pollin_events().  Its
+  request is written by tunnel_flush().  (Client only.)
+
+int tunnel_listen (const char *host, int port);
+
+  Return a socket listening for tunnel connections at PORT, or -1.
+  If HOST is not NULL, use it to bind the socket to a specific network
+  interface.
+
+int tunnel_listen_workers (const char *host, int port, int *fds, int n);
+
+  Like tunnel_listen(), but make N sockets listening on PORT, and put
+  them in FDS, so that N processes can accept tunnel connections each
+  on its own.  The kernel spreads the connections over the sockets,
+  so a connection may reach a process that doesn't serve its tunnel;
+  see tunnel_connection_send().  Return 0, or -1 on error.
+
+Tunnel_connection *tunnel_connection_accept (int fd);
+
+  Accept a connection on the listening socket FD.  The HTTP request
+  header is read later with tunnel_connection_read().
+
+int tunnel_connection_read (Tunnel_connection *conn);
+
+  Read the request header of CONN.  Make only one read(), so it's
+  safe to call whenever tunnel_connection_fd() polls readable.  Return
+  1 when the connection is ready to be attached to a tunnel, 0 if the
+  peer closed the connection, or -1 on error.  EAGAIN means that more
+  input is needed.
+
+int tunnel_connection_send (Tunnel_connection *conn, int sock);
+
+  Pass CONN to another process through the Unix domain socket SOCK,
+  along with what has been read from it.  The caller still owns CONN,
+  and should destroy it, which leaves the other process's copy open.
+  Return 0, or -1 on error.  SOCK isn't blocked on; EAGAIN means that
+  the other process is behind.
+
+Tunnel_connection *tunnel_connection_receive (int sock);
+
+  Receive a connection passed with tunnel_connection_send(), or
+  return NULL.  Its request header is read again with
+  tunnel_connection_read(), from what was passed along with it.
+
+int tunnel_connection_fd (Tunnel_connection *conn);
+
+  Return the socket of CONN.
+
+const char *tunnel_connection_key (Tunnel_connection *conn);
 
-int tunnel_accept (Tunnel *tunnel);
+  Return a string identifying the tunnel that CONN belongs to.  This
+  is the session token that clients put in the request URI, or the
+  peer address for clients that don't.
 
-  Accept a tunnel connection.  (Server only.)
+int tunnel_connection_opens (Tunnel_connection *conn);
+
+  Return nonzero if CONN is the first connection of a new tunnel.
+
+int tunnel_connection_multiplexed (Tunnel_connection *conn);
+
+  Return nonzero if CONN opens a new tunnel, and the client asks to
+  carry many streams in it.  See the multiplex option.
+
+void tunnel_connection_destroy (Tunnel_connection *conn);
+
+  Close CONN and free it.
+
+int tunnel_attach (Tunnel *tunnel, Tunnel_connection *conn);
+
+  Give CONN to the tunnel, which then owns it.  A connection received
+  before the current one in the same direction has ended is kept as
+  standby, and used when the current one ends.  Return -1 if the
+  tunnel can't use CONN.  (Server only.)
+
+  Only a few GETs are kept as standby.  A POST is always kept, since
+  the client won't send its data again; it's left unread until the
+  POSTs before it are done.
+
+Tunnel_connection *tunnel_released (Tunnel *tunnel);
+
+  Return a persistent connection which the tunnel is done with, or
+  NULL if there is none.  The caller owns it, and should read the
+  next request on it with tunnel_connection_read(), since it may
+  belong to another tunnel.  (Server only.)
 
 int tunnel_pollin_fd (Tunnel *tunnel);
 
   Return a file descriptor that can be used to poll for input from
-  the tunnel.
+  the tunnel.  A server returns -1 while it waits for the client to
+  connect.  A client that is connecting the input returns the new
+  connection; tunnel_read() goes on connecting it.
+
+int tunnel_pollin_events (Tunnel *tunnel);
+
+  Return the poll() events to wait for on tunnel_pollin_fd(): POLLOUT
+  while a client's input connection is being made, else POLLIN.
+
+unsigned int tunnel_pollin_generation (Tunnel *tunnel);
+
+  Return a number that changes whenever the descriptor returned by
+  tunnel_pollin_fd() is replaced.  A new descriptor may reuse the
+  number of the old one, so callers that register it with an event
+  loop should check this too.
+
+int tunnel_can_write (Tunnel *tunnel);
+
+  Return nonzero if tunnel_write() can send data right away.  A
+  server can't while it waits for the client to connect, and a client
+  can't while the previous POST has output queued; data written
+  meanwhile is kept until then.  Neither can while more than
+  TUNNEL_QUEUE_MAX bytes of output are queued; see tunnel_flush().
+
+int tunnel_is_attached (Tunnel *tunnel);
+
+  Return nonzero if the client is connected in both directions.  A
+  client is once the server has answered it; see tunnel_connect().
 
 ssize_t tunnel_read (Tunnel *tunnel, void *data, size_t length);
 ssize_t tunnel_write (Tunnel *tunnel, void *data, size_t length);
 
   Read or write to the tunnel.  Same semantics as read() and write().
-  Watch out for return values less than LENGTH.
+  Watch out for return values less than LENGTH.  tunnel_write()
+  never blocks: output the peer is slow to take, or that waits for a
+  client's POST to be connected, is queued, to be written by
+  tunnel_flush().
+
+ssize_t tunnel_read_to (Tunnel *tunnel, int fd, size_t length);
+ssize_t tunnel_write_from (Tunnel *tunnel, int fd, size_t length);
+
+  Like tunnel_read() and tunnel_write(), but the data is written to,
+  or read from, FD.  Where splice() is available, large amounts of
+  data are moved between FD and the tunnel connection without being
+  copied through user space.  tunnel_read_to() returns the number of
+  bytes written to FD, and tunnel_write_from() returns as read().
+
+  Up to TUNNEL_DATA_MAX bytes are moved at a time, and sent in one
+  request if the peer takes it.  Peers negotiate this when the tunnel
+  is opened; with an older peer, a request holds at most 65535 bytes.
+  tunnel_write_from() reads less than LENGTH unless reads keep
+  filling what's asked for, so that interactive traffic makes small
+  reads and bulk transfers large ones.
+
+  tunnel_read_to() doesn't block if FD is nonblocking.  What FD won't
+  take is queued in the tunnel instead.  While more than
+  TUNNEL_QUEUE_MAX bytes are queued, tunnel_read_to() reads nothing
+  from the tunnel and fails with EAGAIN.
+
+size_t tunnel_held (Tunnel *tunnel);
+ssize_t tunnel_write_held (Tunnel *tunnel);
+
+  With the coalesce_window option, tunnel_write_from() doesn't send
+  a read that doesn't fill a request, but holds it back for the next
+  reads to add to.  tunnel_held() returns the number of bytes held,
+  and tunnel_write_held() sends them like tunnel_write().  Data is
+  then always copied rather than spliced.
+
+ssize_t tunnel_flush_to (Tunnel *tunnel, int fd);
+
+  Write the data that tunnel_read_to() has queued to FD, for instance
+  when FD polls writable.  Return the number of bytes still queued, or
+  -1 on error.
+
+int tunnel_pollout_fd (Tunnel *tunnel);
+ssize_t tunnel_flush (Tunnel *tunnel);
+
+  Return the descriptor which output is queued for, or a client's POST
+  that is being connected, or -1 if there is none.  When it polls
+  writable, tunnel_flush() sends the POST header, writes what the
+  connection takes of the queue, and returns the number of bytes
+  still queued, or -1 on error.  The connection may have ended with
+  output queued, and is closed when the queue is written.  Output
+  queued by tunnel_close() is written like this too, before
+  tunnel_destroy().
+
+unsigned int tunnel_pollout_generation (Tunnel *tunnel);
+
+  Return a number that changes whenever a new connection is used for
+  output.  Like tunnel_pollin_generation(), it tells a caller that
+  tunnel_pollout_fd() is another descriptor with the same number.
+
+size_t tunnel_queued (Tunnel *tunnel);
+
+  Return the number of bytes queued by tunnel_read_to().
+
+int tunnel_pending (Tunnel *tunnel);
+
+  Return nonzero if tunnel data has already been received and can be
+  read with tunnel_read() without polling tunnel_pollin_fd() first.
+  Input is read from the network in large chunks, so after a
+  tunnel_read() more data may be waiting in the tunnel's buffer.
+  Return zero while tunnel_read_to() has too much queued to read it.
 
 int tunnel_padding (Tunnel *tunnel, size_t length);
 
@@ -71,6 +249,56 @@ int tunnel_getopt (Tunnel *tunnel, const char *opt, void *data);
     DATA must be a pointer to an int.  The int specifies the maximum
     time a connection will be kept open, in seconds.
 
+  * persistent
+
+    DATA must be a pointer to an int.  If the int is nonzero, the
+    client asks for persistent HTTP/1.1 connections, and sends the
+    next POST or GET on a connection when the previous one is done.
+    This implies strict_content_length.  (Client only; a server keeps
+    connections that the client asks it to.)
+
+  * chunked
+
+    DATA must be a pointer to an int.  If the int is nonzero, the
+    client sends POST bodies with chunked Transfer-Encoding, each
+    write to the network becoming a chunk, and the server answers with
+    chunked GET responses.  Connections are then not ended when
+    Content-Length bytes have been sent, and aren't padded.  (Client
+    only; a server follows the client.)
+
+  * coalesce_window
+
+    DATA must be a pointer to an int, up to TUNNEL_COALESCE_MAX.  If
+    the int is nonzero, tunnel_write_from() holds back reads that
+    don't fill a request, and the caller sends them with
+    tunnel_write_held() once this many microseconds have passed since
+    tunnel_held() became nonzero.  Zero, the default, sends every read
+    right away.  (Client only.)
+
+  * multiplex
+
+    DATA must be a pointer to an int.  A client sets it nonzero before
+    tunnel_connect() to ask the server to carry many streams in the
+    tunnel, as framed by mux.h.  A server sets it to agree.  On the
+    client it reads as 1 once the server has agreed, 0 if it didn't,
+    and -1 until the server has answered.  The tunnel itself passes
+    the stream frames along as any other data.
+
+  * compression
+
+    DATA must be a pointer to an int from 0 to 9, the zlib level at
+    which tunnel_write() compresses data, if the peer can decompress
+    it.  Zero, the default, disables this.  Data that doesn't compress
+    is sent as it is, and padding is never compressed.  Setting a
+    level fails with ENOSYS if zlib isn't available.
+
+  * standby_threshold
+
+    DATA must be a pointer to an int.  When this percentage of
+    Content-Length has been sent in a POST, or received in a GET, the
+    next one is connected in the background, so that it's ready when
+    the current one is used up.  Zero disables this.  (Client only.)
+
   * proxy_authorization
 
     DATA must be a pointer to a char pointer.  The char pointer
@@ -112,19 +340,49 @@ void tunnel_destroy (Tunnel *tunnel);
 #include <sys/types.h>
 
 #define DEFAULT_CONNECTION_MAX_TIME 300
+#define TUNNEL_DATA_MAX (256 * 1024) /* bytes in one request */
+#define TUNNEL_QUEUE_MAX TUNNEL_DATA_MAX /* see tunnel_read_to() */
+#define TUNNEL_COALESCE_MAX 10000 /* microseconds, see coalesce_window */
 
 typedef struct tunnel Tunnel;
+typedef struct tunnel_connection Tunnel_connection;
 
 extern Tunnel *tunnel_new_client (const char *host, int host_port,
 				  const char *proxy, int proxy_port,
 				  size_t content_length);
-extern Tunnel *tunnel_new_server (const char *host, int port,
-                                  size_t content_length);
+extern Tunnel *tunnel_new_server (size_t content_length);
 extern int tunnel_connect (Tunnel *tunnel);
-extern int tunnel_accept (Tunnel *tunnel);
+extern int tunnel_listen (const char *host, int port);
+extern int tunnel_listen_workers (const char *host, int port,
+				  int *fds, int n);
+extern Tunnel_connection *tunnel_connection_accept (int fd);
+extern int tunnel_connection_read (Tunnel_connection *conn);
+extern int tunnel_connection_send (Tunnel_connection *conn, int sock);
+extern Tunnel_connection *tunnel_connection_receive (int sock);
+extern int tunnel_connection_fd (Tunnel_connection *conn);
+extern const char *tunnel_connection_key (Tunnel_connection *conn);
+extern int tunnel_connection_opens (Tunnel_connection *conn);
+extern int tunnel_connection_multiplexed (Tunnel_connection *conn);
+extern void tunnel_connection_destroy (Tunnel_connection *conn);
+extern int tunnel_attach (Tunnel *tunnel, Tunnel_connection *conn);
 extern int tunnel_pollin_fd (Tunnel *tunnel);
+extern int tunnel_pollin_events (Tunnel *tunnel);
+extern unsigned int tunnel_pollin_generation (Tunnel *tunnel);
+extern Tunnel_connection *tunnel_released (Tunnel *tunnel);
+extern int tunnel_can_write (Tunnel *tunnel);
+extern int tunnel_is_attached (Tunnel *tunnel);
 extern ssize_t tunnel_read (Tunnel *tunnel, void *data, size_t length);
 extern ssize_t tunnel_write (Tunnel *tunnel, void *data, size_t length);
+extern ssize_t tunnel_read_to (Tunnel *tunnel, int fd, size_t length);
+extern ssize_t tunnel_write_from (Tunnel *tunnel, int fd, size_t length);
+extern size_t tunnel_held (Tunnel *tunnel);
+extern ssize_t tunnel_write_held (Tunnel *tunnel);
+extern ssize_t tunnel_flush_to (Tunnel *tunnel, int fd);
+extern int tunnel_pollout_fd (Tunnel *tunnel);
+extern unsigned int tunnel_pollout_generation (Tunnel *tunnel);
+extern ssize_t tunnel_flush (Tunnel *tunnel);
+extern size_t tunnel_queued (Tunnel *tunnel);
+extern int tunnel_pending (Tunnel *tunnel);
 extern ssize_t tunnel_padding (Tunnel *tunnel, size_t length);
 extern int tunnel_maybe_pad (Tunnel *tunnel, size_t length);
 extern int tunnel_setopt (Tunnel *tunnel, const char *opt, void *data);